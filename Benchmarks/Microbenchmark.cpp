@@ -0,0 +1,434 @@
+/* -------------------------------------------------------------------------------------------------
+Copyright 2017 Shealyn Tate Hindenlang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+-------------------------------------------------------------------------------------------------
+*/
+#include "stdafx.h"
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <random>
+
+#include "Scene.h"
+
+/* -------------------------------------------------------------------------------------------------
+   Microbenchmarks for the tracer's hot paths. Every kernel runs over the same fixed set of random
+   rays (the generator is seeded, so each run and each build sees identical input) and is timed as
+   the best of several passes, which filters out most of the noise from the rest of the machine.
+   Results are reported as nanoseconds per call and millions of rays per second, along with a
+   checksum of the kernel's output so a change that alters results doesn't pass for a speed up.
+   Creating objects in an arena is also timed for a small and a large scene, and the ratio of their
+   cost per object reported; it stays near 1 as long as loading large scenes is linear.
+   Usage:
+		Microbenchmark [--rays <int>] [--repeats <int>] [name filter]
+   -------------------------------------------------------------------------------------------------
+*/
+
+#pragma region Benchmark Setup
+
+static const unsigned RANDOM_SEED = 20170301;
+static const int GRID_SPHERES = 256;
+static const int GRID_TRIANGLES = 4096;
+
+// Objects created per pass for the small and large arena loads
+static const int ARENA_SMALL_LOAD = 1 << 14;
+static const int ARENA_LARGE_LOAD = 1 << 16;
+
+// Occlusion queries stop at the middle of the scene, like a light placed at the origin
+static const float OCCLUSION_DISTANCE = 6.0f;
+
+struct BenchmarkOptions
+{
+	int rays = 1 << 16;
+	int repeats = 5;
+	std::string filter;
+};
+
+/* -------------------------------------------------------------------------------------------------
+   Rays start on a sphere of radius 6 around the origin and aim at a random point within 1.5 of it,
+   so roughly half of them hit the unit sized test primitives and the rest just miss.
+   -------------------------------------------------------------------------------------------------
+*/
+std::vector<Ray> randomRays(int count, std::mt19937& random)
+{
+	std::uniform_real_distribution<float> unit{ -1.0f, 1.0f };
+	std::vector<Ray> rays;
+	rays.reserve(count);
+
+	while ((int)rays.size() < count)
+	{
+		Vector<3> origin{ unit(random), unit(random), unit(random) };
+		if (origin.magnitude() < 0.01f)
+			continue;
+
+		Vector<3> target{ unit(random) * 1.5f, unit(random) * 1.5f, unit(random) * 1.5f };
+		origin = origin.normal() * 6.0f;
+		rays.push_back(Ray{ origin, (target - origin).normal() });
+	}
+
+	return rays;
+}
+
+TriangleMesh* randomMesh(int triangles, float extent, std::mt19937& random)
+{
+	std::uniform_real_distribution<float> position{ -extent, extent };
+	std::uniform_real_distribution<float> offset{ -0.3f, 0.3f };
+	TriangleMesh *mesh = new TriangleMesh(0);
+
+	for (int i = 0; i < triangles; ++i)
+	{
+		Vector<3> center{ position(random), position(random), position(random) };
+		int v[3];
+
+		for (int k = 0; k < 3; ++k)
+			v[k] = mesh->addVertex(center + Vector<3>{ offset(random), offset(random), offset(random) });
+
+		mesh->addTriangle(v[0], v[1], v[2]);
+	}
+
+	mesh->generateBoundingBox(Matrix<4, 4>{});
+	return mesh;
+}
+
+Sphere* makeSphere(Vector<3> center, float radius)
+{
+	auto offset = Matrix<4, 4>::Translation(center);
+	auto scale = Matrix<4, 4>::Scale(Vector<3>{ radius, radius, radius });
+	Sphere *sphere = new Sphere(Vector<3>{}, 1.0f, 0, scale.inverse() * offset.inverse());
+	sphere->generateBoundingBox(offset * scale);
+
+	return sphere;
+}
+
+#pragma endregion
+
+#pragma region Benchmark Runner
+
+/* -------------------------------------------------------------------------------------------------
+   Times one kernel. A pass calls the kernel once, which processes the whole ray set and returns a
+   checksum of what it computed; the fastest of the repeated passes is reported. Returns nanoseconds
+   per op, or 0 if the filter skipped the kernel.
+   -------------------------------------------------------------------------------------------------
+*/
+double runBenchmark(const BenchmarkOptions& options, const std::string& name, int ops,
+	const std::function<double()>& kernel)
+{
+	if (!options.filter.empty() && name.find(options.filter) == std::string::npos)
+		return 0;
+
+	double best = 0, checksum = 0;
+
+	// The first pass warms the caches and isn't timed
+	checksum = kernel();
+
+	for (int i = 0; i < options.repeats; ++i)
+	{
+		Timer timer;
+		checksum = kernel();
+		double elapsed = timer.elapsed();
+
+		if (i == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	double nsPerOp = (best * 1.0e9) / ops;
+	double mraysPerSecond = (best > 0) ? ops / best / 1.0e6 : 0;
+
+	std::cout << std::left << std::setw(30) << name << std::right
+		<< std::fixed << std::setprecision(2) << std::setw(12) << nsPerOp
+		<< std::setw(12) << mraysPerSecond
+		<< std::setprecision(4) << std::setw(18) << checksum << "\n";
+
+	return nsPerOp;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   One op creates a sphere in an arena the way the scene parser does, with every pass loading a
+   fresh arena of the given size.
+   -------------------------------------------------------------------------------------------------
+*/
+double runArenaLoad(const BenchmarkOptions& options, int objects)
+{
+	return runBenchmark(options, "Arena::create x" + std::to_string(objects), objects, [&]()
+	{
+		Arena arena;
+		for (int i = 0; i < objects; ++i)
+			arena.create<Sphere>(Vector<3>{ (float)i, 0, 0 }, 1.0f, 0, Matrix<4, 4>{});
+		return (double)arena.bytes();
+	});
+}
+
+#pragma endregion
+
+int main(int argc, char *argv[])
+{
+	BenchmarkOptions options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--rays") && i + 1 < argc)
+			options.rays = std::max(atoi(argv[++i]), 1);
+		else if (!strcmp(argv[i], "--repeats") && i + 1 < argc)
+			options.repeats = std::max(atoi(argv[++i]), 1);
+		else if (argv[i][0] == '-')
+		{
+			std::cout << "Usage: Microbenchmark [--rays <int>] [--repeats <int>] [name filter]" << std::endl;
+			return 1;
+		}
+		else
+			options.filter = argv[i];
+	}
+
+	std::mt19937 random{ RANDOM_SEED };
+	std::uniform_real_distribution<float> unit{ -1.0f, 1.0f };
+	const std::vector<Ray> rays = randomRays(options.rays, random);
+	const int n = (int)rays.size();
+
+	std::cout << "Timing " << n << " rays per pass, best of " << options.repeats << " passes\n\n";
+	std::cout << std::left << std::setw(30) << "kernel" << std::right << std::setw(12) << "ns/op"
+		<< std::setw(12) << "Mrays/s" << std::setw(18) << "checksum" << "\n";
+
+	// Single primitives
+	Sphere *sphere = makeSphere(Vector<3>{ 0.1f, -0.2f, 0.0f }, 1.2f);
+	Triangle triangle{ Vector<3>{ -1.5f, -1.0f, 0.2f }, Vector<3>{ 1.5f, -1.0f, -0.2f },
+		Vector<3>{ 0.0f, 1.5f, 0.0f }, 0, Matrix<4, 4>{} };
+	TriangleMesh *mesh = randomMesh(1024, 1.5f, random);
+	BoundingBox box;
+
+	runBenchmark(options, "Sphere::hit", n, [&]()
+	{
+		ShaderData sd;
+		double hits = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			float t = MAX_T;
+			if (sphere->hit(rays[i], t, sd))
+				hits += t;
+		}
+		return hits;
+	});
+
+	runBenchmark(options, "Sphere::occluded", n, [&]()
+	{
+		double hits = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			if (sphere->occluded(rays[i], OCCLUSION_DISTANCE))
+				hits += 1;
+		}
+		return hits;
+	});
+
+	runBenchmark(options, "Triangle::hit", n, [&]()
+	{
+		ShaderData sd;
+		double hits = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			float t = MAX_T;
+			if (triangle.hit(rays[i], t, sd))
+				hits += t;
+		}
+		return hits;
+	});
+
+	runBenchmark(options, "TriangleMesh::hitPrimitive", n, [&]()
+	{
+		ShaderData sd;
+		int triangles = mesh->primitiveCount();
+		double hits = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			float t = MAX_T;
+			if (mesh->hitPrimitive(i % triangles, rays[i], t, sd))
+				hits += t;
+		}
+		return hits;
+	});
+
+	runBenchmark(options, "BoundingBox::hit", n, [&]()
+	{
+		double hits = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			if (box.hit(rays[i]))
+				hits += 1;
+		}
+		return hits;
+	});
+
+	// One op is a ray against a full group of boxes
+	BoxGroup group;
+	for (int lane = 0; lane < BOX_GROUP_SIZE; ++lane)
+	{
+		Vector<3> min{ unit(random), unit(random), unit(random) };
+		group.setBox(lane, min, min + Vector<3>{ 0.5f, 0.5f, 0.5f });
+	}
+
+	runBenchmark(options, "hitBoxGroup x" + std::to_string(BOX_GROUP_SIZE), n, [&]()
+	{
+		double hits = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			PrecomputedRay pray{ rays[i] };
+			unsigned mask = hitBoxGroup(group, pray, MAX_T);
+			while (mask)
+			{
+				hits += 1;
+				mask &= mask - 1;
+			}
+		}
+		return hits;
+	});
+
+	// Acceleration structure over a cluttered scene
+	std::vector<Geometry*> objects;
+	std::uniform_real_distribution<float> position{ -3.0f, 3.0f };
+	for (int i = 0; i < GRID_SPHERES; ++i)
+		objects.push_back(makeSphere(Vector<3>{ position(random), position(random), position(random) }, 0.15f));
+	objects.push_back(randomMesh(GRID_TRIANGLES, 3.0f, random));
+
+	Grid grid;
+	for (auto geo = objects.begin(); geo != objects.end(); ++geo)
+		grid.addGeometry(*geo);
+	if (!grid.build())
+	{
+		std::cout << "Unable to build the grid" << std::endl;
+		return 1;
+	}
+
+	runBenchmark(options, "Grid::hit", n, [&]()
+	{
+		ShaderData sd;
+		double hits = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			float t = MAX_T;
+			if (grid.hit(rays[i], t, sd))
+				hits += t;
+		}
+		return hits;
+	});
+
+	runBenchmark(options, "Grid::occluded", n, [&]()
+	{
+		double hits = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			if (grid.occluded(rays[i], OCCLUSION_DISTANCE))
+				hits += 1;
+		}
+		return hits;
+	});
+
+	BoundingVolumeHierarchy bvh;
+	for (auto geo = objects.begin(); geo != objects.end(); ++geo)
+		bvh.addGeometry(*geo);
+	if (!bvh.build())
+	{
+		std::cout << "Unable to build the BVH" << std::endl;
+		return 1;
+	}
+
+	runBenchmark(options, "BVH::hit", n, [&]()
+	{
+		ShaderData sd;
+		double hits = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			float t = MAX_T;
+			if (bvh.hit(rays[i], t, sd))
+				hits += t;
+		}
+		return hits;
+	});
+
+	runBenchmark(options, "BVH::occluded", n, [&]()
+	{
+		double hits = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			if (bvh.occluded(rays[i], OCCLUSION_DISTANCE))
+				hits += 1;
+		}
+		return hits;
+	});
+
+	// Shading of precomputed hit points
+	Material material;
+	material.setkd(Color{ 0.6f, 0.4f, 0.3f });
+	material.setks(Color{ 0.5f, 0.5f, 0.5f });
+	material.setexp(40.0f);
+	Point light{ 1.0f, Color{ 1.0f, 1.0f, 1.0f }, Vector<3>{ 4.0f, 6.0f, 5.0f } };
+
+	std::vector<ShaderData> hits(n);
+	for (int i = 0; i < n; ++i)
+	{
+		Vector<3> normal{ unit(random), unit(random), unit(random) };
+		hits[i].setRay(rays[i]);
+		hits[i].setHitPoint(rays[i].origin + rays[i].direction * 5.0f);
+		hits[i].setNormal(normal.magnitude() > 0 ? normal.normal() : Vector<3>{ 0, 1, 0 });
+	}
+
+	runBenchmark(options, "Material::diffuse", n, [&]()
+	{
+		Color sum;
+		for (int i = 0; i < n; ++i)
+			sum += material.diffuse(hits[i], &light);
+		return (double)(sum.r + sum.g + sum.b);
+	});
+
+	runBenchmark(options, "Material::specular", n, [&]()
+	{
+		Color sum;
+		for (int i = 0; i < n; ++i)
+			sum += material.specular(hits[i], &light);
+		return (double)(sum.r + sum.g + sum.b);
+	});
+
+	// Primary ray generation for a 640x480 film
+	Camera camera{ Vector<3>{}, PERSPECTIVE };
+	camera.setTransform(Matrix<4, 4>::Translation(Vector<3>{ 0, 0, 5 }));
+	Sampler sampler{ Vector<3>{ 0, 0, -1 }, 640, 480, 0.55f, 0.41f };
+
+	runBenchmark(options, "Camera::generateRay", n, [&]()
+	{
+		double sum = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			Sample sample{ i % 640, (i / 640) % 480 };
+			Ray r = camera.generateRay(sampler.getPoint(sample), sample);
+			sum += r.direction[0];
+		}
+		return sum;
+	});
+
+	// Scene loading, which has to stay linear in the number of objects
+	double smallLoad = runArenaLoad(options, ARENA_SMALL_LOAD);
+	double largeLoad = runArenaLoad(options, ARENA_LARGE_LOAD);
+
+	if (smallLoad > 0 && largeLoad > 0)
+		std::cout << "\nCreating " << ARENA_LARGE_LOAD << " objects costs " << std::setprecision(2)
+			<< largeLoad / smallLoad << " times as much per object as creating " << ARENA_SMALL_LOAD << "\n";
+
+	for (auto geo = objects.begin(); geo != objects.end(); ++geo)
+		delete *geo;
+	delete mesh;
+	delete sphere;
+
+	return 0;
+}
@@ -0,0 +1,386 @@
+/* -------------------------------------------------------------------------------------------------
+Copyright 2017 Shealyn Tate Hindenlang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+-------------------------------------------------------------------------------------------------
+*/
+#include "stdafx.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include "Statistics.h"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+/* -------------------------------------------------------------------------------------------------
+   End to end benchmark over whole scenes. Each scene file is rendered several times by the
+   Ray_Tracer program, one headless process per render so every run starts cold and reports its own
+   peak memory. Wall time is measured around the process, and the rays per second and peak memory
+   are read back from the JSON report the tracer writes beside its image.
+   The median and 95th percentile wall time, median rays per second and largest peak memory of each
+   scene can be saved as a baseline and later runs compared against it. A scene regresses when it
+   gets slower, traces fewer rays per second, or uses more memory than its threshold allows, and
+   the program then exits with a non-zero status.
+   Usage:
+		SceneBenchmark [options] <scene file> [<scene file> ...]
+		--tracer <path> : Ray_Tracer program to run, defaults to the one beside SceneBenchmark
+		--runs <int> : renders per scene, defaults to 5
+		--baseline <file> : compare the results against this baseline
+		--save <file> : save the results as a baseline
+		--time-threshold <percent> : allowed increase in median wall time, defaults to 10
+		--rate-threshold <percent> : allowed drop in rays per second, defaults to 10
+		--memory-threshold <percent> : allowed increase in peak memory, defaults to 10
+   Baseline files hold one scene per line: median and 95th percentile wall time in seconds, rays per
+   second, peak memory in bytes, then the scene file as it was given on the command line. Lines
+   that begin with # are ignored as comments.
+   -------------------------------------------------------------------------------------------------
+*/
+
+#pragma region Benchmark Results
+
+struct RenderRun
+{
+	double wallTime;
+	double raysPerSecond;
+	double peakMemory;
+};
+
+struct SceneResult
+{
+	double medianTime;
+	double p95Time;
+	double raysPerSecond;
+	double peakMemory;
+};
+
+struct Thresholds
+{
+	double time = 10.0;
+	double rate = 10.0;
+	double memory = 10.0;
+};
+
+// Value at the given fraction of a sorted list, using the nearest rank
+static double percentile(std::vector<double> values, double fraction)
+{
+	if (values.empty())
+		return 0;
+
+	std::sort(values.begin(), values.end());
+	int rank = (int)std::ceil(fraction * values.size()) - 1;
+
+	return values[std::min(std::max(rank, 0), (int)values.size() - 1)];
+}
+
+static SceneResult summarize(const std::vector<RenderRun>& runs)
+{
+	std::vector<double> times, rates;
+	SceneResult result{ 0, 0, 0, 0 };
+
+	for (auto run = runs.begin(); run != runs.end(); ++run)
+	{
+		times.push_back(run->wallTime);
+		rates.push_back(run->raysPerSecond);
+		result.peakMemory = std::max(result.peakMemory, run->peakMemory);
+	}
+
+	result.medianTime = percentile(times, 0.5);
+	result.p95Time = percentile(times, 0.95);
+	result.raysPerSecond = percentile(rates, 0.5);
+
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Rendering
+
+static std::string quote(const std::string& s)
+{
+	return "\"" + s + "\"";
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Reads a top level number from the tracer's report. The report's keys are unique apart from the
+   two totals, so a plain search for the key is enough.
+   -------------------------------------------------------------------------------------------------
+*/
+static bool reportValue(const std::string& report, const std::string& key, double& value)
+{
+	auto position = report.find("\"" + key + "\":");
+	if (position == std::string::npos)
+		return false;
+
+	std::istringstream number{ report.substr(position + key.size() + 3) };
+	return (bool)(number >> value);
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Renders a scene once and fills in the run. The tracer names the report it saved on its output,
+   which is how the report is found whatever output file the scene asks for.
+   -------------------------------------------------------------------------------------------------
+*/
+static bool renderOnce(const std::string& tracer, const std::string& sceneFile, RenderRun& run)
+{
+	std::string command = quote(tracer) + " --headless " + quote(sceneFile);
+#ifdef _WIN32
+	// cmd.exe strips the outer quotes of the whole command
+	command = quote(command);
+#endif
+
+	const std::string saved = "Saved render report ";
+	std::string reportFile, line;
+	char buffer[4096];
+
+	Timer timer;
+	FILE *output = popen(command.c_str(), "r");
+	if (!output)
+		return false;
+
+	while (fgets(buffer, sizeof(buffer), output))
+	{
+		line += buffer;
+		if (line.back() != '\n')
+			continue;
+
+		line.erase(line.find_last_not_of("\r\n") + 1);
+		if (line.compare(0, saved.size(), saved) == 0)
+			reportFile = line.substr(saved.size());
+		line.clear();
+	}
+
+	int status = pclose(output);
+	run.wallTime = timer.elapsed();
+
+	if (status != 0 || reportFile.empty())
+		return false;
+
+	std::ifstream file(reportFile);
+	std::stringstream report;
+	report << file.rdbuf();
+
+	return reportValue(report.str(), "raysPerSecond", run.raysPerSecond) &&
+		reportValue(report.str(), "peakMemory", run.peakMemory);
+}
+
+#pragma endregion
+
+#pragma region Baselines
+
+static bool loadBaseline(const std::string& fileName, std::map<std::string, SceneResult>& baseline)
+{
+	std::ifstream file(fileName);
+	std::string line;
+
+	if (!file)
+		return false;
+
+	while (getline(file, line))
+	{
+		std::istringstream fields{ line };
+		SceneResult result;
+		std::string scene;
+
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		if (fields >> result.medianTime >> result.p95Time >> result.raysPerSecond >> result.peakMemory)
+		{
+			getline(fields >> std::ws, scene);
+			baseline[scene] = result;
+		}
+	}
+
+	return true;
+}
+
+static bool saveBaseline(const std::string& fileName, const std::vector<std::string>& scenes,
+	const std::vector<SceneResult>& results)
+{
+	std::ofstream file(fileName, std::ofstream::out | std::ofstream::trunc);
+
+	if (!file)
+		return false;
+
+	file.precision(9);
+	file << "# median(s) p95(s) rays/s peakMemory(bytes) scene\n";
+
+	for (unsigned i = 0; i < scenes.size(); ++i)
+	{
+		// Scenes that failed to render have nothing to compare against
+		if (results[i].medianTime <= 0)
+			continue;
+
+		file << results[i].medianTime << " " << results[i].p95Time << " " << (long long)results[i].raysPerSecond
+			<< " " << (long long)results[i].peakMemory << " " << scenes[i] << "\n";
+	}
+
+	return file.good();
+}
+
+// Relative change from the baseline in percent
+static double change(double current, double base)
+{
+	return (base > 0) ? (current / base - 1.0) * 100.0 : 0;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Prints how a scene compares to its baseline and returns false if it regressed past any of the
+   thresholds.
+   -------------------------------------------------------------------------------------------------
+*/
+static bool compare(const SceneResult& result, const SceneResult& base, const Thresholds& thresholds)
+{
+	double time = change(result.medianTime, base.medianTime);
+	double rate = change(result.raysPerSecond, base.raysPerSecond);
+	double memory = change(result.peakMemory, base.peakMemory);
+
+	bool passed = time <= thresholds.time && -rate <= thresholds.rate && memory <= thresholds.memory;
+
+	std::cout << std::showpos << std::setprecision(1)
+		<< "    time " << time << "%, rays/s " << rate << "%, memory " << memory << "%"
+		<< std::noshowpos << (passed ? "" : "  REGRESSION") << "\n";
+
+	return passed;
+}
+
+#pragma endregion
+
+int main(int argc, char *argv[])
+{
+	std::string tracer, baselineFile, saveFile;
+	std::vector<std::string> scenes;
+	Thresholds thresholds;
+	int runs = 5;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg{ argv[i] };
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--tracer" && hasValue)
+			tracer = argv[++i];
+		else if (arg == "--runs" && hasValue)
+			runs = std::max(atoi(argv[++i]), 1);
+		else if (arg == "--baseline" && hasValue)
+			baselineFile = argv[++i];
+		else if (arg == "--save" && hasValue)
+			saveFile = argv[++i];
+		else if (arg == "--time-threshold" && hasValue)
+			thresholds.time = atof(argv[++i]);
+		else if (arg == "--rate-threshold" && hasValue)
+			thresholds.rate = atof(argv[++i]);
+		else if (arg == "--memory-threshold" && hasValue)
+			thresholds.memory = atof(argv[++i]);
+		else if (arg[0] == '-')
+		{
+			scenes.clear();
+			break;
+		}
+		else
+			scenes.push_back(arg);
+	}
+
+	if (scenes.empty())
+	{
+		std::cout << "Usage: " << argv[0] << " [--tracer <path>] [--runs <int>] [--baseline <file>] [--save <file>]\n"
+			<< "       [--time-threshold <percent>] [--rate-threshold <percent>] [--memory-threshold <percent>]\n"
+			<< "       <scene file> [<scene file> ...]" << std::endl;
+		return 1;
+	}
+
+	// By default the tracer is the Ray_Tracer built beside this program
+	if (tracer.empty())
+	{
+		std::string self{ argv[0] };
+		auto slash = self.find_last_of("/\\");
+		tracer = (slash == std::string::npos) ? "" : self.substr(0, slash + 1);
+#ifdef _WIN32
+		tracer += "Ray_Tracer.exe";
+#else
+		tracer += "Ray_Tracer";
+#endif
+	}
+
+	std::map<std::string, SceneResult> baseline;
+	if (!baselineFile.empty() && !loadBaseline(baselineFile, baseline))
+	{
+		std::cout << "Unable to open baseline " << baselineFile << std::endl;
+		return 1;
+	}
+
+	std::vector<SceneResult> results;
+	bool failed = false, regressed = false;
+
+	std::cout << std::fixed << std::left << std::setw(36) << "scene" << std::right << std::setw(12) << "median s"
+		<< std::setw(12) << "p95 s" << std::setw(12) << "Mrays/s" << std::setw(12) << "peak MB" << "\n";
+
+	for (auto scene = scenes.begin(); scene != scenes.end(); ++scene)
+	{
+		std::vector<RenderRun> sceneRuns;
+
+		for (int i = 0; i < runs; ++i)
+		{
+			RenderRun run;
+			if (renderOnce(tracer, *scene, run))
+				sceneRuns.push_back(run);
+		}
+
+		if ((int)sceneRuns.size() < runs)
+		{
+			std::cout << std::left << std::setw(36) << *scene << "  failed to render" << std::endl;
+			failed = true;
+			results.push_back(SceneResult{ 0, 0, 0, 0 });
+			continue;
+		}
+
+		SceneResult result = summarize(sceneRuns);
+		results.push_back(result);
+
+		std::cout << std::left << std::setw(36) << *scene << std::right << std::setprecision(3)
+			<< std::setw(12) << result.medianTime << std::setw(12) << result.p95Time
+			<< std::setw(12) << result.raysPerSecond / 1.0e6
+			<< std::setprecision(1) << std::setw(12) << result.peakMemory / (1024.0 * 1024.0) << "\n";
+
+		auto base = baseline.find(*scene);
+		if (base != baseline.end() && !compare(result, base->second, thresholds))
+			regressed = true;
+
+		std::cout.flush();
+	}
+
+	if (!saveFile.empty() && !saveBaseline(saveFile, scenes, results))
+	{
+		std::cout << "Unable to save baseline " << saveFile << std::endl;
+		failed = true;
+	}
+
+	if (regressed)
+		std::cout << "Performance regressed past the thresholds" << std::endl;
+
+	return (failed || regressed) ? 1 : 0;
+}
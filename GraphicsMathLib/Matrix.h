@@ -0,0 +1,178 @@
+/* -------------------------------------------------------------------------------------------------
+   Copyright 2017 Shealyn Tate Hindenlang
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge, publish, distribute,
+   sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+   -------------------------------------------------------------------------------------------------
+*/
+#ifndef GRAPHICSMATH_MATRIX_H
+#define GRAPHICSMATH_MATRIX_H
+
+#include <utility>
+
+#include "Vector.h"
+
+namespace GraphicsMath
+{
+
+#pragma region Matrix
+
+/* -------------------------------------------------------------------------------------------------
+   R x C float matrix stored column-major: m[c] is column c and m[c][r] the element in row r. A
+   default constructed square matrix is the identity. Transforms act on column vectors, so
+   A * B * v applies B first.
+   -------------------------------------------------------------------------------------------------
+*/
+template <unsigned R, unsigned C>
+class Matrix
+{
+private:
+	Vector<R> m_columns[C];
+
+public:
+	Matrix()
+	{
+		for (unsigned c = 0; c < C; ++c)
+			for (unsigned r = 0; r < R; ++r)
+				m_columns[c][r] = (r == c) ? 1.0f : 0.0f;
+	}
+
+	Vector<R>& operator [](unsigned c) { return m_columns[c]; }
+	const Vector<R>& operator [](unsigned c) const { return m_columns[c]; }
+
+	template <unsigned K>
+	Matrix<R, K> operator *(const Matrix<C, K>& m) const
+	{
+		Matrix<R, K> result;
+		for (unsigned k = 0; k < K; ++k)
+			result[k] = *this * m[k];
+		return result;
+	}
+
+	Vector<R> operator *(const Vector<C>& v) const
+	{
+		Vector<R> result;
+		for (unsigned c = 0; c < C; ++c)
+			for (unsigned r = 0; r < R; ++r)
+				result[r] += m_columns[c][r] * v[c];
+		return result;
+	}
+
+	Matrix<C, R> transposition() const
+	{
+		Matrix<C, R> result;
+		for (unsigned c = 0; c < C; ++c)
+			for (unsigned r = 0; r < R; ++r)
+				result[r][c] = m_columns[c][r];
+		return result;
+	}
+
+	// Gauss-Jordan elimination with partial pivoting. A singular matrix returns the identity.
+	Matrix inverse() const
+	{
+		static_assert(R == C, "Only square matrices can be inverted");
+
+		Matrix a{ *this };
+		Matrix result;
+
+		for (unsigned c = 0; c < C; ++c)
+		{
+			unsigned pivot = c;
+			for (unsigned r = c + 1; r < R; ++r)
+				if (std::fabs(a[c][r]) > std::fabs(a[c][pivot]))
+					pivot = r;
+
+			if (a[c][pivot] == 0.0f)
+				return Matrix{};
+
+			if (pivot != c)
+			{
+				for (unsigned k = 0; k < C; ++k)
+				{
+					std::swap(a[k][c], a[k][pivot]);
+					std::swap(result[k][c], result[k][pivot]);
+				}
+			}
+
+			float scale = 1.0f / a[c][c];
+			for (unsigned k = 0; k < C; ++k)
+			{
+				a[k][c] *= scale;
+				result[k][c] *= scale;
+			}
+
+			for (unsigned r = 0; r < R; ++r)
+			{
+				if (r == c || a[c][r] == 0.0f)
+					continue;
+
+				float factor = a[c][r];
+				for (unsigned k = 0; k < C; ++k)
+				{
+					a[k][r] -= factor * a[k][c];
+					result[k][r] -= factor * result[k][c];
+				}
+			}
+		}
+
+		return result;
+	}
+
+	static Matrix Translation(const Vector<3>& t)
+	{
+		static_assert(R == 4 && C == 4, "Translation matrices are 4x4");
+
+		Matrix result;
+		result[3][0] = t[0];
+		result[3][1] = t[1];
+		result[3][2] = t[2];
+		return result;
+	}
+
+	static Matrix Scale(const Vector<3>& s)
+	{
+		static_assert(R == 4 && C == 4, "Scale matrices are 4x4");
+
+		Matrix result;
+		result[0][0] = s[0];
+		result[1][1] = s[1];
+		result[2][2] = s[2];
+		return result;
+	}
+
+	// Right handed rotation of the given angle (in radians) about an arbitrary axis
+	static Matrix Rotation(const Vector<3>& axis, float radians)
+	{
+		static_assert(R == 4 && C == 4, "Rotation matrices are 4x4");
+
+		Vector<3> n = axis.normal();
+		float x = n[0], y = n[1], z = n[2];
+		float c = std::cos(radians);
+		float s = std::sin(radians);
+		float t = 1.0f - c;
+
+		Matrix result;
+		result[0][0] = t * x * x + c;     result[1][0] = t * x * y - s * z; result[2][0] = t * x * z + s * y;
+		result[0][1] = t * x * y + s * z; result[1][1] = t * y * y + c;     result[2][1] = t * y * z - s * x;
+		result[0][2] = t * x * z - s * y; result[1][2] = t * y * z + s * x; result[2][2] = t * z * z + c;
+		return result;
+	}
+};
+
+#pragma endregion
+
+}
+
+#endif
@@ -0,0 +1,238 @@
+/* -------------------------------------------------------------------------------------------------
+   Copyright 2017 Shealyn Tate Hindenlang
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge, publish, distribute,
+   sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+   -------------------------------------------------------------------------------------------------
+*/
+#ifndef GRAPHICSMATH_VECTOR_H
+#define GRAPHICSMATH_VECTOR_H
+
+#include <cmath>
+#include <initializer_list>
+
+namespace GraphicsMath
+{
+
+#pragma region Vector
+
+/* -------------------------------------------------------------------------------------------------
+   Fixed size float vector. Storage is a plain array of N floats so vectors can be copied, packed
+   into arrays and written to disk as raw memory. Components not given to the initializer list
+   constructor are zero, so Vector<3>{ x, y } is the point (x, y, 0).
+   -------------------------------------------------------------------------------------------------
+*/
+template <unsigned N>
+class Vector
+{
+private:
+	float m_data[N];
+
+public:
+	Vector()
+	{
+		for (unsigned i = 0; i < N; ++i)
+			m_data[i] = 0.0f;
+	}
+
+	Vector(std::initializer_list<float> values)
+	{
+		unsigned i = 0;
+		for (auto v = values.begin(); v != values.end() && i < N; ++v, ++i)
+			m_data[i] = *v;
+		for (; i < N; ++i)
+			m_data[i] = 0.0f;
+	}
+
+	float& operator [](unsigned i) { return m_data[i]; }
+	const float& operator [](unsigned i) const { return m_data[i]; }
+
+	Vector operator +(const Vector& v) const
+	{
+		Vector result;
+		for (unsigned i = 0; i < N; ++i)
+			result.m_data[i] = m_data[i] + v.m_data[i];
+		return result;
+	}
+
+	Vector operator -(const Vector& v) const
+	{
+		Vector result;
+		for (unsigned i = 0; i < N; ++i)
+			result.m_data[i] = m_data[i] - v.m_data[i];
+		return result;
+	}
+
+	Vector operator *(float s) const
+	{
+		Vector result;
+		for (unsigned i = 0; i < N; ++i)
+			result.m_data[i] = m_data[i] * s;
+		return result;
+	}
+
+	Vector operator /(float s) const
+	{
+		Vector result;
+		for (unsigned i = 0; i < N; ++i)
+			result.m_data[i] = m_data[i] / s;
+		return result;
+	}
+
+	Vector& operator +=(const Vector& v)
+	{
+		for (unsigned i = 0; i < N; ++i)
+			m_data[i] += v.m_data[i];
+		return *this;
+	}
+
+	Vector& operator -=(const Vector& v)
+	{
+		for (unsigned i = 0; i < N; ++i)
+			m_data[i] -= v.m_data[i];
+		return *this;
+	}
+
+	Vector& operator +=(float s)
+	{
+		for (unsigned i = 0; i < N; ++i)
+			m_data[i] += s;
+		return *this;
+	}
+
+	Vector& operator -=(float s)
+	{
+		for (unsigned i = 0; i < N; ++i)
+			m_data[i] -= s;
+		return *this;
+	}
+
+	Vector& operator *=(float s)
+	{
+		for (unsigned i = 0; i < N; ++i)
+			m_data[i] *= s;
+		return *this;
+	}
+
+	Vector& operator /=(float s)
+	{
+		for (unsigned i = 0; i < N; ++i)
+			m_data[i] /= s;
+		return *this;
+	}
+
+	// Component-wise comparisons, true only if the relation holds for every component
+	bool operator >(const Vector& v) const
+	{
+		for (unsigned i = 0; i < N; ++i)
+			if (!(m_data[i] > v.m_data[i]))
+				return false;
+		return true;
+	}
+
+	bool operator <(const Vector& v) const
+	{
+		for (unsigned i = 0; i < N; ++i)
+			if (!(m_data[i] < v.m_data[i]))
+				return false;
+		return true;
+	}
+
+	bool operator ==(const Vector& v) const
+	{
+		for (unsigned i = 0; i < N; ++i)
+			if (m_data[i] != v.m_data[i])
+				return false;
+		return true;
+	}
+
+	bool operator !=(const Vector& v) const
+	{
+		return !(*this == v);
+	}
+
+	float dotProduct(const Vector& v) const
+	{
+		float result = 0.0f;
+		for (unsigned i = 0; i < N; ++i)
+			result += m_data[i] * v.m_data[i];
+		return result;
+	}
+
+	Vector crossProduct(const Vector& v) const
+	{
+		static_assert(N == 3, "Cross product is only defined for 3 dimensional vectors");
+
+		return Vector{ m_data[1] * v.m_data[2] - m_data[2] * v.m_data[1],
+					   m_data[2] * v.m_data[0] - m_data[0] * v.m_data[2],
+					   m_data[0] * v.m_data[1] - m_data[1] * v.m_data[0] };
+	}
+
+	float magnitude() const
+	{
+		return std::sqrt(dotProduct(*this));
+	}
+
+	Vector normal() const
+	{
+		float length = magnitude();
+		return (length > 0.0f) ? *this / length : *this;
+	}
+
+	// Divide through by the last (homogeneous) component
+	void homogenize()
+	{
+		float w = m_data[N - 1];
+		if (w != 0.0f && w != 1.0f)
+			for (unsigned i = 0; i < N; ++i)
+				m_data[i] /= w;
+	}
+
+	Vector homogenous() const
+	{
+		Vector result{ *this };
+		result.homogenize();
+		return result;
+	}
+};
+
+#pragma endregion
+
+#pragma region Dimension Conversion
+
+template <unsigned N>
+Vector<N + 1> higherDimension(const Vector<N>& v, float w)
+{
+	Vector<N + 1> result;
+	for (unsigned i = 0; i < N; ++i)
+		result[i] = v[i];
+	result[N] = w;
+	return result;
+}
+
+template <unsigned N>
+Vector<N - 1> lowerDimension(const Vector<N>& v)
+{
+	Vector<N - 1> result;
+	for (unsigned i = 0; i < N - 1; ++i)
+		result[i] = v[i];
+	return result;
+}
+
+#pragma endregion
+
+}
+
+#endif
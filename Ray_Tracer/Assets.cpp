@@ -1,46 +1,115 @@
 #include "stdafx.h"
 #include "Assets.h"
+#include "Statistics.h"
 
+#include <atomic>
+#include <cmath>
+#include <thread>
 #include <typeinfo>
 
-#pragma region Bounding Box
+#pragma region Parallel Build
 
-BoundingBox::BoundingBox()
-	: min{ -1, -1, -1 }, max{ 1, 1, 1 }
+/* -------------------------------------------------------------------------------------------------
+   Sorts items with one block per thread, then merges neighbouring blocks pairwise, the merges of
+   each round also running in parallel.
+   -------------------------------------------------------------------------------------------------
+*/
+template <typename T>
+static void parallelSort(std::vector<T>& items, int threads)
 {
+	int count = (int)items.size();
+	int blocks = std::max(1, std::min(threads, count / PARALLEL_GRAIN));
+	std::vector<int> bounds(blocks + 1);
+
+	for (int b = 0; b <= blocks; ++b)
+		bounds[b] = (int)((long long)count * b / blocks);
 
+	parallelFor(blocks, blocks, [&](int begin, int end)
+	{
+		for (int b = begin; b < end; ++b)
+			std::sort(items.begin() + bounds[b], items.begin() + bounds[b + 1]);
+	}, 1);
+
+	for (int width = 1; width < blocks; width *= 2)
+	{
+		parallelFor((blocks + 2 * width - 1) / (2 * width), blocks, [&](int begin, int end)
+		{
+			for (int pair = begin; pair < end; ++pair)
+			{
+				int first = pair * 2 * width;
+				int middle = std::min(first + width, blocks);
+				int last = std::min(first + 2 * width, blocks);
+				std::inplace_merge(items.begin() + bounds[first], items.begin() + bounds[middle], items.begin() + bounds[last]);
+			}
+		}, 1);
+	}
 }
 
-bool BoundingBox::hit(const Ray &ray) const
+#pragma endregion
+
+#pragma region Grid Data
+
+float GridData::exit() const
+{
+	return std::min(txNext, std::min(tyNext, tzNext));
+}
+
+bool GridData::step()
 {
-	float ox = ray.origin[0]; float oy = ray.origin[1]; float oz = ray.origin[2];
-	float dx = ray.direction[0]; float dy = ray.direction[1]; float dz = ray.direction[2];
+	if (txNext < tyNext && txNext < tzNext)
+	{
+		txNext += dtx;
+		ix += ixStep;
 
-	float txMin, tyMin, tzMin;
-	float txMax, tyMax, tzMax;
+		return ix != ixStop;
+	}
+
+	if (tyNext < tzNext)
+	{
+		tyNext += dty;
+		iy += iyStep;
 
-	float a = 1.0f / dx;
-	float b = 1.0f / dy;
-	float c = 1.0f / dz;
+		return iy != iyStop;
+	}
 
-	txMin = (a >= 0.0f) ? (min[0] - ox) * a : (max[0] - ox) * a;
-	txMax = (a >= 0.0f) ? (max[0] - ox) * a : (min[0] - ox) * a;
+	tzNext += dtz;
+	iz += izStep;
 
-	tyMin = (b >= 0.0f) ? (min[1] - oy) * b : (max[1] - oy) * b;
-	tyMax = (b >= 0.0f) ? (max[1] - oy) * b : (min[1] - oy) * b;
+	return iz != izStop;
+}
 
-	tzMin = (c >= 0.0f) ? (min[2] - oz) * c : (max[2] - oz) * c;
-	tzMax = (c >= 0.0f) ? (max[2] - oz) * c : (min[2] - oz) * c;
+#pragma endregion
 
-	float t0, t1;
+#pragma region Bounding Box
 
-	t0 = (txMin > tyMin) ? txMin : tyMin;
-	if (tzMin > t0) t0 = tzMin;
+BoundingBox::BoundingBox()
+	: min{ -1, -1, -1 }, max{ 1, 1, 1 }
+{
+
+}
+
+bool BoundingBox::hit(const Ray &ray) const
+{
+	float tNear;
+	return hit(PrecomputedRay{ ray }, MAX_T, tNear);
+}
+
+bool BoundingBox::hit(const PrecomputedRay& ray, float tMax, float& tNear) const
+{
+	float t0 = MIN_T;
+	float t1 = tMax;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float tA = ((ray.sign[axis] ? max : min)[axis] - ray.origin[axis]) * ray.invDirection[axis];
+		float tB = ((ray.sign[axis] ? min : max)[axis] - ray.origin[axis]) * ray.invDirection[axis];
 
-	t1 = (txMax < tyMin) ? txMax : tyMax;
-	if (tzMax < t1) t1 = tzMax;
+		t0 = (tA > t0) ? tA : t0;
+		t1 = (tB < t1) ? tB : t1;
+	}
 
-	return (t0 < t1 && t1 > MIN_T);
+	tNear = t0;
+	return t0 <= t1;
 }
 
 bool BoundingBox::inside(const Vector<3>& p) const
@@ -48,6 +117,15 @@ bool BoundingBox::inside(const Vector<3>& p) const
 	return p > min && p < max;
 }
 
+float BoundingBox::surfaceArea() const
+{
+	float dx = max[0] - min[0];
+	float dy = max[1] - min[1];
+	float dz = max[2] - min[2];
+
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
 void BoundingBox::updateMin(const Vector<3>& v)
 {
 	min[0] = fminf(min[0], v[0]);
@@ -66,8 +144,8 @@ void BoundingBox::updateMax(const Vector<3>& v)
 
 #pragma region Geometry
 
-Geometry::Geometry(Material mat, Matrix<4, 4> inv)
-	: material{ mat }, invTransform{ inv }, invTranspose{ inv.transposition() }, boundingBox {}
+Geometry::Geometry(unsigned mat, Matrix<4, 4> inv)
+	: materialId{ mat }, invTransform{ inv }, invTranspose{ inv.transposition() }, boundingBox {}
 {
 
 }
@@ -87,14 +165,39 @@ void Geometry::addGeometry(Geometry *geo)
 
 }
 
-Material Geometry::getMaterial()
+int Geometry::primitiveCount() const
 {
-	return material;
+	return 1;
 }
 
-void Geometry::setMaterial(Material m)
+BoundingBox Geometry::primitiveBoundingBox(int index)
 {
-	material = m;
+	return getBoundingBox();
+}
+
+bool Geometry::hitPrimitive(int index, const Ray& ray, float& tMin, ShaderData& sd) const
+{
+	return hit(ray, tMin, sd);
+}
+
+bool Geometry::occludedPrimitive(int index, const Ray& ray, float tMax) const
+{
+	return occluded(ray, tMax);
+}
+
+PRIMITIVE_TYPE Geometry::primitiveType() const
+{
+	return PRIMITIVE_GEOMETRY;
+}
+
+unsigned Geometry::getMaterialId()
+{
+	return materialId;
+}
+
+void Geometry::setMaterialId(unsigned id)
+{
+	materialId = id;
 }
 
 Geometry::~Geometry()
@@ -106,7 +209,7 @@ Geometry::~Geometry()
 
 #pragma region Sphere Geometry
 
-Sphere::Sphere(Vector<3> center, float radius, Material mat, Matrix<4,4> inv)
+Sphere::Sphere(Vector<3> center, float radius, unsigned mat, Matrix<4,4> inv)
 	: Geometry{ mat, inv }, center{ center }, radius{ radius }
 {
 
@@ -166,6 +269,8 @@ void Sphere::generateBoundingBox(Matrix<4,4> transform)
 
 bool Sphere::hitCalculations(Ray& localRay, float& a, float& b, float& e, Vector<3>& diff) const
 { 
+	++threadCounters.intersectionTests;
+
 	auto origin = invTransform * higherDimension(localRay.origin, 1.0f);
 	auto direction = invTransform * higherDimension(localRay.direction, 0);
 	origin.homogenize();
@@ -187,14 +292,14 @@ bool Sphere::hitCalculations(Ray& localRay, float& a, float& b, float& e, Vector
 	return true;
 }
 
-bool Sphere::hit(const Ray &ray, float &tMin, ShaderData &shaderData) const
+// Sets tMin to the nearest intersection in front of the ray's origin, if there is one
+bool Sphere::intersect(const Ray& ray, float& tMin) const
 {
 	float a, b, e;
 	Vector<3> diff;
 	Ray localRay{ ray };
-	bool result = hitCalculations(localRay, a, b, e, diff);
 
-	if (!result)
+	if (!hitCalculations(localRay, a, b, e, diff))
 		return false;
 
 	float denom = 2.0f * a;
@@ -203,12 +308,6 @@ bool Sphere::hit(const Ray &ray, float &tMin, ShaderData &shaderData) const
 	if (hit0 > MIN_T)
 	{
 		tMin = hit0;
-		auto localNormal = (diff + localRay.direction * hit0) / radius;
-		auto transNormal = invTranspose * higherDimension(localNormal, 0);
-		shaderData.setNormal(lowerDimension(transNormal).normal());
-		shaderData.setHitPoint(ray.origin + ray.direction * hit0);
-		shaderData.setMaterial(material);
-
 		return true;
 	}
 
@@ -216,18 +315,36 @@ bool Sphere::hit(const Ray &ray, float &tMin, ShaderData &shaderData) const
 	if (hit1 > MIN_T)
 	{
 		tMin = hit1;
-		auto localNormal = (diff + localRay.direction * hit1) / radius;
-		auto transNormal = invTranspose * higherDimension(localNormal, 0);
-		shaderData.setNormal(lowerDimension(transNormal).normal());
-		shaderData.setHitPoint(ray.origin + ray.direction * hit1);
-		shaderData.setMaterial(material);
-
 		return true;
 	}
+
 	return false;
 }
 
-bool Sphere::shadowHit(const Ray& ray, float& tMin) const
+// Fills in the shader data for an intersection found by intersect at distance t
+void Sphere::shade(const Ray& ray, float t, ShaderData& shaderData) const
+{
+	auto origin = invTransform * higherDimension(ray.origin, 1.0f);
+	auto direction = lowerDimension(invTransform * higherDimension(ray.direction, 0));
+	origin.homogenize();
+
+	auto localNormal = (lowerDimension(origin) - center + direction * t) / radius;
+	auto transNormal = invTranspose * higherDimension(localNormal, 0);
+	shaderData.setNormal(lowerDimension(transNormal).normal());
+	shaderData.setHitPoint(ray.origin + ray.direction * t);
+	shaderData.setMaterialId(materialId);
+}
+
+bool Sphere::hit(const Ray &ray, float &tMin, ShaderData &shaderData) const
+{
+	if (!intersect(ray, tMin))
+		return false;
+
+	shade(ray, tMin, shaderData);
+	return true;
+}
+
+bool Sphere::occluded(const Ray& ray, float tMax) const
 {
 	float a, b, e;
 	Vector<3> diff;
@@ -239,18 +356,86 @@ bool Sphere::shadowHit(const Ray& ray, float& tMin) const
 
 	float denom = 2.0f * a;
 
+	// Only the nearest intersection in front of the origin can block the ray
+	float hit0 = (-b - e) / denom;
+	if (hit0 > MIN_T)
+		return hit0 < tMax;
+
+	float hit1 = (-b + e) / denom;
+	return hit1 > MIN_T && hit1 < tMax;
+}
+
+SphereRecord Sphere::record() const
+{
+	SphereRecord record;
+
+	for (int c = 0; c < 4; ++c)
+		for (int r = 0; r < 3; ++r)
+			record.transform[c][r] = invTransform[c][r];
+
+	record.center = center;
+	record.radius = radius;
+	record.sphere = this;
+
+	return record;
+}
+
+PRIMITIVE_TYPE Sphere::primitiveType() const
+{
+	bool affine = invTransform[0][3] == 0.0f && invTransform[1][3] == 0.0f && invTransform[2][3] == 0.0f &&
+		invTransform[3][3] == 1.0f;
+
+	return affine ? PRIMITIVE_SPHERE : PRIMITIVE_GEOMETRY;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Sphere::intersect for a sphere record, bringing the ray into the sphere's space with the
+   record's affine transform rather than a full matrix product and homogeneous divide. The sums
+   are taken in the same order as the matrix product, so the result is the same.
+   -------------------------------------------------------------------------------------------------
+*/
+static bool sphereIntersection(const SphereRecord& sphere, const Ray& ray, float& tMin)
+{
+	++threadCounters.intersectionTests;
+
+	const float (*m)[3] = sphere.transform;
+	const Vector<3>& o = ray.origin;
+	const Vector<3>& d = ray.direction;
+
+	Vector<3> diff{
+		m[0][0] * o[0] + m[1][0] * o[1] + m[2][0] * o[2] + m[3][0] - sphere.center[0],
+		m[0][1] * o[0] + m[1][1] * o[1] + m[2][1] * o[2] + m[3][1] - sphere.center[1],
+		m[0][2] * o[0] + m[1][2] * o[1] + m[2][2] * o[2] + m[3][2] - sphere.center[2] };
+	Vector<3> direction{
+		m[0][0] * d[0] + m[1][0] * d[1] + m[2][0] * d[2],
+		m[0][1] * d[0] + m[1][1] * d[1] + m[2][1] * d[2],
+		m[0][2] * d[0] + m[1][2] * d[1] + m[2][2] * d[2] };
+
+	float a = direction.dotProduct(direction);
+	float b = diff.dotProduct(direction) * 2.0f;
+	float c = diff.dotProduct(diff) - sphere.radius * sphere.radius;
+	float disc = b * b - 4.0f * a * c;
+
+	if (disc < 0)
+		return false;
+
+	float e = sqrt(disc);
+	float denom = 2.0f * a;
+
 	float hit0 = (-b - e) / denom;
 	if (hit0 > MIN_T)
 	{
 		tMin = hit0;
 		return true;
 	}
+
 	float hit1 = (-b + e) / denom;
 	if (hit1 > MIN_T)
 	{
 		tMin = hit1;
 		return true;
 	}
+
 	return false;
 }
 
@@ -258,28 +443,27 @@ bool Sphere::shadowHit(const Ray& ray, float& tMin) const
 
 #pragma region Triangle Geometry
 
-Triangle::Triangle(Vector<3> v0, Vector<3> v1, Vector<3> v2, Material mat, Matrix<4,4> inv)
-	: Geometry(mat, inv), v0(v0), v1(v1), v2(v2), useTransform(false)
+Triangle::Triangle(Vector<3> v0, Vector<3> v1, Vector<3> v2, unsigned mat, Matrix<4,4> inv)
+	: Geometry(mat, inv), v0(v0), v1(v1), v2(v2), edge1(v0 - v1), edge2(v0 - v2)
 {
 	auto cross = higherDimension((v1 - v0).crossProduct(v2 - v0), 0);
 	m_normal = lowerDimension(invTranspose * cross).normal();
 }
 
-bool Triangle::hitCalculations(Ray& loc, float& tMin) const
+/* -------------------------------------------------------------------------------------------------
+   Ray-triangle intersection shared by Triangle and TriangleMesh, solving for the barycentric
+   coordinates and ray distance with Cramer's rule. Takes the triangle as its first vertex and the
+   edges v0 - v1 and v0 - v2, which only depend on the triangle, so they're worked out in advance.
+   -------------------------------------------------------------------------------------------------
+*/
+static bool triangleIntersection(const Vector<3>& v0, const Vector<3>& edge1, const Vector<3>& edge2,
+	const Ray& loc, float& tMin)
 {
-	if (useTransform)
-	{
-		auto origin = invTransform * higherDimension(loc.origin, 1.0f);
-		auto direction = invTransform * higherDimension(loc.direction, 0);
-		origin.homogenize();
-
-		loc.origin = lowerDimension(origin);
-		loc.direction = lowerDimension(direction);
-	}
+	++threadCounters.intersectionTests;
 
-	float a = v0[0] - v1[0], b = v0[0] - v2[0], c = loc.direction[0], d = v0[0] - loc.origin[0];
-	float e = v0[1] - v1[1], f = v0[1] - v2[1], g = loc.direction[1], h = v0[1] - loc.origin[1];
-	float i = v0[2] - v1[2], j = v0[2] - v2[2], k = loc.direction[2], l = v0[2] - loc.origin[2];
+	float a = edge1[0], b = edge2[0], c = loc.direction[0], d = v0[0] - loc.origin[0];
+	float e = edge1[1], f = edge2[1], g = loc.direction[1], h = v0[1] - loc.origin[1];
+	float i = edge1[2], j = edge2[2], k = loc.direction[2], l = v0[2] - loc.origin[2];
 
 	float m = f * k - g * j, n = h * k - g * l, p = f * l - h * j;
 	float q = g * i - e * k, s = e * j - f * i;
@@ -312,25 +496,113 @@ bool Triangle::hitCalculations(Ray& loc, float& tMin) const
 	return true;
 }
 
+/* -------------------------------------------------------------------------------------------------
+   Ray set up for the watertight triangle test. The axis the ray travels furthest along becomes z,
+   and the shear that lines the ray up with it only depends on the ray, so it's worked out once for
+   all the triangles the ray is tested against.
+   -------------------------------------------------------------------------------------------------
+*/
+struct WatertightRay
+{
+	Vector<3> origin;
+	int kx, ky, kz;
+	float sx, sy, sz;
+
+	WatertightRay(const Ray&);
+};
+
+WatertightRay::WatertightRay(const Ray& ray)
+	: origin{ ray.origin }
+{
+	const Vector<3>& d = ray.direction;
+
+	kz = 0;
+	if (std::fabs(d[1]) > std::fabs(d[kz]))
+		kz = 1;
+	if (std::fabs(d[2]) > std::fabs(d[kz]))
+		kz = 2;
+
+	// Swapping x and y when the ray runs down z keeps the triangles' winding
+	kx = (kz + 1) % 3;
+	ky = (kx + 1) % 3;
+	if (d[kz] < 0.0f)
+		std::swap(kx, ky);
+
+	sx = d[kx] / d[kz];
+	sy = d[ky] / d[kz];
+	sz = 1.0f / d[kz];
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Watertight ray-triangle intersection (Woop, Benthin and Wald, 2013). The vertices are moved to
+   the ray's origin and sheared so the ray runs along z, which leaves a 2d test of the origin
+   against the triangle's edges. Triangles sharing an edge compute it from the same vertices in the
+   same way, so a ray always hits one of them, and a ray exactly on the edge is settled in double
+   precision rather than left to rounding. Both windings are hit, like triangleIntersection.
+   -------------------------------------------------------------------------------------------------
+*/
+static bool watertightIntersection(const Vector<3>& v0, const Vector<3>& v1, const Vector<3>& v2,
+	const WatertightRay& ray, float& tMin)
+{
+	++threadCounters.intersectionTests;
+
+	Vector<3> a = v0 - ray.origin, b = v1 - ray.origin, c = v2 - ray.origin;
+
+	float ax = a[ray.kx] - ray.sx * a[ray.kz], ay = a[ray.ky] - ray.sy * a[ray.kz];
+	float bx = b[ray.kx] - ray.sx * b[ray.kz], by = b[ray.ky] - ray.sy * b[ray.kz];
+	float cx = c[ray.kx] - ray.sx * c[ray.kz], cy = c[ray.ky] - ray.sy * c[ray.kz];
+
+	// Scaled barycentric coordinates, each the area spanned by the origin and one edge
+	float u = cx * by - cy * bx;
+	float v = ax * cy - ay * cx;
+	float w = bx * ay - by * ax;
+
+	if (u == 0.0f || v == 0.0f || w == 0.0f)
+	{
+		u = (float)((double)cx * by - (double)cy * bx);
+		v = (float)((double)ax * cy - (double)ay * cx);
+		w = (float)((double)bx * ay - (double)by * ax);
+	}
+
+	if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+		return false;
+
+	float det = u + v + w;
+	if (det == 0.0f)
+		return false;
+
+	float t = (u * (ray.sz * a[ray.kz]) + v * (ray.sz * b[ray.kz]) + w * (ray.sz * c[ray.kz])) / det;
+	if (t < MIN_T)
+		return false;
+
+	tMin = t;
+	return true;
+}
+
+bool Triangle::hitCalculations(const Ray& ray, float& tMin) const
+{
+	return triangleIntersection(v0, edge1, edge2, ray, tMin);
+}
+
 bool Triangle::hit(const Ray& ray, float& tMin, ShaderData& shaderData) const
 {
-	Ray loc = Ray(ray);
-	bool result = hitCalculations(loc, tMin);
+	bool result = hitCalculations(ray, tMin);
 
 	if (result)
 	{
 		shaderData.setHitPoint(ray.origin + ray.direction * tMin);
 		shaderData.setNormal(m_normal);
-		shaderData.setMaterial(material);
+		shaderData.setMaterialId(materialId);
 	}
 
 	return result;
 }
 
-bool Triangle::shadowHit(const Ray& ray, float& tMin) const
+bool Triangle::occluded(const Ray& ray, float tMax) const
 {
-	Ray local = Ray(ray);
-	return hitCalculations(local, tMin);
+	float t = tMax;
+
+	return hitCalculations(ray, t) && t < tMax;
 }
 
 void Triangle::generateBoundingBox(Matrix<4,4> inv)
@@ -352,487 +624,1937 @@ void Triangle::generateBoundingBox(Matrix<4,4> inv)
 	boundingBox.max += epsilon;
 }
 
-void Triangle::setUseTransform(bool f)
+#pragma endregion
+
+#pragma region Triangle Mesh Geometry
+
+TriangleMesh::TriangleMesh(unsigned mat)
+	: Geometry{ mat, Matrix<4, 4>{} }, m_vertexStorage{}, m_indexStorage{}, m_vertices{ NULL }, m_indices{ NULL },
+	  m_numVertices{ 0 }, m_numIndices{ 0 }, m_watertight{ false }
 {
-	useTransform = f;
+
 }
 
-#pragma endregion
+// Copies viewed arrays into the mesh's own storage before they're changed
+void TriangleMesh::ownArrays()
+{
+	if (m_vertices != m_vertexStorage.data())
+		m_vertexStorage.assign(m_vertices, m_vertices + m_numVertices);
 
-#pragma region Compound Geometry
+	if (m_indices != m_indexStorage.data())
+		m_indexStorage.assign(m_indices, m_indices + m_numIndices);
+}
 
-Compound::Compound()
-	: Geometry{ Material{}, Matrix<4, 4>{} }, geometries{}
+int TriangleMesh::addVertex(Vector<3> v)
 {
+	ownArrays();
+	m_vertexStorage.push_back(v);
+	m_vertices = m_vertexStorage.data();
+	return m_numVertices++;
+}
 
+void TriangleMesh::addTriangle(int a, int b, int c)
+{
+	ownArrays();
+	m_indexStorage.push_back(a);
+	m_indexStorage.push_back(b);
+	m_indexStorage.push_back(c);
+	m_indices = m_indexStorage.data();
+	m_numIndices += 3;
 }
 
-Compound::Compound(const Compound &c)
-	: Geometry(c.material, c.invTransform), geometries{geometries.size()}
+/* -------------------------------------------------------------------------------------------------
+   Uses the given vertices and triangle indices in place, without copying them. They have to stay
+   valid for as long as the mesh does, and every index has to refer to one of the vertices.
+   -------------------------------------------------------------------------------------------------
+*/
+void TriangleMesh::viewArrays(const Vector<3> *vertices, int numVertices, const int *indices, int numIndices)
 {
-	for (unsigned i = 0; i < c.geometries.size(); ++i)
-		geometries[i] = c.geometries[i];
+	m_vertexStorage = std::vector<Vector<3>>{};
+	m_indexStorage = std::vector<int>{};
+	m_vertices = vertices;
+	m_indices = indices;
+	m_numVertices = numVertices;
+	m_numIndices = numIndices;
 }
 
-Compound& Compound::operator =(const Compound& c)
+// Makes room for the given number of vertices and triangles, so adding them doesn't reallocate
+void TriangleMesh::reserve(int vertices, int triangles)
 {
-	Compound result{ c };
-	geometries = result.geometries;
+	ownArrays();
+	m_vertexStorage.reserve(vertices);
+	m_indexStorage.reserve(3 * (size_t)triangles);
+	m_vertices = m_vertexStorage.data();
+	m_indices = m_indexStorage.data();
+}
 
-	return *this;
+int TriangleMesh::numVertices() const
+{
+	return m_numVertices;
 }
 
-void Compound::addGeometry(Geometry *geo)
+int TriangleMesh::numTriangles() const
 {
-	geometries.push_back(geo);
+	return m_numIndices / 3;
 }
 
-bool Compound::hit(const Ray& ray, float& tMin, ShaderData& sd) const
+void TriangleMesh::setWatertight(bool watertight)
 {
-	Vector<3> normal, hitPoint;
-	Material m{};
-	bool hit = false;
+	m_watertight = watertight;
+}
 
-	for (unsigned i = 0; i < geometries.size(); ++i)
-	{
-		float t = tMin;
-		if (geometries[i]->hit(ray, t, sd) && t < tMin)
-		{
-			hit = true;
-			tMin = t;
-			m = sd.getMaterial();
-			normal = sd.getNormal();
-			hitPoint = sd.getHitPoint();
-			
-		}
-	}
+bool TriangleMesh::watertight() const
+{
+	return m_watertight;
+}
 
-	if (hit)
-	{
-		sd.setNormal(normal);
-		sd.setHitPoint(hitPoint);
-		sd.setMaterial(m);
-	}
+TriangleRecord TriangleMesh::record(int triangle) const
+{
+	const int *index = &m_indices[3 * triangle];
+	const Vector<3>& v0 = m_vertices[index[0]];
 
-	return hit;
+	return TriangleRecord{ v0, v0 - m_vertices[index[1]], v0 - m_vertices[index[2]], this, triangle };
 }
 
-bool Compound::shadowHit(const Ray& ray, float& tMin) const
+WatertightRecord TriangleMesh::watertightRecord(int triangle) const
 {
-	bool hit = false;
-
-	for (unsigned i = 0; i < geometries.size(); ++i)
-	{
-		float t = tMin;
-		if (geometries[i]->shadowHit(ray, t) && t < tMin)
-		{
-			hit = true;
-			tMin = t;
-			break;
-		}
-	}
+	const int *index = &m_indices[3 * triangle];
 
-	return hit;
+	return WatertightRecord{ m_vertices[index[0]], m_vertices[index[1]], m_vertices[index[2]], this, triangle };
 }
 
-void Compound::generateBoundingBox(Matrix<4, 4> m)
+// Fills in the shader data for a hit on the triangle at distance t
+void TriangleMesh::shade(int triangle, const Ray& ray, float t, ShaderData& shaderData) const
 {
-	// TODO
+	shaderData.setHitPoint(ray.origin + ray.direction * t);
+	shaderData.setNormal(faceNormal(triangle));
+	shaderData.setMaterialId(materialId);
 }
 
-BoundingBox Compound::getBoundingBox()
+bool TriangleMesh::hitCalculations(int triangle, const Ray& ray, float& tMin) const
 {
-	boundingBox.min = Vector<3>{ MAX_T, MAX_T, MAX_T };
-	boundingBox.max = Vector<3>{ -MAX_T, -MAX_T, -MAX_T };
-	
-	for (unsigned i = 0; i < geometries.size(); ++i)
-	{
-		BoundingBox box = geometries[i]->getBoundingBox();
+	const int *index = &m_indices[3 * triangle];
+	const Vector<3>& v0 = m_vertices[index[0]];
 
-		boundingBox.updateMin(box.min);
-		boundingBox.updateMax(box.max);
-	}
+	if (m_watertight)
+		return watertightIntersection(v0, m_vertices[index[1]], m_vertices[index[2]], WatertightRay{ ray }, tMin);
 
-	return boundingBox;
+	return triangleIntersection(v0, v0 - m_vertices[index[1]], v0 - m_vertices[index[2]], ray, tMin);
 }
 
-#pragma endregion
+Vector<3> TriangleMesh::faceNormal(int triangle) const
+{
+	const int *index = &m_indices[3 * triangle];
+	const Vector<3>& v0 = m_vertices[index[0]];
+	auto cross = higherDimension((m_vertices[index[1]] - v0).crossProduct(m_vertices[index[2]] - v0), 0);
 
-#pragma region Grid Compound Geometry
+	return lowerDimension(invTranspose * cross).normal();
+}
 
-Grid::Grid()
+bool TriangleMesh::hit(const Ray& ray, float& tMin, ShaderData& shaderData) const
 {
+	int closest = -1;
+	float tClosest = tMin;
+
+	for (int i = 0; i < numTriangles(); ++i)
+	{
+		float t = tClosest;
+		if (hitCalculations(i, ray, t) && t < tClosest)
+		{
+			tClosest = t;
+			closest = i;
+		}
+	}
 
+	if (closest < 0)
+		return false;
+
+	tMin = tClosest;
+	shaderData.setHitPoint(ray.origin + ray.direction * tMin);
+	shaderData.setNormal(faceNormal(closest));
+	shaderData.setMaterialId(materialId);
+
+	return true;
 }
 
-Vector<3> Grid::minCoordinate()
+bool TriangleMesh::occluded(const Ray& ray, float tMax) const
 {
-	float epsilon = 0;
-	Vector<3> point{ MAX_T, MAX_T, MAX_T };
-	
-	for (unsigned i = 0; i < geometries.size(); ++i)
+	for (int i = 0; i < numTriangles(); ++i)
 	{
-		BoundingBox box = geometries[i]->getBoundingBox();
-
-		point[0] = fminf(point[0], box.min[0]);
-		point[1] = fminf(point[1], box.min[1]);
-		point[2] = fminf(point[2], box.min[2]);
+		float t = tMax;
+		if (hitCalculations(i, ray, t) && t < tMax)
+			return true;
 	}
 
-	point -= epsilon;
-	
-	return point;
+	return false;
 }
 
-Vector<3> Grid::maxCoordinate()
+void TriangleMesh::generateBoundingBox(Matrix<4,4> inv)
 {
-	float epsilon = 0;
-	Vector<3> point{ -MAX_T, -MAX_T, -MAX_T };
-	
-	for (unsigned i = 0; i < geometries.size(); ++i)
-	{
-		BoundingBox box = geometries[i]->getBoundingBox();
+	boundingBox.min = Vector<3>{ MAX_T, MAX_T, MAX_T };
+	boundingBox.max = Vector<3>{ -MAX_T, -MAX_T, -MAX_T };
 
-		point[0] = fmaxf(point[0], box.max[0]);
-		point[1] = fmaxf(point[1], box.max[1]);
-		point[2] = fmaxf(point[2], box.max[2]);
+	for (int i = 0; i < m_numVertices; ++i)
+	{
+		boundingBox.updateMin(m_vertices[i]);
+		boundingBox.updateMax(m_vertices[i]);
 	}
 
-	point += epsilon;
-	
-	return point;
+	boundingBox.min -= MIN_T;
+	boundingBox.max += MIN_T;
 }
 
-BoundingBox Grid::getBoundingBox()
+int TriangleMesh::primitiveCount() const
 {
-	return boundingBox;
+	return numTriangles();
 }
 
-void Grid::generateCells()
+BoundingBox TriangleMesh::primitiveBoundingBox(int triangle)
 {
-	auto min = minCoordinate();
-	auto max = maxCoordinate();
-
-	boundingBox.min = minCoordinate();
-	boundingBox.max = maxCoordinate();
-
-	int numObjects = geometries.size();
-	float dimx = max[0] - min[0];
-	float dimy = max[1] - min[1];
-	float dimz = max[2] - min[2];
-	float multiplier = 2.0f;
-	float side = pow(dimx * dimy * dimz / numObjects, 0.333333f);
-	nx = (int)round(multiplier * dimx / side) + 1;
-	ny = (int)round(multiplier * dimy / side) + 1;
-	nz = (int)round(multiplier * dimz / side) + 1;
-
-	int numCells = nx * ny * nz;
-	cells.reserve(numObjects);
+	const int *index = &m_indices[3 * triangle];
+	BoundingBox box;
 
-	for (int i = 0; i < numCells; ++i)
-		cells.push_back(NULL);
+	box.min = box.max = m_vertices[index[0]];
+	for (int i = 1; i < 3; ++i)
+	{
+		box.updateMin(m_vertices[index[i]]);
+		box.updateMax(m_vertices[index[i]]);
+	}
 
-	std::vector<int> counts;
-	counts.reserve(numCells);
+	// Pad the box slightly so flat, axis aligned triangles still have some volume
+	box.min -= MIN_T;
+	box.max += MIN_T;
 
-	for (int i = 0; i < numCells; i++)
-		counts.push_back(0);
+	return box;
+}
 
-	BoundingBox objectBox;
-	int index;
+bool TriangleMesh::hitPrimitive(int triangle, const Ray& ray, float& tMin, ShaderData& shaderData) const
+{
+	if (!hitCalculations(triangle, ray, tMin))
+		return false;
 
-	for (int i = 0; i < numObjects; i++)
-	{
-		objectBox = geometries[i]->getBoundingBox();
-		int ixmin = clamp((objectBox.min[0] - min[0]) * nx / dimx, 0, nx - 1);
-		int iymin = clamp((objectBox.min[1] - min[1]) * ny / dimy, 0, ny - 1);
-		int izmin = clamp((objectBox.min[2] - min[2]) * nz / dimz, 0, nz - 1);
-		int ixmax = clamp(round(objectBox.max[0] - min[0]) * nx / dimx, 0, nx - 1);
-		int iymax = clamp(round(objectBox.max[1] - min[1]) * ny / dimy, 0, ny - 1);
-		int izmax = clamp(round(objectBox.max[2] - min[2]) * nz / dimz, 0, nz - 1);
+	shade(triangle, ray, tMin, shaderData);
+	return true;
+}
 
-		for (int iz = izmin; iz <= izmax; iz++)
-		{
-			for (int iy = iymin; iy <= iymax; iy++)
-			{
-				for (int ix = ixmin; ix <= ixmax; ix++)
-				{
-					index = nx * ny * iz + nx * iy + ix;
-
-					if (counts[index] == 0)
-					{
-						cells[index] = geometries[i];
-						counts[index]++;
-					}
-					else
-					{
-						// If more than one object in a cell, create a compound geometry
-						if (counts[index] == 1)
-						{
-							Compound *compound = new Compound;
-							compound->addGeometry(cells[index]);
-							compound->addGeometry(geometries[i]);
-							cells[index] = compound;
-							counts[index]++;
-						}
-						else
-						{
-							cells[index]->addGeometry(geometries[i]);
-							counts[index]++;
-						}
-					}
-				}
-			}
-		}
-	}
-	geometries.erase(geometries.begin(), geometries.end());
-	counts.erase(counts.begin(), counts.end());
+bool TriangleMesh::occludedPrimitive(int triangle, const Ray& ray, float tMax) const
+{
+	float t = tMax;
+	return hitCalculations(triangle, ray, t) && t < tMax;
 }
 
-bool Grid::hitCalculations(const Ray& ray, float& tMin, GridData& gd) const
+PRIMITIVE_TYPE TriangleMesh::primitiveType() const
 {
-	float ox = ray.origin[0];
-	float oy = ray.origin[1];
-	float oz = ray.origin[2];
-	float dx = ray.direction[0];
-	float dy = ray.direction[1];
-	float dz = ray.direction[2];
+	return m_watertight ? PRIMITIVE_WATERTIGHT : PRIMITIVE_TRIANGLE;
+}
 
-	float x0 = boundingBox.min[0];
-	float y0 = boundingBox.min[1];
-	float z0 = boundingBox.min[2];
-	float x1 = boundingBox.max[0];
-	float y1 = boundingBox.max[1];
-	float z1 = boundingBox.max[2];
+#pragma endregion
 
-	float txMin, tyMin, tzMin;
-	float txMax, tyMax, tzMax;
+#pragma region Compound Geometry
 
-	float a = 1.0f / dx;
-	txMin = (a >= 0) ? (x0 - ox) * a : (x1 - ox) * a;
-	txMax = (a >= 0) ? (x1 - ox) * a : (x0 - ox) * a;
+Compound::Compound()
+	: Geometry{ 0, Matrix<4, 4>{} }, primitives{}, buildThreads{ 1 }
+{
 
-	float b = 1.0f / dy;
-	tyMin = (b >= 0) ? (y0 - oy) * b : (y1 - oy) * b;
-	tyMax = (b >= 0) ? (y1 - oy) * b : (y0 - oy) * b;
+}
 
-	float c = 1.0f / dz;
-	tzMin = (c >= 0) ? (z0 - oz) * c : (z1 - oz) * c;
-	tzMax = (c >= 0) ? (z1 - oz) * c : (z0 - oz) * c;
+Compound::Compound(const Compound &c)
+	: Geometry(c.materialId, c.invTransform), primitives{ c.primitives }, groupStorage{ c.groupStorage },
+	  groups{ c.groups.data() == c.groupStorage.data() ? ArrayView<PrimitiveGroup>{ groupStorage } : c.groups },
+	  primitiveSlots{ c.primitiveSlots }, spheres{ c.spheres }, triangles{ c.triangles },
+	  watertightTriangles{ c.watertightTriangles }, buildThreads{ c.buildThreads }
+{
 
-	float t0, t1;
+}
+
+Compound& Compound::operator =(const Compound& c)
+{
+	Compound result{ c };
+	primitives = result.primitives;
+	groupStorage = result.groupStorage;
+	groups = c.groups.data() == c.groupStorage.data() ? ArrayView<PrimitiveGroup>{ groupStorage } : c.groups;
+	primitiveSlots = result.primitiveSlots;
+	spheres = result.spheres;
+	triangles = result.triangles;
+	watertightTriangles = result.watertightTriangles;
+	buildThreads = result.buildThreads;
+
+	return *this;
+}
+
+void Compound::addGeometry(Geometry *geo)
+{
+	int count = geo->primitiveCount();
+
+	for (int i = 0; i < count; ++i)
+		primitives.push_back(Primitive{ geo, i });
+}
+
+void Compound::addPrimitive(Primitive primitive)
+{
+	primitives.push_back(primitive);
+}
+
+void Compound::reserve(int count)
+{
+	primitives.reserve(count);
+}
+
+void Compound::setBuildThreads(int threads)
+{
+	buildThreads = std::max(threads, 1);
+}
+
+bool Compound::hit(const Ray& ray, float& tMin, ShaderData& sd) const
+{
+	PrimitiveHit closest{ tMin, false };
+	hitGroups(0, (int)groups.size(), ray, PrecomputedRay{ ray }, closest, sd);
+
+	if (closest.found)
+	{
+		tMin = closest.t;
+		shadeHit(closest, ray, sd);
+	}
+
+	return closest.found;
+}
+
+bool Compound::occluded(const Ray& ray, float tMax) const
+{
+	return occludedGroups(0, (int)groups.size(), ray, PrecomputedRay{ ray }, tMax);
+}
+
+// Puts the primitives begin up to end in order of kind, keeping their order within each kind
+void Compound::sortPrimitives(int begin, int end)
+{
+	std::stable_sort(primitives.begin() + begin, primitives.begin() + end, [](const Primitive& a, const Primitive& b)
+	{
+		return a.geometry->primitiveType() < b.geometry->primitiveType();
+	});
+}
+
+void Compound::groupPrimitives(int first, int count)
+{
+	for (int i = first; i < first + count; i += BOX_GROUP_SIZE)
+	{
+		PrimitiveGroup group;
+		group.first = i;
+		group.count = std::min(BOX_GROUP_SIZE, first + count - i);
+
+		for (int lane = 0; lane < group.count; ++lane)
+		{
+			const Primitive& primitive = primitives[i + lane];
+			BoundingBox box = primitive.geometry->primitiveBoundingBox(primitive.index);
+			group.boxes.setBox(lane, box.min, box.max);
+		}
+
+		groupStorage.push_back(group);
+	}
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Copies the primitives into the arrays of their kind and tags every box group with the kind its
+   lanes share. Called once the groups are built, and again after loading them from a cache, so
+   returns false if a group refers to a primitive that doesn't exist.
+   -------------------------------------------------------------------------------------------------
+*/
+bool Compound::gatherPrimitives()
+{
+	int numPrimitives = (int)primitives.size();
+	std::vector<PRIMITIVE_TYPE> types(numPrimitives);
+
+	primitiveSlots.assign(numPrimitives, -1);
+	spheres.clear();
+	triangles.clear();
+	watertightTriangles.clear();
+
+	// A mesh's triangles follow one another, so its kind is only looked up when the geometry changes
+	const Geometry *geometry = NULL;
+	PRIMITIVE_TYPE type = PRIMITIVE_GEOMETRY;
+	int counts[PRIMITIVE_WATERTIGHT + 1] = {};
+
+	for (int i = 0; i < numPrimitives; ++i)
+	{
+		if (primitives[i].geometry != geometry)
+		{
+			geometry = primitives[i].geometry;
+			type = geometry->primitiveType();
+		}
+
+		types[i] = type;
+		++counts[type];
+	}
+
+	spheres.reserve(counts[PRIMITIVE_SPHERE]);
+	triangles.reserve(counts[PRIMITIVE_TRIANGLE]);
+	watertightTriangles.reserve(counts[PRIMITIVE_WATERTIGHT]);
+
+	for (int i = 0; i < numPrimitives; ++i)
+	{
+		const Primitive& primitive = primitives[i];
+
+		if (types[i] == PRIMITIVE_SPHERE)
+		{
+			primitiveSlots[i] = (int)spheres.size();
+			spheres.push_back(static_cast<const Sphere*>(primitive.geometry)->record());
+		}
+		else if (types[i] == PRIMITIVE_TRIANGLE)
+		{
+			primitiveSlots[i] = (int)triangles.size();
+			triangles.push_back(static_cast<const TriangleMesh*>(primitive.geometry)->record(primitive.index));
+		}
+		else if (types[i] == PRIMITIVE_WATERTIGHT)
+		{
+			primitiveSlots[i] = (int)watertightTriangles.size();
+			watertightTriangles.push_back(static_cast<const TriangleMesh*>(primitive.geometry)->watertightRecord(primitive.index));
+		}
+	}
+
+	// Looked up once, rather than through a virtual call for every lane
+	const ArrayView<int> *members = groupMembers();
+
+	for (size_t g = 0; g < groups.size(); ++g)
+	{
+		const PrimitiveGroup& group = groups[g];
+		PRIMITIVE_TYPE groupType = PRIMITIVE_GEOMETRY;
+
+		if (group.count < 0 || group.count > BOX_GROUP_SIZE ||
+			(members && (group.first < 0 || (size_t)group.first + group.count > members->size())))
+			return false;
+
+		for (int lane = 0; lane < group.count; ++lane)
+		{
+			int id = members ? (*members)[group.first + lane] : group.first + lane;
+			if (id < 0 || id >= numPrimitives)
+				return false;
+
+			if (lane == 0)
+				groupType = types[id];
+			else if (types[id] != groupType)
+				groupType = PRIMITIVE_GEOMETRY;
+		}
+
+		// Groups viewed in a mapped cache can't be changed, but were saved already tagged
+		if (group.type != groupType)
+		{
+			if (groups.data() != groupStorage.data())
+				return false;
+
+			groupStorage[g].type = groupType;
+		}
+	}
+
+	return true;
+}
+
+// Table the lanes of the compound's groups index into, or NULL as they hold consecutive primitives
+const ArrayView<int>* Compound::groupMembers() const
+{
+	return NULL;
+}
+
+// Points the views the compound is traced through at the arrays its build filled
+void Compound::viewStorage()
+{
+	groups = ArrayView<PrimitiveGroup>{ groupStorage };
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Tests the primitives in the given lanes of a box group, updating the closest hit. lookup turns a
+   lane into the primitive it holds, or -1 to skip it. The kind of primitive is decided once for
+   the whole group, so spheres and triangles are intersected without a virtual call.
+   -------------------------------------------------------------------------------------------------
+*/
+template <typename Lookup>
+void Compound::hitLanes(const PrimitiveGroup& group, unsigned lanes, Lookup lookup, const Ray& ray,
+	PrimitiveHit& closest, ShaderData& sd) const
+{
+	switch (group.type)
+	{
+	case PRIMITIVE_SPHERE:
+		while (lanes)
+		{
+			int id = lookup(lowestLane(lanes));
+			lanes &= lanes - 1;
+
+			float t = closest.t;
+			if (id >= 0 && sphereIntersection(spheres[primitiveSlots[id]], ray, t) && t < closest.t)
+			{
+				closest.t = t;
+				closest.found = true;
+				closest.type = PRIMITIVE_SPHERE;
+				closest.slot = primitiveSlots[id];
+			}
+		}
+		break;
+
+	case PRIMITIVE_TRIANGLE:
+		while (lanes)
+		{
+			int id = lookup(lowestLane(lanes));
+			lanes &= lanes - 1;
+
+			if (id < 0)
+				continue;
+
+			const TriangleRecord& triangle = triangles[primitiveSlots[id]];
+			float t = closest.t;
+			if (triangleIntersection(triangle.v0, triangle.edge1, triangle.edge2, ray, t) && t < closest.t)
+			{
+				closest.t = t;
+				closest.found = true;
+				closest.type = PRIMITIVE_TRIANGLE;
+				closest.slot = primitiveSlots[id];
+			}
+		}
+		break;
+
+	case PRIMITIVE_WATERTIGHT:
+	{
+		WatertightRay sheared{ ray };
+
+		while (lanes)
+		{
+			int id = lookup(lowestLane(lanes));
+			lanes &= lanes - 1;
+
+			if (id < 0)
+				continue;
+
+			const WatertightRecord& triangle = watertightTriangles[primitiveSlots[id]];
+			float t = closest.t;
+			if (watertightIntersection(triangle.v0, triangle.v1, triangle.v2, sheared, t) && t < closest.t)
+			{
+				closest.t = t;
+				closest.found = true;
+				closest.type = PRIMITIVE_WATERTIGHT;
+				closest.slot = primitiveSlots[id];
+			}
+		}
+		break;
+	}
+
+	default:
+		while (lanes)
+		{
+			int id = lookup(lowestLane(lanes));
+			lanes &= lanes - 1;
+
+			// A rejected hit can still write to the shader data, so the closest one is kept aside
+			float t = closest.t;
+			if (id >= 0 && primitives[id].geometry->hitPrimitive(primitives[id].index, ray, t, sd) && t < closest.t)
+			{
+				closest.t = t;
+				closest.found = true;
+				closest.type = PRIMITIVE_GEOMETRY;
+				closest.materialId = sd.getMaterialId();
+				closest.normal = sd.getNormal();
+				closest.hitPoint = sd.getHitPoint();
+			}
+		}
+		break;
+	}
+}
+
+template <typename Lookup>
+bool Compound::occludedLanes(const PrimitiveGroup& group, unsigned lanes, Lookup lookup, const Ray& ray, float tMax) const
+{
+	switch (group.type)
+	{
+	case PRIMITIVE_SPHERE:
+		while (lanes)
+		{
+			int id = lookup(lowestLane(lanes));
+			lanes &= lanes - 1;
+
+			float t = tMax;
+			if (id >= 0 && sphereIntersection(spheres[primitiveSlots[id]], ray, t) && t < tMax)
+				return true;
+		}
+		return false;
+
+	case PRIMITIVE_TRIANGLE:
+		while (lanes)
+		{
+			int id = lookup(lowestLane(lanes));
+			lanes &= lanes - 1;
+
+			if (id < 0)
+				continue;
+
+			const TriangleRecord& triangle = triangles[primitiveSlots[id]];
+			float t = tMax;
+			if (triangleIntersection(triangle.v0, triangle.edge1, triangle.edge2, ray, t) && t < tMax)
+				return true;
+		}
+		return false;
+
+	case PRIMITIVE_WATERTIGHT:
+	{
+		WatertightRay sheared{ ray };
+
+		while (lanes)
+		{
+			int id = lookup(lowestLane(lanes));
+			lanes &= lanes - 1;
+
+			if (id < 0)
+				continue;
+
+			const WatertightRecord& triangle = watertightTriangles[primitiveSlots[id]];
+			float t = tMax;
+			if (watertightIntersection(triangle.v0, triangle.v1, triangle.v2, sheared, t) && t < tMax)
+				return true;
+		}
+		return false;
+	}
+
+	default:
+		while (lanes)
+		{
+			int id = lookup(lowestLane(lanes));
+			lanes &= lanes - 1;
+
+			if (id >= 0 && primitives[id].geometry->occludedPrimitive(primitives[id].index, ray, tMax))
+				return true;
+		}
+		return false;
+	}
+}
+
+// Fills in the shader data for the closest hit, once it's known
+void Compound::shadeHit(const PrimitiveHit& hit, const Ray& ray, ShaderData& sd) const
+{
+	if (hit.type == PRIMITIVE_SPHERE)
+		spheres[hit.slot].sphere->shade(ray, hit.t, sd);
+	else if (hit.type == PRIMITIVE_TRIANGLE)
+		triangles[hit.slot].mesh->shade(triangles[hit.slot].index, ray, hit.t, sd);
+	else if (hit.type == PRIMITIVE_WATERTIGHT)
+		watertightTriangles[hit.slot].mesh->shade(watertightTriangles[hit.slot].index, ray, hit.t, sd);
+	else
+	{
+		sd.setNormal(hit.normal);
+		sd.setHitPoint(hit.hitPoint);
+		sd.setMaterialId(hit.materialId);
+	}
+}
+
+void Compound::hitGroups(int begin, int end, const Ray& ray, const PrecomputedRay& pray, PrimitiveHit& closest, ShaderData& sd) const
+{
+	for (int g = begin; g < end; ++g)
+	{
+		// Only intersect the primitives whose boxes the ray enters before the closest hit so far
+		const PrimitiveGroup& group = groups[g];
+		unsigned lanes = hitBoxGroup(group.boxes, pray, closest.t);
+
+		if (lanes)
+			hitLanes(group, lanes, [&group](int lane) { return group.first + lane; }, ray, closest, sd);
+	}
+}
+
+bool Compound::occludedGroups(int begin, int end, const Ray& ray, const PrecomputedRay& pray, float tMax) const
+{
+	for (int g = begin; g < end; ++g)
+	{
+		const PrimitiveGroup& group = groups[g];
+		unsigned lanes = hitBoxGroup(group.boxes, pray, tMax);
+
+		if (lanes && occludedLanes(group, lanes, [&group](int lane) { return group.first + lane; }, ray, tMax))
+			return true;
+	}
+
+	return false;
+}
+
+void Compound::generateBoundingBox(Matrix<4, 4> m)
+{
+	// TODO
+}
+
+bool Compound::build()
+{
+	sortPrimitives(0, (int)primitives.size());
+	groupStorage.clear();
+	groupPrimitives(0, (int)primitives.size());
+	viewStorage();
+	return gatherPrimitives();
+}
+
+BoundingBox Compound::getBoundingBox()
+{
+	boundingBox.min = Vector<3>{ MAX_T, MAX_T, MAX_T };
+	boundingBox.max = Vector<3>{ -MAX_T, -MAX_T, -MAX_T };
+	
+	for (unsigned i = 0; i < primitives.size(); ++i)
+	{
+		BoundingBox box = primitives[i].geometry->primitiveBoundingBox(primitives[i].index);
+
+		boundingBox.updateMin(box.min);
+		boundingBox.updateMax(box.max);
+	}
+
+	return boundingBox;
+}
+
+#pragma endregion
+
+#pragma region Grid Compound Geometry
+
+Grid::Grid()
+	: nx{ 0 }, ny{ 0 }, nz{ 0 }, multiplier{ GRID_MULTIPLIER }, density{ GRID_DENSITY }
+{
+
+}
+
+Vector<3> Grid::minCoordinate(const std::vector<BoundingBox>& boxes)
+{
+	float epsilon = 0;
+	Vector<3> point{ MAX_T, MAX_T, MAX_T };
+	
+	for (unsigned i = 0; i < boxes.size(); ++i)
+	{
+		point[0] = fminf(point[0], boxes[i].min[0]);
+		point[1] = fminf(point[1], boxes[i].min[1]);
+		point[2] = fminf(point[2], boxes[i].min[2]);
+	}
+
+	point -= epsilon;
+	
+	return point;
+}
+
+Vector<3> Grid::maxCoordinate(const std::vector<BoundingBox>& boxes)
+{
+	float epsilon = 0;
+	Vector<3> point{ -MAX_T, -MAX_T, -MAX_T };
+	
+	for (unsigned i = 0; i < boxes.size(); ++i)
+	{
+		point[0] = fmaxf(point[0], boxes[i].max[0]);
+		point[1] = fmaxf(point[1], boxes[i].max[1]);
+		point[2] = fmaxf(point[2], boxes[i].max[2]);
+	}
+
+	point += epsilon;
+	
+	return point;
+}
+
+BoundingBox Grid::getBoundingBox()
+{
+	return boundingBox;
+}
+
+bool Grid::build()
+{
+	sortPrimitives(0, (int)primitives.size());
+	generateCells();
+	viewStorage();
+	return gatherPrimitives();
+}
+
+void Grid::setMultiplier(float m)
+{
+	multiplier = m;
+}
+
+void Grid::setDensity(int d)
+{
+	density = d;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Number of cells along each axis for count primitives spread over a box, about multiplier cells
+   per primitive along each axis when the primitives are laid out evenly.
+   -------------------------------------------------------------------------------------------------
+*/
+void Grid::resolution(const BoundingBox& box, int count, int& rx, int& ry, int& rz) const
+{
+	float dimx = box.max[0] - box.min[0];
+	float dimy = box.max[1] - box.min[1];
+	float dimz = box.max[2] - box.min[2];
+	float side = pow(dimx * dimy * dimz / count, 0.333333f);
+
+	// A flat box has no volume to share out
+	if (!(side > 0))
+	{
+		rx = ry = rz = 1;
+		return;
+	}
+
+	rx = (int)round(multiplier * dimx / side) + 1;
+	ry = (int)round(multiplier * dimy / side) + 1;
+	rz = (int)round(multiplier * dimz / side) + 1;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Builds the cells in parallel. Primitive boxes are found, counted into the cells they overlap and
+   written into the cells' runs by blocks of primitives on separate threads. Counting and filling
+   use atomics, so the threads' writes land in whatever order they happen to run; sorting each run
+   afterwards restores primitive order, so the grid comes out the same whatever the thread count.
+   Dense cells are then split into sub-grids, one sub-grid per thread, and their cells appended to
+   the runs and groups of the top level.
+   -------------------------------------------------------------------------------------------------
+*/
+void Grid::generateCells()
+{
+	int numObjects = primitives.size();
+	std::vector<BoundingBox> boxes(numObjects);
+
+	parallelFor(numObjects, buildThreads, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			boxes[i] = primitives[i].geometry->primitiveBoundingBox(primitives[i].index);
+	});
+
+	boundingBox.min = minCoordinate(boxes);
+	boundingBox.max = maxCoordinate(boxes);
+	resolution(boundingBox, numObjects, nx, ny, nz);
+
+	int numCells = nx * ny * nz;
+
+	// Count the primitives overlapping each cell
+	std::vector<std::atomic<int>> counts(numCells);
+
+	parallelFor(numObjects, buildThreads, [&](int begin, int end)
+	{
+		int lo[3], hi[3];
+
+		for (int i = begin; i < end; i++)
+		{
+			cellRange(boundingBox, nx, ny, nz, boxes[i], lo, hi);
+
+			for (int iz = lo[2]; iz <= hi[2]; iz++)
+				for (int iy = lo[1]; iy <= hi[1]; iy++)
+					for (int ix = lo[0]; ix <= hi[0]; ix++)
+						counts[nx * ny * iz + nx * iy + ix].fetch_add(1, std::memory_order_relaxed);
+		}
+	});
+
+	// The prefix sum of the counts gives the start of each cell's run, and of its box groupStorage. A dense
+	// cell's primitives are grouped in its sub-grid instead, so at the top level it has none
+	std::vector<int> offsets(numCells + 1, 0);
+	cellOffsetStorage.assign(numCells + 1, 0);
+	cellSubGridStorage.assign(numCells, -1);
+	subGridStorage.clear();
+
+	for (int cell = 0; cell < numCells; ++cell)
+	{
+		int count = counts[cell].load(std::memory_order_relaxed);
+		offsets[cell + 1] = offsets[cell] + count;
+
+		if (density > 0 && count > density)
+		{
+			cellSubGridStorage[cell] = subGridStorage.size();
+			subGridStorage.push_back(SubGrid{});
+			cellOffsetStorage[cell + 1] = cellOffsetStorage[cell];
+		}
+		else
+			cellOffsetStorage[cell + 1] = cellOffsetStorage[cell] + (count + BOX_GROUP_SIZE - 1) / BOX_GROUP_SIZE;
+
+		// From here on the count is the cell's fill cursor
+		counts[cell].store(offsets[cell], std::memory_order_relaxed);
+	}
+
+	// Fill the runs in
+	cellPrimitiveStorage.assign(offsets[numCells], 0);
+
+	parallelFor(numObjects, buildThreads, [&](int begin, int end)
+	{
+		int lo[3], hi[3];
+
+		for (int i = begin; i < end; i++)
+		{
+			cellRange(boundingBox, nx, ny, nz, boxes[i], lo, hi);
+
+			for (int iz = lo[2]; iz <= hi[2]; iz++)
+				for (int iy = lo[1]; iy <= hi[1]; iy++)
+					for (int ix = lo[0]; ix <= hi[0]; ix++)
+						cellPrimitiveStorage[counts[nx * ny * iz + nx * iy + ix].fetch_add(1, std::memory_order_relaxed)] = i;
+		}
+	});
+
+	// Splits the run of cellPrimitives from begin to end into the box groups firstGroup onwards
+	auto makeGroups = [&](int firstGroup, int begin, int end)
+	{
+		for (int first = begin, g = firstGroup; first < end; first += BOX_GROUP_SIZE, ++g)
+		{
+			PrimitiveGroup& group = groupStorage[g];
+			group.first = first;
+			group.count = std::min(BOX_GROUP_SIZE, end - first);
+
+			for (int lane = 0; lane < group.count; ++lane)
+			{
+				const BoundingBox& box = boxes[cellPrimitiveStorage[group.first + lane]];
+				group.boxes.setBox(lane, box.min, box.max);
+			}
+		}
+	};
+
+	// Put each cell's primitives back in the order they were added and split its run into groups for
+	// the SIMD box test
+	groupStorage.assign(cellOffsetStorage[numCells], PrimitiveGroup{});
+
+	parallelFor(numCells, buildThreads, [&](int begin, int end)
+	{
+		for (int cell = begin; cell < end; ++cell)
+		{
+			std::sort(cellPrimitiveStorage.begin() + offsets[cell], cellPrimitiveStorage.begin() + offsets[cell + 1]);
+
+			if (cellSubGridStorage[cell] < 0)
+				makeGroups(cellOffsetStorage[cell], offsets[cell], offsets[cell + 1]);
+		}
+	});
+
+	// Each sub-grid is built apart, as runs of primitives and the offsets of those runs, with the same
+	// count and fill passes as the top level. There are few of them but each is a lot of work, so
+	// they're shared out one at a time
+	int numSubGrids = subGridStorage.size();
+	std::vector<int> denseCells(numSubGrids);
+	std::vector<std::vector<int>> subOffsets(numSubGrids);
+	std::vector<std::vector<int>> subPrimitives(numSubGrids);
+
+	for (int cell = 0; cell < numCells; ++cell)
+	{
+		if (cellSubGridStorage[cell] >= 0)
+			denseCells[cellSubGridStorage[cell]] = cell;
+	}
+
+	parallelFor(numSubGrids, buildThreads, [&](int begin, int end)
+	{
+		int lo[3], hi[3];
+
+		for (int s = begin; s < end; ++s)
+		{
+			int cell = denseCells[s];
+			int c[3] = { cell % nx, cell / nx % ny, cell / (nx * ny) };
+			int n[3] = { nx, ny, nz };
+			SubGrid& sub = subGridStorage[s];
+
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				float dim = boundingBox.max[axis] - boundingBox.min[axis];
+				sub.box.min[axis] = boundingBox.min[axis] + c[axis] * dim / n[axis];
+				sub.box.max[axis] = boundingBox.min[axis] + (c[axis] + 1) * dim / n[axis];
+			}
+
+			resolution(sub.box, offsets[cell + 1] - offsets[cell], sub.nx, sub.ny, sub.nz);
+
+			int subCells = sub.nx * sub.ny * sub.nz;
+			std::vector<int>& runOffsets = subOffsets[s];
+			runOffsets.assign(subCells + 1, 0);
+
+			for (int i = offsets[cell]; i < offsets[cell + 1]; ++i)
+			{
+				cellRange(sub.box, sub.nx, sub.ny, sub.nz, boxes[cellPrimitiveStorage[i]], lo, hi);
+
+				for (int iz = lo[2]; iz <= hi[2]; iz++)
+					for (int iy = lo[1]; iy <= hi[1]; iy++)
+						for (int ix = lo[0]; ix <= hi[0]; ix++)
+							++runOffsets[sub.nx * sub.ny * iz + sub.nx * iy + ix + 1];
+			}
+
+			for (int j = 0; j < subCells; ++j)
+				runOffsets[j + 1] += runOffsets[j];
+
+			// The dense cell's run is already sorted, so the sub-cells' runs come out sorted too
+			std::vector<int> cursors(runOffsets.begin(), runOffsets.end() - 1);
+			subPrimitives[s].assign(runOffsets[subCells], 0);
+
+			for (int i = offsets[cell]; i < offsets[cell + 1]; ++i)
+			{
+				cellRange(sub.box, sub.nx, sub.ny, sub.nz, boxes[cellPrimitiveStorage[i]], lo, hi);
+
+				for (int iz = lo[2]; iz <= hi[2]; iz++)
+					for (int iy = lo[1]; iy <= hi[1]; iy++)
+						for (int ix = lo[0]; ix <= hi[0]; ix++)
+							subPrimitives[s][cursors[sub.nx * sub.ny * iz + sub.nx * iy + ix]++] = cellPrimitiveStorage[i];
+			}
+		}
+	}, 1);
+
+	// Number the sub-grids' cells and groups after the top level's and append their runs
+	std::vector<int> runStarts(numSubGrids);
+	subCellOffsetStorage.assign(1, cellOffsetStorage[numCells]);
+
+	for (int s = 0; s < numSubGrids; ++s)
+	{
+		const std::vector<int>& runOffsets = subOffsets[s];
+		subGridStorage[s].firstCell = subCellOffsetStorage.size() - 1;
+		runStarts[s] = cellPrimitiveStorage.size();
+
+		for (unsigned j = 0; j + 1 < runOffsets.size(); ++j)
+			subCellOffsetStorage.push_back(subCellOffsetStorage.back() + (runOffsets[j + 1] - runOffsets[j] + BOX_GROUP_SIZE - 1) / BOX_GROUP_SIZE);
+
+		cellPrimitiveStorage.insert(cellPrimitiveStorage.end(), subPrimitives[s].begin(), subPrimitives[s].end());
+		subPrimitives[s] = std::vector<int>{};
+	}
+
+	groupStorage.resize(subCellOffsetStorage.back());
+
+	parallelFor(numSubGrids, buildThreads, [&](int begin, int end)
+	{
+		for (int s = begin; s < end; ++s)
+		{
+			const std::vector<int>& runOffsets = subOffsets[s];
+
+			for (unsigned j = 0; j + 1 < runOffsets.size(); ++j)
+				makeGroups(subCellOffsetStorage[subGridStorage[s].firstCell + j], runStarts[s] + runOffsets[j], runStarts[s] + runOffsets[j + 1]);
+		}
+	}, 1);
+}
+
+// A grid's groups hold runs of cellPrimitives, which point in turn to the primitives
+const ArrayView<int>* Grid::groupMembers() const
+{
+	return &cellPrimitives;
+}
+
+void Grid::viewStorage()
+{
+	Compound::viewStorage();
+	cellOffsets = ArrayView<int>{ cellOffsetStorage };
+	cellPrimitives = ArrayView<int>{ cellPrimitiveStorage };
+	cellSubGrids = ArrayView<int>{ cellSubGridStorage };
+	subCellOffsets = ArrayView<int>{ subCellOffsetStorage };
+	subGrids = ArrayView<SubGrid>{ subGridStorage };
+}
+
+// Range of cells, inclusive, that a bounding box overlaps along each axis of a grid over bounds
+void Grid::cellRange(const BoundingBox& bounds, int rx, int ry, int rz, const BoundingBox& box, int lo[3], int hi[3])
+{
+	int n[3] = { rx, ry, rz };
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float dim = bounds.max[axis] - bounds.min[axis];
+		lo[axis] = clamp((box.min[axis] - bounds.min[axis]) * n[axis] / dim, 0, n[axis] - 1);
+		hi[axis] = clamp((box.max[axis] - bounds.min[axis]) * n[axis] / dim, 0, n[axis] - 1);
+	}
+}
+
+// Sets up the walk of a ray through a grid of nx by ny by nz cells over bounds
+bool Grid::hitCalculations(const BoundingBox& bounds, int nx, int ny, int nz, const Ray& ray, const PrecomputedRay& pray, GridData& gd)
+{
+	float ox = ray.origin[0];
+	float oy = ray.origin[1];
+	float oz = ray.origin[2];
+	float dx = ray.direction[0];
+	float dy = ray.direction[1];
+	float dz = ray.direction[2];
+
+	float x0 = bounds.min[0];
+	float y0 = bounds.min[1];
+	float z0 = bounds.min[2];
+	float x1 = bounds.max[0];
+	float y1 = bounds.max[1];
+	float z1 = bounds.max[2];
+
+	float txMin, tyMin, tzMin;
+	float txMax, tyMax, tzMax;
+
+	float a = pray.invDirection[0];
+	txMin = pray.sign[0] ? (x1 - ox) * a : (x0 - ox) * a;
+	txMax = pray.sign[0] ? (x0 - ox) * a : (x1 - ox) * a;
+
+	float b = pray.invDirection[1];
+	tyMin = pray.sign[1] ? (y1 - oy) * b : (y0 - oy) * b;
+	tyMax = pray.sign[1] ? (y0 - oy) * b : (y1 - oy) * b;
+
+	float c = pray.invDirection[2];
+	tzMin = pray.sign[2] ? (z1 - oz) * c : (z0 - oz) * c;
+	tzMax = pray.sign[2] ? (z0 - oz) * c : (z1 - oz) * c;
+
+	float t0, t1;
+
+	t0 = (txMin > tyMin) ? txMin : tyMin;
+	if (tzMin > t0)
+		t0 = tzMin;
+
+	t1 = (txMax < tyMax) ? txMax : tyMax;
+	if (tzMax < t1)
+		t1 = tzMax;
+
+	if (t0 > t1)
+		return false;
+
+	float dimx = x1 - x0;
+	float dimy = y1 - y0;
+	float dimz = z1 - z0;
+	if (bounds.inside(ray.origin))
+	{
+		gd.ix = clamp((ox - x0) * nx / dimx, 0, nx - 1);
+		gd.iy = clamp((oy - y0) * ny / dimy, 0, ny - 1);
+		gd.iz = clamp((oz - z0) * nz / dimz, 0, nz - 1);
+	}
+	else
+	{
+		Vector<3> p = ray.origin + ray.direction * t0;
+		gd.ix = clamp((p[0] - x0) * nx / (dimx - 0), 0, nx - 1);
+		gd.iy = clamp((p[1] - y0) * ny / (dimy - 0), 0, ny - 1);
+		gd.iz = clamp((p[2] - z0) * nz / (dimz - 0), 0, nz - 1);
+	}
+
+	gd.dtx = (txMax - txMin) / nx;
+	gd.dty = (tyMax - tyMin) / ny;
+	gd.dtz = (tzMax - tzMin) / nz;
+
+	if (dx > 0)
+	{
+		gd.txNext = txMin + (gd.ix + 1) * gd.dtx;
+		gd.ixStep = 1;
+		gd.ixStop = nx;
+	}
+	else if (dx == 0.0)
+	{
+		gd.txNext = MAX_T;
+		gd.ixStep = -1;
+		gd.ixStop = -1;
+	}
+	else
+	{
+		gd.txNext = txMin + (nx - gd.ix) * gd.dtx;
+		gd.ixStep = -1;
+		gd.ixStop = -1;
+	}
+
+	if (dy > 0)
+	{
+		gd.tyNext = tyMin + (gd.iy + 1) * gd.dty;
+		gd.iyStep = 1;
+		gd.iyStop = ny;
+	}
+	else if (dy == 0.0)
+	{
+		gd.tyNext = MAX_T;
+		gd.iyStep = -1;
+		gd.iyStop = -1;
+	}
+	else
+	{
+		gd.tyNext = tyMin + (ny - gd.iy) * gd.dty;
+		gd.iyStep = -1;
+		gd.iyStop = -1;
+	}
+
+	if (dz > 0)
+	{
+		gd.tzNext = tzMin + (gd.iz + 1) * gd.dtz;
+		gd.izStep = 1;
+		gd.izStop = nz;
+	}
+	else if (dz == 0.0)
+	{
+		gd.tzNext = MAX_T;
+		gd.izStep = -1;
+		gd.izStop = -1;
+	}
+	else
+	{
+		gd.tzNext = tzMin + (nz - gd.iz) * gd.dtz;
+		gd.izStep = -1;
+		gd.izStop = -1;
+	}
+
+	return true;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Tests the ray against the primitives of the box groups begin up to end, keeping the closest hit
+   in closest. Every primitive is tested once, in the first cell the ray meets it in.
+   -------------------------------------------------------------------------------------------------
+*/
+void Grid::hitCell(int begin, int end, const Ray& ray, const PrecomputedRay& pray, ShaderData& sd, Mailbox& mailbox, PrimitiveHit& closest) const
+{
+	for (int g = begin; g < end; ++g)
+	{
+		const PrimitiveGroup& group = groups[g];
+		unsigned lanes = hitBoxGroup(group.boxes, pray, closest.t);
+
+		if (!lanes)
+			continue;
+
+		hitLanes(group, lanes, [&](int lane)
+		{
+			int id = cellPrimitives[group.first + lane];
+			return mailbox.visit(id) ? id : -1;
+		}, ray, closest, sd);
+	}
+}
+
+// Walks the cells of a sub-grid like hit walks the top level, returning true once the closest hit is found
+bool Grid::hitSubGrid(const SubGrid& sub, const Ray& ray, const PrecomputedRay& pray, ShaderData& sd, Mailbox& mailbox, PrimitiveHit& closest) const
+{
+	GridData gd;
+
+	if (!hitCalculations(sub.box, sub.nx, sub.ny, sub.nz, ray, pray, gd))
+		return false;
+
+	while (true)
+	{
+		int cell = sub.firstCell + gd.ix + sub.nx * gd.iy + sub.nx * sub.ny * gd.iz;
+		++threadCounters.gridCellsVisited;
+
+		hitCell(subCellOffsets[cell], subCellOffsets[cell + 1], ray, pray, sd, mailbox, closest);
+
+		if (closest.found && closest.t < gd.exit())
+			return true;
+
+		if (!gd.step())
+			return false;
+	}
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Walks the cells along the ray in order, and through the sub-grid of any dense cell on the way.
+   The closest hit so far is carried from cell to cell. A hit can lie beyond the cell it was found
+   in, so it's only returned once the walk has passed every cell in front of it.
+   -------------------------------------------------------------------------------------------------
+*/
+bool Grid::hit(const Ray& ray, float& t, ShaderData& sd) const
+{
+	GridData gd;
+	Mailbox mailbox;
+	PrecomputedRay pray{ ray };
+	PrimitiveHit closest{ t, false };
+
+	if (!hitCalculations(boundingBox, nx, ny, nz, ray, pray, gd))
+		return false;
+
+	while (true)
+	{
+		int cell = gd.ix + nx * gd.iy + nx * ny * gd.iz;
+		++threadCounters.gridCellsVisited;
+
+		if (cellSubGrids[cell] < 0)
+			hitCell(cellOffsets[cell], cellOffsets[cell + 1], ray, pray, sd, mailbox, closest);
+		else if (hitSubGrid(subGrids[cellSubGrids[cell]], ray, pray, sd, mailbox, closest))
+			break;
+
+		if ((closest.found && closest.t < gd.exit()) || !gd.step())
+			break;
+	}
+
+	if (closest.found)
+	{
+		t = closest.t;
+		shadeHit(closest, ray, sd);
+	}
+
+	return closest.found;
+}
+
+// Tests the primitives of the box groups begin up to end for one blocking the ray before tMax
+bool Grid::occludedCell(int begin, int end, const Ray& ray, const PrecomputedRay& pray, float tMax, Mailbox& mailbox) const
+{
+	for (int g = begin; g < end; ++g)
+	{
+		const PrimitiveGroup& group = groups[g];
+		unsigned lanes = hitBoxGroup(group.boxes, pray, tMax);
+
+		if (lanes && occludedLanes(group, lanes, [&](int lane)
+		{
+			int id = cellPrimitives[group.first + lane];
+			return mailbox.visit(id) ? id : -1;
+		}, ray, tMax))
+			return true;
+	}
+
+	return false;
+}
+
+bool Grid::occludedSubGrid(const SubGrid& sub, const Ray& ray, const PrecomputedRay& pray, float tMax, Mailbox& mailbox) const
+{
+	GridData gd;
+
+	if (!hitCalculations(sub.box, sub.nx, sub.ny, sub.nz, ray, pray, gd))
+		return false;
+
+	while (true)
+	{
+		int cell = sub.firstCell + gd.ix + sub.nx * gd.iy + sub.nx * sub.ny * gd.iz;
+		++threadCounters.gridCellsVisited;
+
+		if (occludedCell(subCellOffsets[cell], subCellOffsets[cell + 1], ray, pray, tMax, mailbox))
+			return true;
+
+		if (gd.exit() >= tMax || !gd.step())
+			return false;
+	}
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Walks the same cells as hit, but any primitive that blocks the ray before tMax is an occluder,
+   wherever the hit lies, so the walk ends at the first one. It also ends at the first cell that
+   starts beyond tMax, since nothing there can be in the way. Primitives are tested only once,
+   as a primitive that didn't block the ray in one cell won't in the next.
+   -------------------------------------------------------------------------------------------------
+*/
+bool Grid::occluded(const Ray& ray, float tMax) const
+{
+	GridData gd;
+	Mailbox mailbox;
+	PrecomputedRay pray{ ray };
+
+	if (!hitCalculations(boundingBox, nx, ny, nz, ray, pray, gd))
+		return false;
+
+	while (true)
+	{
+		int cell = gd.ix + nx * gd.iy + nx * ny * gd.iz;
+		++threadCounters.gridCellsVisited;
+
+		if (cellSubGrids[cell] < 0)
+		{
+			if (occludedCell(cellOffsets[cell], cellOffsets[cell + 1], ray, pray, tMax, mailbox))
+				return true;
+		}
+		else if (occludedSubGrid(subGrids[cellSubGrids[cell]], ray, pray, tMax, mailbox))
+			return true;
+
+		if (gd.exit() >= tMax || !gd.step())
+			return false;
+	}
+}
+
+#pragma endregion
+
+#pragma region Bounding Volume Hierarchy
+
+static const int BVH_BINS = 16;
+static const int BVH_MAX_LEAF_SIZE = 8;
+static const float BVH_TRAVERSAL_COST = 1.0f;
+static const float BVH_INTERSECTION_COST = 1.0f;
+
+// Collapsing never makes the tree deeper, and every node visited pushes at most a group of children
+static const int BVH_STACK_SIZE = BVH_MAX_DEPTH * BOX_GROUP_SIZE;
+
+// Node or leaf waiting on the traversal stack, with the distance at which the ray enters its box
+struct BVHStackEntry
+{
+	int offset, count;
+	float tNear;
+};
+
+BoundingVolumeHierarchy::BoundingVolumeHierarchy()
+{
 
-	t0 = (txMin > tyMin) ? txMin : tyMin;
-	if (tzMin > t0)
-		t0 = tzMin;
+}
 
-	t1 = (txMax < tyMax) ? txMax : tyMax;
-	if (tzMax < t1)
-		t1 = tzMax;
+BoundingBox BoundingVolumeHierarchy::getBoundingBox()
+{
+	return boundingBox;
+}
 
-	if (t0 > t1)
-		return false;
+bool BoundingVolumeHierarchy::build()
+{
+	int numObjects = (int)primitives.size();
+	nodes.clear();
 
-	float dimx = x1 - x0;
-	float dimy = y1 - y0;
-	float dimz = z1 - z0;
-	if (boundingBox.inside(ray.origin))
+	if (numObjects == 0)
+		return true;
+
+	std::vector<BoundingBox> boxes;
+	std::vector<Vector<3>> centroids;
+	std::vector<int> indices;
+	boxes.reserve(numObjects);
+	centroids.reserve(numObjects);
+	indices.reserve(numObjects);
+
+	for (int i = 0; i < numObjects; ++i)
 	{
-		gd.ix = clamp((ox - x0) * nx / dimx, 0, nx - 1);
-		gd.iy = clamp((oy - y0) * ny / dimy, 0, ny - 1);
-		gd.iz = clamp((oz - z0) * nz / dimz, 0, nz - 1);
+		BoundingBox box = primitives[i].geometry->primitiveBoundingBox(primitives[i].index);
+		boxes.push_back(box);
+		centroids.push_back((box.min + box.max) * 0.5f);
+		indices.push_back(i);
 	}
-	else
+
+	nodes.reserve(2 * numObjects);
+	buildNode(indices, 0, numObjects, boxes, centroids, 0);
+	storeLeaves(indices);
+	collapse();
+	viewStorage();
+	return gatherPrimitives();
+}
+
+// Puts the primitives in the order the leaves were built over, sorted by kind within each leaf, and
+// splits each leaf into groups
+void BoundingVolumeHierarchy::storeLeaves(const std::vector<int>& order)
+{
+	int numObjects = (int)primitives.size();
+
+	// Store primitives in leaf order so each leaf references a contiguous range
+	std::vector<Primitive> ordered;
+	ordered.reserve(numObjects);
+
+	for (int i = 0; i < numObjects; ++i)
+		ordered.push_back(primitives[order[i]]);
+
+	primitives.swap(ordered);
+	boundingBox = nodes[0].box;
+
+	// Leaves refer to their primitives through groups, so each leaf is culled a group at a time
+	groupStorage.clear();
+	for (auto node = nodes.begin(); node != nodes.end(); ++node)
 	{
-		Vector<3> p = ray.origin + ray.direction * t0;
-		gd.ix = clamp((p[0] - x0) * nx / (dimx - 0), 0, nx - 1);
-		gd.iy = clamp((p[1] - y0) * ny / (dimy - 0), 0, ny - 1);
-		gd.iz = clamp((p[2] - z0) * nz / (dimz - 0), 0, nz - 1);
+		if (node->count == 0)
+			continue;
+
+		int first = (int)groupStorage.size();
+		sortPrimitives(node->offset, node->offset + node->count);
+		groupPrimitives(node->offset, node->count);
+		node->offset = first;
+		node->count = (int)groupStorage.size() - first;
 	}
+}
 
-	gd.dtx = (txMax - txMin) / nx;
-	gd.dty = (tyMax - tyMin) / ny;
-	gd.dtz = (tzMax - tzMin) / nz;
+int BoundingVolumeHierarchy::buildNode(std::vector<int>& indices, int begin, int end,
+	const std::vector<BoundingBox>& boxes, const std::vector<Vector<3>>& centroids, int depth)
+{
+	int index = (int)nodes.size();
+	nodes.push_back(BVHNode{});
 
-	if (dx > 0)
+	BoundingBox box, centroidBox;
+	box.min = centroidBox.min = Vector<3>{ MAX_T, MAX_T, MAX_T };
+	box.max = centroidBox.max = Vector<3>{ -MAX_T, -MAX_T, -MAX_T };
+
+	for (int i = begin; i < end; ++i)
 	{
-		gd.txNext = txMin + (gd.ix + 1) * gd.dtx;
-		gd.ixStep = 1;
-		gd.ixStop = nx;
+		box.updateMin(boxes[indices[i]].min);
+		box.updateMax(boxes[indices[i]].max);
+		centroidBox.updateMin(centroids[indices[i]]);
+		centroidBox.updateMax(centroids[indices[i]]);
 	}
-	else if (dx == 0.0)
+
+	nodes[index].box = box;
+	nodes[index].offset = begin;
+	nodes[index].count = end - begin;
+	nodes[index].axis = 0;
+
+	int count = end - begin;
+	if (count == 1 || depth >= BVH_MAX_DEPTH - 1)
+		return index;
+
+	// Bin the centroids along each axis and find the cheapest split plane
+	float area = box.surfaceArea();
+	float invArea = (area > 0.0f) ? 1.0f / area : 0.0f;
+	float bestCost = MAX_T;
+	int bestAxis = -1, bestBin = 0;
+
+	for (int axis = 0; axis < 3; ++axis)
 	{
-		gd.txNext = MAX_T;
-		gd.ixStep = -1;
-		gd.ixStop = -1;
+		float extent = centroidBox.max[axis] - centroidBox.min[axis];
+		if (extent <= 0.0f)
+			continue;
+
+		int binCounts[BVH_BINS] = {};
+		BoundingBox binBoxes[BVH_BINS];
+		for (int b = 0; b < BVH_BINS; ++b)
+		{
+			binBoxes[b].min = Vector<3>{ MAX_T, MAX_T, MAX_T };
+			binBoxes[b].max = Vector<3>{ -MAX_T, -MAX_T, -MAX_T };
+		}
+
+		for (int i = begin; i < end; ++i)
+		{
+			int b = (int)(BVH_BINS * (centroids[indices[i]][axis] - centroidBox.min[axis]) / extent);
+			b = std::min(b, BVH_BINS - 1);
+			binCounts[b]++;
+			binBoxes[b].updateMin(boxes[indices[i]].min);
+			binBoxes[b].updateMax(boxes[indices[i]].max);
+		}
+
+		// Sweep from the right to get the area and count of every right hand side
+		float rightAreas[BVH_BINS];
+		int rightCounts[BVH_BINS];
+		BoundingBox right = binBoxes[BVH_BINS - 1];
+		int rightCount = 0;
+
+		for (int b = BVH_BINS - 1; b > 0; --b)
+		{
+			right.updateMin(binBoxes[b].min);
+			right.updateMax(binBoxes[b].max);
+			rightCount += binCounts[b];
+			rightAreas[b] = (rightCount > 0) ? right.surfaceArea() : 0.0f;
+			rightCounts[b] = rightCount;
+		}
+
+		// Then sweep from the left, evaluating the split after each bin
+		BoundingBox left = binBoxes[0];
+		int leftCount = 0;
+
+		for (int b = 0; b < BVH_BINS - 1; ++b)
+		{
+			left.updateMin(binBoxes[b].min);
+			left.updateMax(binBoxes[b].max);
+			leftCount += binCounts[b];
+
+			if (leftCount == 0 || rightCounts[b + 1] == 0)
+				continue;
+
+			float cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * invArea *
+				(left.surfaceArea() * leftCount + rightAreas[b + 1] * rightCounts[b + 1]);
+
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b;
+			}
+		}
 	}
-	else
+
+	// Keep small nodes as leaves when splitting wouldn't pay for the extra traversal
+	float leafCost = BVH_INTERSECTION_COST * count;
+	if (bestAxis == -1 || (bestCost >= leafCost && count <= BVH_MAX_LEAF_SIZE))
+		return index;
+
+	float splitMin = centroidBox.min[bestAxis];
+	float splitExtent = centroidBox.max[bestAxis] - splitMin;
+	auto middle = std::partition(indices.begin() + begin, indices.begin() + end, [&](int i)
 	{
-		gd.txNext = txMin + (nx - gd.ix) * gd.dtx;
-		gd.ixStep = -1;
-		gd.ixStop = -1;
-	}
+		int b = (int)(BVH_BINS * (centroids[i][bestAxis] - splitMin) / splitExtent);
+		return std::min(b, BVH_BINS - 1) <= bestBin;
+	});
+	int mid = (int)(middle - indices.begin());
 
-	if (dy > 0)
+	nodes[index].count = 0;
+	nodes[index].axis = bestAxis;
+
+	buildNode(indices, begin, mid, boxes, centroids, depth + 1);
+	int second = buildNode(indices, mid, end, boxes, centroids, depth + 1);
+	nodes[index].offset = second;
+
+	return index;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Collapses the binary tree into wide nodes. Each wide node starts from a binary node's two
+   children and keeps opening the interior child with the largest surface area, the one rays are
+   most likely to enter, until it has BOX_GROUP_SIZE children or only leaves are left. The binary
+   nodes aren't needed after that.
+   -------------------------------------------------------------------------------------------------
+*/
+void BoundingVolumeHierarchy::collapse()
+{
+	wideNodeStorage.clear();
+
+	if (nodes.empty())
+		return;
+
+	if (nodes[0].count > 0)
 	{
-		gd.tyNext = tyMin + (gd.iy + 1) * gd.dty;
-		gd.iyStep = 1;
-		gd.iyStop = ny;
+		// A single leaf still gets a node, so traversal always starts at one
+		WideBVHNode root{};
+		root.boxes.setBox(0, nodes[0].box.min, nodes[0].box.max);
+		root.offsets[0] = nodes[0].offset;
+		root.counts[0] = nodes[0].count;
+		wideNodeStorage.push_back(root);
 	}
-	else if (dy == 0.0)
+	else
 	{
-		gd.tyNext = MAX_T;
-		gd.iyStep = -1;
-		gd.iyStop = -1;
+		wideNodeStorage.reserve(nodes.size() / 2);
+		collapseNode(0);
 	}
-	else
+
+	nodes = std::vector<BVHNode>{};
+}
+
+int BoundingVolumeHierarchy::collapseNode(int node)
+{
+	int index = (int)wideNodeStorage.size();
+	wideNodeStorage.push_back(WideBVHNode{});
+
+	int children[BOX_GROUP_SIZE] = { node + 1, nodes[node].offset };
+	int count = 2;
+
+	while (count < BOX_GROUP_SIZE)
 	{
-		gd.tyNext = tyMin + (ny - gd.iy) * gd.dty;
-		gd.iyStep = -1;
-		gd.iyStop = -1;
+		int best = -1;
+		float bestArea = -1.0f;
+
+		for (int i = 0; i < count; ++i)
+		{
+			const BVHNode& child = nodes[children[i]];
+			if (child.count == 0 && child.box.surfaceArea() > bestArea)
+			{
+				best = i;
+				bestArea = child.box.surfaceArea();
+			}
+		}
+
+		if (best == -1)
+			break;
+
+		int open = children[best];
+		children[best] = open + 1;
+		children[count++] = nodes[open].offset;
 	}
 
-	if (dz > 0)
+	for (int lane = 0; lane < count; ++lane)
 	{
-		gd.tzNext = tzMin + (gd.iz + 1) * gd.dtz;
-		gd.izStep = 1;
-		gd.izStop = nz;
+		const BVHNode& child = nodes[children[lane]];
+		int offset = (child.count > 0) ? child.offset : collapseNode(children[lane]);
+
+		// Collapsing the child can grow the array, so the node is looked up again
+		WideBVHNode& wide = wideNodeStorage[index];
+		wide.boxes.setBox(lane, child.box.min, child.box.max);
+		wide.offsets[lane] = offset;
+		wide.counts[lane] = child.count;
 	}
-	else if (dz == 0.0)
+
+	return index;
+}
+
+void BoundingVolumeHierarchy::viewStorage()
+{
+	Compound::viewStorage();
+	wideNodes = ArrayView<WideBVHNode>{ wideNodeStorage };
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Every box of a node is tested at once, and the children the ray enters are pushed farthest
+   first, so the nearest is visited next and a close hit lets the farther ones be skipped when
+   they come off the stack.
+   -------------------------------------------------------------------------------------------------
+*/
+bool BoundingVolumeHierarchy::hit(const Ray& ray, float& tMin, ShaderData& sd) const
+{
+	if (wideNodes.empty())
+		return false;
+
+	PrecomputedRay pray{ ray };
+	PrimitiveHit closest{ tMin, false };
+
+	BVHStackEntry stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = BVHStackEntry{ 0, 0, MIN_T };
+
+	while (top > 0)
 	{
-		gd.tzNext = MAX_T;
-		gd.izStep = -1;
-		gd.izStop = -1;
+		BVHStackEntry entry = stack[--top];
+
+		if (entry.tNear > closest.t)
+			continue;
+
+		if (entry.count > 0)
+		{
+			hitGroups(entry.offset, entry.offset + entry.count, ray, pray, closest, sd);
+			continue;
+		}
+
+		const WideBVHNode& node = wideNodes[entry.offset];
+		float tNear[BOX_GROUP_SIZE];
+		unsigned lanes = hitBoxGroup(node.boxes, pray, closest.t, tNear);
+
+		// Sort the lanes hit from farthest to nearest
+		int order[BOX_GROUP_SIZE];
+		int count = 0;
+
+		while (lanes)
+		{
+			int lane = lowestLane(lanes);
+			lanes &= lanes - 1;
+
+			int i = count++;
+			for (; i > 0 && tNear[order[i - 1]] < tNear[lane]; --i)
+				order[i] = order[i - 1];
+			order[i] = lane;
+		}
+
+		for (int i = 0; i < count; ++i)
+			stack[top++] = BVHStackEntry{ node.offsets[order[i]], node.counts[order[i]], tNear[order[i]] };
 	}
-	else
+
+	// Only the closest hit is shaded
+	if (closest.found)
 	{
-		gd.tzNext = tzMin + (nz - gd.iz) * gd.dtz;
-		gd.izStep = -1;
-		gd.izStop = -1;
+		tMin = closest.t;
+		shadeHit(closest, ray, sd);
 	}
 
-	return true;
+	return closest.found;
 }
 
-bool Grid::hit(const Ray& ray, float& t, ShaderData& sd) const
+// Any occluder will do, so children are visited in whatever order and the walk stops at the first
+bool BoundingVolumeHierarchy::occluded(const Ray& ray, float tMax) const
 {
-	GridData gd;
-	bool result = hitCalculations(ray, t, gd);
-
-	if (!result)
+	if (wideNodes.empty())
 		return false;
 
-	while (true)
+	PrecomputedRay pray{ ray };
+
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
 	{
-		float tNew = t;
-		Geometry *geo = cells[gd.ix + nx * gd.iy + nx * ny * gd.iz];
+		const WideBVHNode& node = wideNodes[stack[--top]];
+		unsigned lanes = hitBoxGroup(node.boxes, pray, tMax);
 
-		if (gd.txNext < gd.tyNext && gd.txNext < gd.tzNext)
+		while (lanes)
 		{
-			if (geo && geo->hit(ray, tNew, sd) && tNew < gd.txNext)
-			{
-				t = tNew;
+			int lane = lowestLane(lanes);
+			lanes &= lanes - 1;
+
+			if (node.counts[lane] == 0)
+				stack[top++] = node.offsets[lane];
+			else if (occludedGroups(node.offsets[lane], node.offsets[lane] + node.counts[lane], ray, pray, tMax))
 				return true;
-			}
+		}
+	}
 
-			gd.txNext += gd.dtx;
-			gd.ix += gd.ixStep;
+	return false;
+}
 
-			if (gd.ix == gd.ixStop)
-				return false;
-		}
-		else
-		{
-			if (gd.tyNext < gd.tzNext)
-			{
-				if (geo && geo->hit(ray, tNew, sd) && tNew < gd.tyNext)
-				{
-					t = tNew;
-					return true;
-				}
+#pragma endregion
 
-				gd.tyNext += gd.dty;
-				gd.iy += gd.iyStep;
+#pragma region Linear Bounding Volume Hierarchy
 
-				if (gd.iy == gd.iyStop)
-					return false;
-			}
-			else
-			{
-				if (geo && geo->hit(ray, tNew, sd) && tNew < gd.tzNext)
-				{
-					t = tNew;
-					return true;
-				}
+// Bits per axis of a Morton code, three of which fill a 64 bit code
+static const int MORTON_BITS = 21;
 
-				gd.tzNext += gd.dtz;
-				gd.iz += gd.izStep;
+// Spreads the low MORTON_BITS bits of v out so two zero bits follow each one
+static uint64_t spreadBits(uint64_t v)
+{
+	v &= (1ull << MORTON_BITS) - 1;
+	v = (v | v << 32) & 0x001f00000000ffffull;
+	v = (v | v << 16) & 0x001f0000ff0000ffull;
+	v = (v | v << 8) & 0x100f00f00f00f00full;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+	v = (v | v << 2) & 0x1249249249249249ull;
+
+	return v;
+}
 
-				if (gd.iz == gd.izStop)
-					return false;
-			}
-		}
+// Morton code of a point inside bounds, with x in the highest bit of each group of three
+static uint64_t mortonCode(const Vector<3>& point, const BoundingBox& bounds)
+{
+	uint64_t q[3];
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float extent = bounds.max[axis] - bounds.min[axis];
+		float scaled = (extent > 0.0f) ? (point[axis] - bounds.min[axis]) / extent * (1 << MORTON_BITS) : 0.0f;
+		q[axis] = (uint64_t)clamp(scaled, 0, (1 << MORTON_BITS) - 1);
 	}
+
+	return spreadBits(q[0]) << 2 | spreadBits(q[1]) << 1 | spreadBits(q[2]);
 }
 
-bool Grid::shadowHit(const Ray& ray, float& tMin) const
+LinearBVH::LinearBVH()
 {
-	GridData gd;
-	bool result = hitCalculations(ray, tMin, gd);
 
-	if (!result)
-		return false;
+}
 
-	while (true)
+/* -------------------------------------------------------------------------------------------------
+   Sorts the primitives by the Morton code of their centroids and builds the hierarchy over them.
+   The top of the tree is split on the calling thread only as far as it takes to cut it into about
+   eight subtrees per thread. Those are built in parallel, each into a node array of its own, and
+   then copied into place as the top of the tree is split a second time, depth first. Every split
+   only depends on the codes, so the tree is the same whatever the thread count.
+   -------------------------------------------------------------------------------------------------
+*/
+bool LinearBVH::build()
+{
+	int numObjects = (int)primitives.size();
+	nodes.clear();
+
+	if (numObjects == 0)
+		return true;
+
+	std::vector<BoundingBox> boxes(numObjects);
+	std::vector<Vector<3>> centroids(numObjects);
+
+	parallelFor(numObjects, buildThreads, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			boxes[i] = primitives[i].geometry->primitiveBoundingBox(primitives[i].index);
+			centroids[i] = (boxes[i].min + boxes[i].max) * 0.5f;
+		}
+	});
+
+	BoundingBox centroidBox;
+	centroidBox.min = Vector<3>{ MAX_T, MAX_T, MAX_T };
+	centroidBox.max = Vector<3>{ -MAX_T, -MAX_T, -MAX_T };
+
+	for (int i = 0; i < numObjects; ++i)
+	{
+		centroidBox.updateMin(centroids[i]);
+		centroidBox.updateMax(centroids[i]);
+	}
+
+	// Ties are broken by primitive index, so the order is fixed
+	std::vector<std::pair<uint64_t, int>> keys(numObjects);
+
+	parallelFor(numObjects, buildThreads, [&](int begin, int end)
 	{
-		Geometry *geo = cells[gd.ix + nx * gd.iy + nx * ny * gd.iz];
-		float tNew = tMin;
+		for (int i = begin; i < end; ++i)
+			keys[i] = std::make_pair(mortonCode(centroids[i], centroidBox), i);
+	});
+
+	parallelSort(keys, buildThreads);
+
+	std::vector<uint64_t> codes(numObjects);
+	std::vector<int> order(numObjects);
+	std::vector<BoundingBox> sortedBoxes(numObjects);
 
-		if (gd.txNext < gd.tyNext && gd.txNext < gd.tzNext)
+	parallelFor(numObjects, buildThreads, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; ++i)
 		{
-			if (geo && geo->shadowHit(ray, tNew) && tNew < gd.txNext)
-			{
-				tMin = tNew;
-				return true;
-			}
-			gd.txNext += gd.dtx;
-			gd.ix += gd.ixStep;
+			codes[i] = keys[i].first;
+			order[i] = keys[i].second;
+			sortedBoxes[i] = boxes[order[i]];
+		}
+	});
 
-			if (gd.ix == gd.ixStop)
-				return false;
+	int size = std::max(BVH_MAX_LEAF_SIZE, numObjects / (8 * std::max(buildThreads, 1)));
+	std::vector<BVHSubtree> subtrees;
+	findSubtrees(codes, 0, numObjects, 0, size, subtrees);
+
+	std::vector<std::vector<BVHNode>> built(subtrees.size());
+
+	parallelFor((int)subtrees.size(), buildThreads, [&](int begin, int end)
+	{
+		for (int s = begin; s < end; ++s)
+		{
+			built[s].reserve(2 * (subtrees[s].end - subtrees[s].begin));
+			buildLinearNode(built[s], codes, sortedBoxes, subtrees[s].begin, subtrees[s].end, subtrees[s].depth);
 		}
-		else
+	}, 1);
+
+	int next = 0;
+	nodes.reserve(2 * numObjects);
+	stitch(codes, 0, numObjects, 0, size, built, next);
+
+	storeLeaves(order);
+	collapse();
+	viewStorage();
+	return gatherPrimitives();
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Splits the sorted codes begin up to end at the first code with the highest differing bit set,
+   and sets axis to the axis that bit belongs to. A range of equal codes is split in the middle.
+   -------------------------------------------------------------------------------------------------
+*/
+int LinearBVH::split(const std::vector<uint64_t>& codes, int begin, int end, int& axis)
+{
+	uint64_t first = codes[begin];
+	uint64_t last = codes[end - 1];
+
+	if (first == last)
+	{
+		axis = 0;
+		return (begin + end) / 2;
+	}
+
+	int bit = 0;
+	for (uint64_t diff = first ^ last; diff >> 1; diff >>= 1)
+		++bit;
+
+	axis = 2 - bit % 3;
+
+	// The codes all share the bits above the differing one, so the second half starts at the lowest
+	// code with it set
+	uint64_t splitCode = last >> bit << bit;
+	return (int)(std::lower_bound(codes.begin() + begin, codes.begin() + end, splitCode) - codes.begin());
+}
+
+// Builds the subtree over the sorted primitives begin up to end into nodes, depth first
+int LinearBVH::buildLinearNode(std::vector<BVHNode>& nodes, const std::vector<uint64_t>& codes,
+	const std::vector<BoundingBox>& boxes, int begin, int end, int depth)
+{
+	int index = (int)nodes.size();
+	nodes.push_back(BVHNode{});
+
+	if (end - begin <= BVH_MAX_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1)
+	{
+		BoundingBox box = boxes[begin];
+		for (int i = begin + 1; i < end; ++i)
 		{
-			if (gd.tyNext < gd.tzNext)
-			{
-				if (geo && geo->shadowHit(ray, tNew) && tNew < gd.tyNext)
-				{
-					tMin = tNew;
-					return true;
-				}
-				gd.tyNext += gd.dty;
-				gd.iy += gd.iyStep;
-
-				if (gd.iy == gd.iyStop)
-					return false;
-			}
-			else
-			{
-				if (geo && geo->shadowHit(ray, tNew) && tNew < gd.tzNext)
-				{
-					tMin = tNew;
-					return true;
-				}
+			box.updateMin(boxes[i].min);
+			box.updateMax(boxes[i].max);
+		}
+
+		nodes[index] = BVHNode{ box, begin, end - begin, 0 };
+		return index;
+	}
 
-				gd.tzNext += gd.dtz;
-				gd.iz += gd.izStep;
+	int axis;
+	int mid = split(codes, begin, end, axis);
 
-				if (gd.iz == gd.izStop)
-					return false;
-			}
+	buildLinearNode(nodes, codes, boxes, begin, mid, depth + 1);
+	int second = buildLinearNode(nodes, codes, boxes, mid, end, depth + 1);
+
+	BoundingBox box = nodes[index + 1].box;
+	box.updateMin(nodes[second].box.min);
+	box.updateMax(nodes[second].box.max);
+	nodes[index] = BVHNode{ box, second, 0, axis };
+
+	return index;
+}
+
+// Splits the top of the tree until every range is small enough to be built as one subtree
+void LinearBVH::findSubtrees(const std::vector<uint64_t>& codes, int begin, int end, int depth, int size,
+	std::vector<BVHSubtree>& subtrees) const
+{
+	if (end - begin <= size || depth >= BVH_MAX_DEPTH - 1)
+	{
+		subtrees.push_back(BVHSubtree{ begin, end, depth });
+		return;
+	}
+
+	int axis;
+	int mid = split(codes, begin, end, axis);
+
+	findSubtrees(codes, begin, mid, depth + 1, size, subtrees);
+	findSubtrees(codes, mid, end, depth + 1, size, subtrees);
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Splits the top of the tree again, in the same order as findSubtrees, adding its nodes to the
+   hierarchy and copying each built subtree in where its range comes up. next is the subtree to
+   copy in next. The subtrees' interior nodes point to their second child within the subtree, so
+   they're moved along by where the subtree lands.
+   -------------------------------------------------------------------------------------------------
+*/
+int LinearBVH::stitch(const std::vector<uint64_t>& codes, int begin, int end, int depth, int size,
+	std::vector<std::vector<BVHNode>>& built, int& next)
+{
+	int index = (int)nodes.size();
+
+	if (end - begin <= size || depth >= BVH_MAX_DEPTH - 1)
+	{
+		for (auto node = built[next].begin(); node != built[next].end(); ++node)
+		{
+			nodes.push_back(*node);
+			if (node->count == 0)
+				nodes.back().offset += index;
 		}
+
+		built[next++] = std::vector<BVHNode>{};
+		return index;
 	}
 
+	nodes.push_back(BVHNode{});
+
+	int axis;
+	int mid = split(codes, begin, end, axis);
+
+	stitch(codes, begin, mid, depth + 1, size, built, next);
+	int second = stitch(codes, mid, end, depth + 1, size, built, next);
+
+	BoundingBox box = nodes[index + 1].box;
+	box.updateMin(nodes[second].box.min);
+	box.updateMax(nodes[second].box.max);
+	nodes[index] = BVHNode{ box, second, 0, axis };
+
+	return index;
 }
 
-#pragma endregion
\ No newline at end of file
+#pragma endregion
+
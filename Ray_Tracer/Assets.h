@@ -21,11 +21,16 @@
 #define ASSETS_H
 
 #include "RenderData.h"
+#include "SlabTest.h"
+
+#include <cstdint>
 
 #pragma region Grid Data
 
 /* -------------------------------------------------------------------------------------------------
-   Struct to store grid cell data used in linear grid acceleration.
+   Struct to store grid cell data used in linear grid acceleration. exit is the distance at which
+   the ray leaves the current cell, and step moves on to the next cell, returning false once the
+   ray has left the grid.
    -------------------------------------------------------------------------------------------------
 */
 struct GridData
@@ -35,8 +40,53 @@ struct GridData
 	float 	txNext, tyNext, tzNext;
 	int 	ixStep, iyStep, izStep;
 	int 	ixStop, iyStop, izStop;
+
+	float exit() const;
+	bool step();
+};
+
+/* -------------------------------------------------------------------------------------------------
+   Mailbox of the primitives a ray has already been tested against while walking a grid. A primitive
+   that overlaps many cells is registered in each of them, so without it a ray would intersect the
+   same large triangle or sphere again in every cell it crosses. The mailbox belongs to a single
+   ray and lives on the stack of the thread tracing it, so render threads never share one. It only
+   remembers the last MAILBOX_SIZE primitives, which is enough to catch the neighbouring cells a
+   repeated primitive shows up in.
+   -------------------------------------------------------------------------------------------------
+*/
+static const int MAILBOX_SIZE = 16;
+
+struct Mailbox
+{
+	int ids[MAILBOX_SIZE];
+	int next;
+
+	Mailbox();
+	bool visit(int);
 };
 
+inline Mailbox::Mailbox()
+	: next{ 0 }
+{
+	for (int i = 0; i < MAILBOX_SIZE; ++i)
+		ids[i] = -1;
+}
+
+// Records the primitive and returns true if the ray hasn't been tested against it yet
+inline bool Mailbox::visit(int id)
+{
+	for (int i = 0; i < MAILBOX_SIZE; ++i)
+	{
+		if (ids[i] == id)
+			return false;
+	}
+
+	ids[next] = id;
+	next = (next + 1) % MAILBOX_SIZE;
+
+	return true;
+}
+
 #pragma endregion
 
 #pragma region Bounding Box
@@ -44,7 +94,8 @@ struct GridData
 /* -------------------------------------------------------------------------------------------------
    Bounding Box for a Geometry object. A simple Axis-aligned box that contains the entire geometric
    shape, used for linear grid acceleration. Rays check to see if they intersect the box in world
-   space before doing more costly transformations and hit calculations.
+   space before doing more costly transformations and hit calculations. Rays tested against many
+   boxes should be precomputed once and use the second hit function.
    -------------------------------------------------------------------------------------------------
 */
 class BoundingBox
@@ -54,7 +105,9 @@ public:
 	
 	BoundingBox();
 	bool hit(const Ray&) const;
+	bool hit(const PrecomputedRay&, float, float&) const;
 	bool inside(const Vector<3>&) const;
+	float surfaceArea() const;
 	
 	void updateMin(const Vector<3>&);
 	void updateMax(const Vector<3>&);
@@ -64,45 +117,91 @@ public:
 
 /* -------------------------------------------------------------------------------------------------
    Abstract base class for Geometric object in the scene. Requires an object have a material for
-   shading, a matrix to transform to its local space and the corresponding inverse, as well as a 
-   bounding box for linear grid acceleration.
+   shading (stored as its id in the scene's material table), a matrix to transform to its local
+   space and the corresponding inverse, as well as a bounding box for linear grid acceleration.
+   hit finds the closest intersection, while occluded only answers whether anything lies on the
+   ray between MIN_T and the given distance (the light, for shadow rays), so it can stop at the
+   first occluder it finds and skip everything past that distance.
+   Geometry made of many pieces, like a triangle mesh, can expose each piece as a primitive with
+   its own bounding box and hit functions, so acceleration structures can sort the pieces rather
+   than the whole object. By default a geometry is a single primitive.
+   primitiveType tells acceleration structures which of the built in kinds of primitive a geometry
+   is made of, so they can test those without a virtual call. Any other kind of geometry is
+   PRIMITIVE_GEOMETRY and is tested through hitPrimitive and occludedPrimitive.
    -------------------------------------------------------------------------------------------------
 */
 #pragma region Geometry
 
+enum PRIMITIVE_TYPE { PRIMITIVE_GEOMETRY, PRIMITIVE_SPHERE, PRIMITIVE_TRIANGLE, PRIMITIVE_WATERTIGHT };
+
 class Geometry
 {
 protected:
-	Material material;
+	unsigned materialId;
 	BoundingBox boundingBox;
 	Matrix<4, 4> invTransform;
 	Matrix<4, 4> invTranspose;
 
 public:
-	Geometry(Material, Matrix<4, 4>);
+	Geometry(unsigned, Matrix<4, 4>);
 
 	virtual bool hit(const Ray&, float&, ShaderData&) const = 0;
-	virtual bool shadowHit(const Ray&, float&) const = 0;
+	virtual bool occluded(const Ray&, float) const = 0;
 	virtual void generateBoundingBox(Matrix<4,4>) = 0;
 	virtual void setBoundingBox();
 	virtual BoundingBox getBoundingBox();
 	virtual void addGeometry(Geometry*);
 
-	virtual Material getMaterial();
-	virtual void setMaterial(Material);
+	virtual int primitiveCount() const;
+	virtual BoundingBox primitiveBoundingBox(int);
+	virtual bool hitPrimitive(int, const Ray&, float&, ShaderData&) const;
+	virtual bool occludedPrimitive(int, const Ray&, float) const;
+	virtual PRIMITIVE_TYPE primitiveType() const;
+
+	virtual unsigned getMaterialId();
+	virtual void setMaterialId(unsigned);
 	
 	virtual ~Geometry();
 };
 
+/* -------------------------------------------------------------------------------------------------
+   Reference to one primitive of a geometry, used by acceleration structures.
+   -------------------------------------------------------------------------------------------------
+*/
+struct Primitive
+{
+	Geometry *geometry;
+	int index;
+};
+
 #pragma endregion
 
 #pragma region Sphere Geometry
 
+class Sphere;
+
+/* -------------------------------------------------------------------------------------------------
+   Sphere as acceleration structures keep it. transform holds the top three rows of the sphere's
+   inverse transform, column by column; the bottom row of an affine transform is always 0, 0, 0, 1,
+   so this is all it takes to bring a ray into the sphere's space. The sphere is kept for shading.
+   -------------------------------------------------------------------------------------------------
+*/
+struct SphereRecord
+{
+	float transform[4][3];
+	Vector<3> center;
+	float radius;
+	const Sphere *sphere;
+};
+
 /* -------------------------------------------------------------------------------------------------
    Sphere geometry class. Spheres are defined by a 3d vector center point and a radius value.
+   hit is split into intersect, which only finds the distance, and shade, so acceleration
+   structures can leave shading until they know which sphere is closest. Only spheres with an
+   affine transform, which every scene file transform is, are PRIMITIVE_SPHERE.
    -------------------------------------------------------------------------------------------------
 */
-class Sphere : public Geometry
+class Sphere final : public Geometry
 {
 private:
 	Vector<3> center;
@@ -111,11 +210,18 @@ private:
 	bool hitCalculations(Ray&, float&, float&, float&, Vector<3>&) const;
 
 public:
-	Sphere(Vector<3>, float, Material, Matrix<4,4>);
+	Sphere(Vector<3>, float, unsigned, Matrix<4,4>);
+
+	friend class SceneCache;
+
+	bool intersect(const Ray&, float&) const;
+	void shade(const Ray&, float, ShaderData&) const;
+	SphereRecord record() const;
 
 	bool hit(const Ray&, float&, ShaderData&) const override;
-	bool shadowHit(const Ray&, float&) const override;
+	bool occluded(const Ray&, float) const override;
 	void generateBoundingBox(Matrix<4,4>) override;
+	PRIMITIVE_TYPE primitiveType() const override;
 };
 
 #pragma endregion
@@ -123,28 +229,116 @@ public:
 #pragma region Triangle Geometry
 
 /* -------------------------------------------------------------------------------------------------
-   Triangle geometry class. Triangles are defined by three 3d vectors, 3 computed normals using
-   those vectors and by default are converted into world space to make ray intersections more 
-   efficient.
+   Triangle geometry class. Triangles are defined by three 3d vectors in world space, with the
+   scene's transforms already applied to them, and a normal computed from those vectors. The edges
+   the intersection test is solved with are computed once, along with the normal.
    -------------------------------------------------------------------------------------------------
 */
 class Triangle : public Geometry
 {
 private:
 	Vector<3> v0, v1, v2;
+	Vector<3> edge1, edge2;
 	Vector<3> m_normal;
-	bool useTransform;
 
-	bool hitCalculations(Ray&, float&) const;
+	bool hitCalculations(const Ray&, float&) const;
 
 public:
-	Triangle(Vector<3>, Vector<3>, Vector<3>, Material, Matrix<4,4>);
+	Triangle(Vector<3>, Vector<3>, Vector<3>, unsigned, Matrix<4,4>);
 
 	bool hit(const Ray&, float&, ShaderData&) const override;
-	bool shadowHit(const Ray&, float&) const override;
+	bool occluded(const Ray&, float) const override;
 	void generateBoundingBox(Matrix<4,4>) override;
-	
-	void setUseTransform(bool);
+};
+
+#pragma endregion
+
+#pragma region Triangle Mesh Geometry
+
+class TriangleMesh;
+
+/* -------------------------------------------------------------------------------------------------
+   Triangle of a mesh as acceleration structures keep it: its first vertex and the edges from the
+   other two to it (v0 - v1 and v0 - v2), which are what the intersection test is solved with, so
+   they aren't worked out again on every test. The mesh and index it came from are kept for shading.
+   -------------------------------------------------------------------------------------------------
+*/
+struct TriangleRecord
+{
+	Vector<3> v0, edge1, edge2;
+	const TriangleMesh *mesh;
+	int index;
+};
+
+/* -------------------------------------------------------------------------------------------------
+   Triangle of a watertight mesh as acceleration structures keep it. The watertight test works from
+   the vertices themselves, as neighbouring triangles only agree on a shared edge if they compute
+   it from the same vertex values.
+   -------------------------------------------------------------------------------------------------
+*/
+struct WatertightRecord
+{
+	Vector<3> v0, v1, v2;
+	const TriangleMesh *mesh;
+	int index;
+};
+
+/* -------------------------------------------------------------------------------------------------
+   Triangle mesh geometry class. A mesh keeps one shared array of world space vertices and three
+   vertex indices per triangle, with a single material for the whole mesh. Each triangle is a
+   primitive of the mesh, so acceleration structures still see individual triangles, but a
+   triangle costs a dozen bytes of indices instead of a full Triangle object.
+   Notes:
+	   - The arrays are normally the mesh's own, but a mesh can also view arrays held elsewhere, like
+	     a mapped binary scene file, and use them in place. Adding to a viewing mesh copies them.
+	   - A watertight mesh is tested with the watertight algorithm of Woop, Benthin and Wald, which
+	     never lets a ray slip through the edge two triangles share, nor through a shared vertex.
+	     It costs a little more per test, so it's only used for meshes that ask for it.
+   -------------------------------------------------------------------------------------------------
+*/
+class TriangleMesh final : public Geometry
+{
+private:
+	std::vector<Vector<3>> m_vertexStorage;
+	std::vector<int> m_indexStorage;
+	const Vector<3> *m_vertices;
+	const int *m_indices;
+	int m_numVertices, m_numIndices;
+	bool m_watertight;
+
+	bool hitCalculations(int, const Ray&, float&) const;
+	Vector<3> faceNormal(int) const;
+	void ownArrays();
+
+public:
+	TriangleMesh(unsigned);
+
+	TriangleMesh(const TriangleMesh&) = delete;
+	TriangleMesh& operator =(const TriangleMesh&) = delete;
+
+	int addVertex(Vector<3>);
+	void addTriangle(int, int, int);
+	void viewArrays(const Vector<3>*, int, const int*, int);
+	void reserve(int, int);
+	int numVertices() const;
+	int numTriangles() const;
+	void setWatertight(bool);
+	bool watertight() const;
+	TriangleRecord record(int) const;
+	WatertightRecord watertightRecord(int) const;
+	void shade(int, const Ray&, float, ShaderData&) const;
+
+	bool hit(const Ray&, float&, ShaderData&) const override;
+	bool occluded(const Ray&, float) const override;
+	void generateBoundingBox(Matrix<4,4>) override;
+
+	int primitiveCount() const override;
+	BoundingBox primitiveBoundingBox(int) override;
+	bool hitPrimitive(int, const Ray&, float&, ShaderData&) const override;
+	bool occludedPrimitive(int, const Ray&, float) const override;
+	PRIMITIVE_TYPE primitiveType() const override;
+
+	friend class SceneCache;
 };
 
 #pragma endregion
@@ -152,15 +346,78 @@ public:
 #pragma region Compound Geometry
 
 /* -------------------------------------------------------------------------------------------------
-   Compound geometry class used in linear grid acceleration. When multiple geometries occupy a grid
-   cell, they are put into a compound instance. When calculating a ray intersection, the compound
-   loops over all contained geometries to find the correct intersection point.
+   A run of up to BOX_GROUP_SIZE consecutive primitives of a compound, starting at first, along with
+   their bounding boxes laid out for the SIMD slab test. type is the kind of primitive every lane
+   holds, or PRIMITIVE_GEOMETRY if they're mixed.
+   -------------------------------------------------------------------------------------------------
+*/
+struct PrimitiveGroup
+{
+	BoxGroup boxes;
+	int first, count;
+	PRIMITIVE_TYPE type;
+};
+
+/* -------------------------------------------------------------------------------------------------
+   Closest hit found so far while testing a compound's primitives. A sphere or triangle is kept as
+   its slot in the compound's array of that kind and only shaded once the search is over, while
+   any other geometry has to be shaded as it's hit, so its shading is kept aside here.
+   -------------------------------------------------------------------------------------------------
+*/
+struct PrimitiveHit
+{
+	float t = MAX_T;
+	bool found = false;
+	PRIMITIVE_TYPE type = PRIMITIVE_GEOMETRY;
+	int slot = -1;
+	unsigned materialId = 0;
+	Vector<3> normal{}, hitPoint{};
+};
+
+/* -------------------------------------------------------------------------------------------------
+   Compound geometry class used in linear grid acceleration. When geometries occupy a grid cell,
+   their primitives are put into a compound instance. When calculating a ray intersection, the
+   compound loops over all contained primitives to find the correct intersection point.
+   build groups the primitives so a single slab test of a group's boxes picks out the few the ray
+   can actually reach before any of them is intersected. It has to be called once all primitives
+   have been added, and returns false if the groups it built don't match the primitives.
+   Acceleration structures that can build in parallel use up to the number of threads set by
+   setBuildThreads, and give the same result whatever that number is.
+   Spheres and mesh triangles, watertight or not, are also gathered into arrays of their own kind,
+   in primitive order, with primitiveSlots giving each primitive's place in its array. Primitives
+   are sorted by kind before they're grouped, so most groups hold a single kind and are tested with
+   one switch on the group's type and a tight loop over its lanes, rather than a virtual call per
+   primitive.
+   The groups, like the arrays of the acceleration structures built on a compound, are traced
+   through a view (see ArrayView) of the compound's own storage, or of a mapped scene cache.
    -------------------------------------------------------------------------------------------------
 */
 class Compound : public Geometry
 {
 protected:
-	std::vector<Geometry*> geometries;
+	std::vector<Primitive> primitives;
+	std::vector<PrimitiveGroup> groupStorage;
+	ArrayView<PrimitiveGroup> groups;
+	std::vector<int> primitiveSlots;
+	std::vector<SphereRecord> spheres;
+	std::vector<TriangleRecord> triangles;
+	std::vector<WatertightRecord> watertightTriangles;
+	int buildThreads;
+
+	void sortPrimitives(int, int);
+	void groupPrimitives(int, int);
+	bool gatherPrimitives();
+	virtual const ArrayView<int>* groupMembers() const;
+	virtual void viewStorage();
+
+	template <typename Lookup>
+	void hitLanes(const PrimitiveGroup&, unsigned, Lookup, const Ray&, PrimitiveHit&, ShaderData&) const;
+	template <typename Lookup>
+	bool occludedLanes(const PrimitiveGroup&, unsigned, Lookup, const Ray&, float) const;
+	void shadeHit(const PrimitiveHit&, const Ray&, ShaderData&) const;
+
+	void hitGroups(int, int, const Ray&, const PrecomputedRay&, PrimitiveHit&, ShaderData&) const;
+	bool occludedGroups(int, int, const Ray&, const PrecomputedRay&, float) const;
 
 public:
 	Compound();
@@ -169,42 +426,218 @@ public:
 	Compound& operator =(const Compound&);
 	
 	bool hit(const Ray&, float&, ShaderData&) const override;
-	bool shadowHit(const Ray&, float&) const override;
+	bool occluded(const Ray&, float) const override;
 	void generateBoundingBox(Matrix<4, 4>) override;
 
 	BoundingBox getBoundingBox() override;
 	void addGeometry(Geometry*) override;
+	void addPrimitive(Primitive);
+	void reserve(int);
+	void setBuildThreads(int);
+	virtual bool build();
+
+	friend class SceneCache;
 };
 
 #pragma endregion
 
 #pragma region Grid Compound Geometry
 
+// Default cells per primitive along each axis, and most primitives a cell holds before it's split
+static const float GRID_MULTIPLIER = 2.0f;
+static const int GRID_DENSITY = 64;
+
+/* -------------------------------------------------------------------------------------------------
+   Second level of a two-level grid. A top-level cell holding more primitives than the grid's
+   density gets a sub-grid of its own, covering the cell's volume with a resolution picked for its
+   primitive count the same way the top level's is picked for the whole scene. Sub-grid cells are
+   numbered from firstCell in the grid's shared subCellOffsets.
+   -------------------------------------------------------------------------------------------------
+*/
+struct SubGrid
+{
+	BoundingBox box;
+	int nx, ny, nz;
+	int firstCell;
+};
+
 /* -------------------------------------------------------------------------------------------------
    Grid geometry class. A scene using linear grid acceleration has only one grid. It uses three 
    values in the x, y, and z planes to generate a 3 dimentional grid with that many cells.
    It then adds the rest of the scene's object into these cells based on the intersection of the
    cell volume and the object's bounding box.
+   The cells are stored flat, in compressed sparse row form. cellPrimitives lists the primitives of
+   every cell one cell after another, as indices into the grid's primitives, and the primitives of
+   cell i are split into the box groups cellOffsets[i] up to cellOffsets[i + 1]. Each group covers
+   a contiguous run of cellPrimitives, so walking a cell reads a few neighbouring entries of two
+   arrays. Building takes two passes over the primitives: the first counts how many overlap each
+   cell, which fixes where every cell's run starts, and the second fills the runs in.
+   One uniform resolution does badly on uneven scenes, such as a dense mesh in a large empty room,
+   where the whole mesh lands in a handful of cells. Cells holding more than density primitives
+   are split again into a sub-grid (see SubGrid), whose cells are stored the same way, with their
+   groups in subCellOffsets; cellSubGrids holds each top-level cell's sub-grid, or -1. The
+   multiplier scales the number of cells along each axis at both levels.
    -------------------------------------------------------------------------------------------------
 */
 class Grid : public Compound
 {
 private:
-	std::vector<Geometry*> cells;
+	std::vector<int> cellOffsetStorage;
+	std::vector<int> cellPrimitiveStorage;
+	std::vector<int> cellSubGridStorage;
+	std::vector<int> subCellOffsetStorage;
+	std::vector<SubGrid> subGridStorage;
+	ArrayView<int> cellOffsets;
+	ArrayView<int> cellPrimitives;
+	ArrayView<int> cellSubGrids;
+	ArrayView<int> subCellOffsets;
+	ArrayView<SubGrid> subGrids;
 	int nx, ny, nz;
+	float multiplier;
+	int density;
+
+	Vector<3> minCoordinate(const std::vector<BoundingBox>&);
+	Vector<3> maxCoordinate(const std::vector<BoundingBox>&);
+	void resolution(const BoundingBox&, int, int&, int&, int&) const;
+	static void cellRange(const BoundingBox&, int, int, int, const BoundingBox&, int[3], int[3]);
+	static bool hitCalculations(const BoundingBox&, int, int, int, const Ray&, const PrecomputedRay&, GridData&);
+	void hitCell(int, int, const Ray&, const PrecomputedRay&, ShaderData&, Mailbox&, PrimitiveHit&) const;
+	bool hitSubGrid(const SubGrid&, const Ray&, const PrecomputedRay&, ShaderData&, Mailbox&, PrimitiveHit&) const;
+	bool occludedCell(int, int, const Ray&, const PrecomputedRay&, float, Mailbox&) const;
+	bool occludedSubGrid(const SubGrid&, const Ray&, const PrecomputedRay&, float, Mailbox&) const;
 
-	Vector<3> minCoordinate();
-	Vector<3> maxCoordinate();
-	bool hitCalculations(const Ray&, float&, GridData&) const;
+protected:
+	const ArrayView<int>* groupMembers() const override;
+	void viewStorage() override;
 
 public:
 	Grid();
 
+	Grid(const Grid&) = delete;
+	Grid& operator =(const Grid&) = delete;
+
 	virtual BoundingBox getBoundingBox();
 	bool hit(const Ray&, float&, ShaderData&) const override;
-	bool shadowHit(const Ray&, float&) const override;
+	bool occluded(const Ray&, float) const override;
+	bool build() override;
+	void setMultiplier(float);
+	void setDensity(int);
 	
 	void generateCells();
+
+	friend class SceneCache;
+};
+
+#pragma endregion
+
+#pragma region Bounding Volume Hierarchy
+
+/* -------------------------------------------------------------------------------------------------
+   Node of a flattened bounding volume hierarchy. Nodes are stored depth first, so the first child
+   of an interior node is always the next node in the array and offset holds the second child.
+   For a leaf, offset is the first of its count primitive groups. Axis is the split axis, used to
+   visit the nearer child first.
+   -------------------------------------------------------------------------------------------------
+*/
+struct BVHNode
+{
+	BoundingBox box;
+	int offset;
+	int count;
+	int axis;
+};
+
+// Deepest a hierarchy is built, which bounds the stack traversing it
+static const int BVH_MAX_DEPTH = 64;
+
+/* -------------------------------------------------------------------------------------------------
+   Node of the wide hierarchy traced by BoundingVolumeHierarchy, holding up to BOX_GROUP_SIZE
+   children whose boxes are tested together with hitBoxGroup. A child with a count is a leaf, its
+   offset the first of its count primitive groups; otherwise offset is the child's node. Unused
+   lanes keep the group's empty boxes, so they're never hit.
+   -------------------------------------------------------------------------------------------------
+*/
+struct WideBVHNode
+{
+	BoxGroup boxes;
+	int offsets[BOX_GROUP_SIZE];
+	int counts[BOX_GROUP_SIZE];
+};
+
+/* -------------------------------------------------------------------------------------------------
+   Bounding volume hierarchy acceleration, an alternative to the linear grid. The scene's objects
+   are split recursively using the surface area heuristic: at each node the centroids are binned
+   along every axis and the split with the lowest expected intersection cost is kept, or a leaf is
+   made when no split beats testing every object. Unlike the grid it adapts to uneven scenes, such
+   as a dense mesh inside a large, mostly empty room.
+   The binary tree is only built to be collapsed into wide nodes (see WideBVHNode), each taking the
+   place of several levels of the binary tree, so a ray tests a whole group of boxes in one SIMD
+   slab test and goes through fewer, larger nodes on its way down.
+   -------------------------------------------------------------------------------------------------
+*/
+class BoundingVolumeHierarchy : public Compound
+{
+private:
+	std::vector<WideBVHNode> wideNodeStorage;
+	ArrayView<WideBVHNode> wideNodes;
+
+	int buildNode(std::vector<int>&, int, int, const std::vector<BoundingBox>&, const std::vector<Vector<3>>&, int);
+	int collapseNode(int);
+
+protected:
+	std::vector<BVHNode> nodes;
+
+	void storeLeaves(const std::vector<int>&);
+	void collapse();
+	void viewStorage() override;
+
+public:
+	BoundingVolumeHierarchy();
+
+	BoundingVolumeHierarchy(const BoundingVolumeHierarchy&) = delete;
+	BoundingVolumeHierarchy& operator =(const BoundingVolumeHierarchy&) = delete;
+
+	BoundingBox getBoundingBox() override;
+	bool hit(const Ray&, float&, ShaderData&) const override;
+	bool occluded(const Ray&, float) const override;
+	bool build() override;
+
+	friend class SceneCache;
+};
+
+/* -------------------------------------------------------------------------------------------------
+   Range of sorted primitives, and its depth in the hierarchy, that a linear BVH builds as a subtree
+   of its own.
+   -------------------------------------------------------------------------------------------------
+*/
+struct BVHSubtree
+{
+	int begin, end;
+	int depth;
+};
+
+/* -------------------------------------------------------------------------------------------------
+   Linear bounding volume hierarchy, built for speed rather than quality. Each primitive's centroid
+   is given a Morton code, which interleaves the bits of its quantised x, y and z coordinates, so
+   sorting the primitives by code lays them out along a space filling curve. A range of sorted codes
+   is split where the highest bit that differs across it flips, which splits space in half along
+   one axis, with no cost estimates to evaluate. The split depends only on the range, so the top
+   of the tree is cut into subtrees that are built on separate threads and stitched back together,
+   giving the same depth first node layout, and traversal, as the surface area heuristic build.
+   -------------------------------------------------------------------------------------------------
+*/
+class LinearBVH : public BoundingVolumeHierarchy
+{
+private:
+	static int split(const std::vector<uint64_t>&, int, int, int&);
+	static int buildLinearNode(std::vector<BVHNode>&, const std::vector<uint64_t>&, const std::vector<BoundingBox>&, int, int, int);
+	void findSubtrees(const std::vector<uint64_t>&, int, int, int, int, std::vector<BVHSubtree>&) const;
+	int stitch(const std::vector<uint64_t>&, int, int, int, int, std::vector<std::vector<BVHNode>>&, int&);
+
+public:
+	LinearBVH();
+
+	bool build() override;
 };
 
 #pragma endregion
@@ -9,6 +9,11 @@ Light::Light(Color c, float ls)
 
 }
 
+Light::~Light()
+{
+
+}
+
 #pragma endregion
 
 #pragma region Ambient Light
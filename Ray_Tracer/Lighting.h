@@ -43,6 +43,8 @@ public:
 	virtual Vector<3> direction(const Vector<3>&) const = 0;
 	virtual Color light(const Vector<3>&) const = 0;
 	virtual RayParameters shadowRay(const Ray&) const = 0;
+
+	virtual ~Light();
 };
 
 #pragma endregion
@@ -86,6 +88,8 @@ public:
 	Vector<3> direction(const Vector<3>&) const override;
 	Color light(const Vector<3>&) const override;
 	RayParameters shadowRay(const Ray&) const override;
+
+	friend class SceneFile;
 };
 
 #pragma endregion
@@ -111,6 +115,8 @@ public:
 	RayParameters shadowRay(const Ray&) const override;
 
 	void setAttenuation(Vector<3>);
+
+	friend class SceneFile;
 };
 
 #pragma endregion
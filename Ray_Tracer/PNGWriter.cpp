@@ -0,0 +1,125 @@
+#include "stdafx.h"
+#include "PNGWriter.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+#pragma region PNG Writer
+
+// Lookup table for the CRC-32 polynomial used by PNG chunks
+struct CRCTable
+{
+	uint32_t entries[256];
+
+	CRCTable()
+	{
+		for (uint32_t n = 0; n < 256; ++n)
+		{
+			uint32_t c = n;
+			for (int k = 0; k < 8; ++k)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			entries[n] = c;
+		}
+	}
+};
+
+static uint32_t crc32(const unsigned char *data, size_t length)
+{
+	static const CRCTable table;
+	uint32_t crc = 0xFFFFFFFFu;
+
+	for (size_t i = 0; i < length; ++i)
+		crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static uint32_t adler32(const unsigned char *data, size_t length)
+{
+	uint32_t a = 1, b = 0;
+
+	for (size_t i = 0; i < length; ++i)
+	{
+		a = (a + data[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+
+	return (b << 16) | a;
+}
+
+static void appendBigEndian(std::vector<unsigned char>& out, uint32_t value)
+{
+	out.push_back((unsigned char)(value >> 24));
+	out.push_back((unsigned char)(value >> 16));
+	out.push_back((unsigned char)(value >> 8));
+	out.push_back((unsigned char)value);
+}
+
+// Chunk layout is length, type, data, then a CRC of the type and data
+static void writeChunk(std::ofstream& file, const char *type, const std::vector<unsigned char>& data)
+{
+	std::vector<unsigned char> chunk;
+	appendBigEndian(chunk, (uint32_t)data.size());
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	appendBigEndian(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+
+	file.write((const char*)chunk.data(), chunk.size());
+}
+
+bool writePNG(const std::string& fileName, int width, int height, const unsigned char *rgb)
+{
+	std::ofstream file(fileName, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+
+	if (!file || width <= 0 || height <= 0)
+		return false;
+
+	static const unsigned char signature[] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	file.write((const char*)signature, sizeof(signature));
+
+	// 8 bits per channel, truecolor, no interlacing
+	std::vector<unsigned char> header;
+	appendBigEndian(header, (uint32_t)width);
+	appendBigEndian(header, (uint32_t)height);
+	header.insert(header.end(), { 8, 2, 0, 0, 0 });
+	writeChunk(file, "IHDR", header);
+
+	// Every scanline starts with its filter type, 0 (none)
+	size_t rowSize = (size_t)width * 3;
+	std::vector<unsigned char> raw;
+	raw.reserve((rowSize + 1) * height);
+	for (int y = 0; y < height; ++y)
+	{
+		raw.push_back(0);
+		raw.insert(raw.end(), rgb + y * rowSize, rgb + (y + 1) * rowSize);
+	}
+
+	// zlib stream of stored deflate blocks, each holding at most 65535 bytes
+	std::vector<unsigned char> data{ 0x78, 0x01 };
+	data.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+	size_t offset = 0;
+	do
+	{
+		size_t length = std::min(raw.size() - offset, (size_t)65535);
+		bool last = (offset + length == raw.size());
+
+		data.push_back(last ? 1 : 0);
+		data.push_back((unsigned char)(length & 0xFF));
+		data.push_back((unsigned char)(length >> 8));
+		data.push_back((unsigned char)(~length & 0xFF));
+		data.push_back((unsigned char)((~length >> 8) & 0xFF));
+		data.insert(data.end(), raw.begin() + offset, raw.begin() + offset + length);
+
+		offset += length;
+	} while (offset < raw.size());
+	appendBigEndian(data, adler32(raw.data(), raw.size()));
+	writeChunk(file, "IDAT", data);
+
+	writeChunk(file, "IEND", std::vector<unsigned char>{});
+
+	return file.good();
+}
+
+#pragma endregion
@@ -0,0 +1,39 @@
+/* -------------------------------------------------------------------------------------------------
+   Copyright 2017 Shealyn Tate Hindenlang
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge, publish, distribute,
+   sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   -------------------------------------------------------------------------------------------------
+*/
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include <string>
+
+#pragma region PNG Writer
+
+/* -------------------------------------------------------------------------------------------------
+   Minimal PNG encoder, used to save renders when the ray tracer is built without FreeImage. Pixels
+   are 8 bit RGB triples with the rows running from the top of the image to the bottom. The image
+   data is written as uncompressed deflate blocks: the files are larger than a real compressor would
+   make them, but it needs no external library and any image viewer can open the result.
+   -------------------------------------------------------------------------------------------------
+*/
+bool writePNG(const std::string&, int, int, const unsigned char*);
+
+#pragma endregion
+
+#endif
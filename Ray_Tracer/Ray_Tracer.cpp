@@ -18,18 +18,111 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 -------------------------------------------------------------------------------------------------
 */
 #include "stdafx.h"
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <new>
 #include <stack>
 
-#include "Scene.h"
+#include "SceneFile.h"
+
+/* -------------------------------------------------------------------------------------------------
+   The global operator new and delete are replaced so every allocation made through new, including
+   the standard containers', is counted along with its size. Each block starts with a header
+   holding its size, so delete can take it back off the bytes in use. They're replaced here rather
+   than in the tracer core, so programs linking the core, like the benchmarks, keep their own
+   allocator. Over-aligned allocations use the library's own versions and aren't counted.
+   -------------------------------------------------------------------------------------------------
+*/
+static const std::size_t ALLOCATION_HEADER = alignof(std::max_align_t);
+
+static void* countedAllocation(std::size_t size) noexcept
+{
+	char *block = (char*)std::malloc(ALLOCATION_HEADER + size);
+	if (!block)
+		return NULL;
+
+	std::memcpy(block, &size, sizeof(size));
+	countAllocation(size);
+	return block + ALLOCATION_HEADER;
+}
+
+static void countedFree(void *memory) noexcept
+{
+	if (!memory)
+		return;
+
+	char *block = (char*)memory - ALLOCATION_HEADER;
+	std::size_t size;
+	std::memcpy(&size, block, sizeof(size));
+	countFree(size);
+	std::free(block);
+}
+
+void* operator new(std::size_t size)
+{
+	if (void *memory = countedAllocation(size))
+		return memory;
+
+	throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+// The nothrow forms have to be replaced along with the rest, as their memory is freed by delete
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	return countedAllocation(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, tag);
+}
+
+void operator delete(void *memory) noexcept
+{
+	countedFree(memory);
+}
+
+void operator delete[](void *memory) noexcept
+{
+	countedFree(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept
+{
+	countedFree(memory);
+}
+
+void operator delete[](void *memory, std::size_t) noexcept
+{
+	countedFree(memory);
+}
+
+void operator delete(void *memory, const std::nothrow_t&) noexcept
+{
+	countedFree(memory);
+}
+
+void operator delete[](void *memory, const std::nothrow_t&) noexcept
+{
+	countedFree(memory);
+}
 
 /* -------------------------------------------------------------------------------------------------
    The fileInputHandler reads in the source file line by line and constructs the materials, lights, 
-   geometry, and camera for the scene based on the input.
+   geometry, and camera for the scene based on the input. Each line is tokenized in a single pass and
+   dispatched on its first word; lines that can't be parsed are printed out and otherwise ignored.
    Input file format :
 		- lines that begin with # are ignored as comments
 		- size <int> <int> : size of display window as well as output file size.
-		- output <filename> : the name of the file to save to, defaults to "defaultOutput.png"
+		- output <filename> : the name of the file to save to, defaults to "defaultOutput.png". A
+		  render report with the same name and a .json extension is written beside it
 		- camera <args> : the origin, look at, up vector, and fov of the scene's camera
 		- point <args> : point light
 		- directional <args> : directional light
@@ -38,6 +131,13 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 		- specular <args> : the specular BRDF of material
 		- shininess <float> : the exponent value for calculating highlight size of specular BRDF
 		- emission <args> : the emissive BRDF of material
+		- threads <int> : number of threads used to build the acceleration structure and render, 0 (the
+		  default) uses one per hardware thread
+		- acceleration <none|grid|bvh|lbvh> : acceleration structure used to trace the scene, defaults
+		  to grid. lbvh is a bounding volume hierarchy that builds much faster but traces a little slower
+		- gridmultiplier <float> : grid cells per primitive along each axis, defaults to 2
+		- griddensity <int> : most primitives a grid cell holds before it gets a sub-grid of its own,
+		  defaults to 64, 0 keeps the grid to one level
 		- maxverts <int> : number of vertices created in scene
 		- maxnorms <int> : number of normals created in scene
 		- vertex <float, float float> : specifies a vertex 3d position
@@ -47,15 +147,175 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 		- scale <float> <float> <float> : apply scale transform to future geometries 
 		- translate <float> <float> <float> : apply translation transform to future geometries
 		- rotate <float> <float> <float> : apply rotation to future geometries
-		- tri <int> <int> <int> : create triangle using indices of 3 vertices previously specified
+		- tri <int> <int> <int> : create triangle using indices of 3 vertices previously specified,
+		  consecutive triangles are grouped into one mesh sharing their vertices
+		- watertight <on|off> : intersect the triangles that follow with a slower test that never lets
+		  a ray slip through the edge two triangles share, defaults to off
 		- sphere <float> <float> <float> <float> : create sphere with given position and radius
+   The file is memory mapped, and each run of consecutive vertex or tri lines is parsed as a block,
+   split between the threads set so far, before its vertices or triangles are added in order.
+   The vertex arrays are sized from the maxverts and maxvertnorms hints, and the scene's geometry
+   list and each mesh from a quick count of the sphere and tri lines made before parsing.
+   With cache set, the geometry, materials and acceleration structure are loaded from a cache
+   file beside the scene file (scene.test.cache) when its key matches, and only the lines that
+   don't add geometry are parsed. The key hashes the file's bytes except the camera, lights,
+   output and render settings lines, so those can be changed without rebuilding the cache.
+   -------------------------------------------------------------------------------------------------
+*/
+
+// Next line of a mapped file, without its newline
+static bool nextLine(const char *&cursor, const char *end, std::string_view &line)
+{
+	if (cursor >= end)
+		return false;
+
+	const char *newline = (const char*)memchr(cursor, '\n', end - cursor);
+	const char *lineEnd = newline ? newline : end;
+	line = std::string_view{ cursor, (size_t)(lineEnd - cursor) };
+	cursor = newline ? newline + 1 : end;
+	return true;
+}
+
+// A line of a vertex or tri run, and where its arguments start after the command
+struct RunLine
+{
+	std::string_view line;
+	const char *arguments;
+};
+
+/* -------------------------------------------------------------------------------------------------
+   Collects a run of lines with the same command, starting with the line just read and carrying on
+   from cursor for as long as the lines begin with word. Returns where the run ends.
+   -------------------------------------------------------------------------------------------------
+*/
+static const char* findRun(std::string_view first, std::string_view word, const char *cursor, const char *end,
+	std::vector<RunLine>& lines)
+{
+	std::string_view line;
+	lines.clear();
+	lines.push_back(RunLine{ first, word.data() + word.size() });
+
+	for (const char *next = cursor; nextLine(next, end, line); cursor = next)
+	{
+		const char *c = line.data(), *lineEnd = line.data() + line.size();
+		while (c != lineEnd && isspace((unsigned char)*c))
+			++c;
+
+		if ((size_t)(lineEnd - c) < word.size() || std::memcmp(c, word.data(), word.size()) != 0 ||
+			(c + word.size() != lineEnd && !isspace((unsigned char)c[word.size()])))
+			break;
+
+		lines.push_back(RunLine{ line, c + word.size() });
+	}
+
+	return cursor;
+}
+
+// Spheres in a scene file, and the triangles in each run of tri lines that will share a mesh
+struct GeometryCounts
+{
+	int spheres;
+	std::vector<int> meshTriangles;
+};
+
+// Counts the geometry in a scene file by the first word of each line, without parsing the rest
+static GeometryCounts countGeometry(const char *cursor, const char *end)
+{
+	GeometryCounts counts{ 0, std::vector<int>{} };
+	std::string_view line, word;
+	bool inMesh = false;
+
+	while (nextLine(cursor, end, line))
+	{
+		// Vertex lines make up most of a large scene and can't end a mesh, so skip them without tokenizing
+		if (line.size() > 6 && line[0] == 'v' && line.compare(0, 6, "vertex") == 0 && isspace((unsigned char)line[6]))
+			continue;
+
+		Tokenizer tokens{ line.data(), line.data() + line.size() };
+		if (!tokens.next(word) || word[0] == '#')
+			continue;
+
+		// Meshes end at the same lines the parser finishes them at
+		if (word == "tri")
+		{
+			if (!inMesh)
+				counts.meshTriangles.push_back(0);
+			++counts.meshTriangles.back();
+			inMesh = true;
+		}
+		else if (word != "vertex" && word != "vertexnormal")
+		{
+			counts.spheres += (word == "sphere");
+			inMesh = false;
+		}
+	}
+
+	return counts;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Hash of the scene file's bytes, apart from the lines setting the camera, lights, output and
+   render options, so those can be changed without rebuilding the cache. The bytes between those
+   lines are hashed a word at a time, in as few pieces as there are masked lines, and lines are
+   only told apart by their first word, so the vertex and tri lines that make up most of a large
+   scene cost a newline search and a short compare each. Every line a scene loaded from the cache
+   still has to parse, the ones that don't add geometry, is listed in settings.
    -------------------------------------------------------------------------------------------------
 */
-Scene fileInputHandler(std::string fileName)
+static uint64_t cacheKey(const char *cursor, const char *end, std::vector<std::string_view>& settings)
 {
-	std::ifstream file(fileName, std::ifstream::in);
-	std::string line;
-	std::smatch m;
+	uint64_t key = SCENE_CACHE_SEED;
+	const char *unhashed = cursor;
+	std::string_view line;
+	settings.clear();
+
+	while (nextLine(cursor, end, line))
+	{
+		const char *c = line.data(), *lineEnd = line.data() + line.size();
+		while (c != lineEnd && isspace((unsigned char)*c))
+			++c;
+
+		const char *wordEnd = c;
+		while (wordEnd != lineEnd && !isspace((unsigned char)*wordEnd))
+			++wordEnd;
+
+		std::string_view word{ c, (size_t)(wordEnd - c) };
+		if (word.empty() || word[0] == '#' || word == "vertex" || word == "tri" || word == "sphere")
+			continue;
+
+		switch (commandType(word))
+		{
+		case CMD_VERTEXNORMAL:
+		case CMD_MAXVERTS:
+		case CMD_MAXVERTNORMS:
+		case CMD_WATERTIGHT:
+			break;
+		case CMD_CAMERA:
+		case CMD_SIZE:
+		case CMD_OUTPUT:
+		case CMD_MAXDEPTH:
+		case CMD_THREADS:
+		case CMD_DIRECTIONAL:
+		case CMD_POINT:
+		case CMD_ATTENUATION:
+			key = SceneCache::hash(key, std::string_view{ unhashed, (size_t)(line.data() - unhashed) });
+			unhashed = cursor;
+			settings.push_back(line);
+			break;
+		default:
+			settings.push_back(line);
+			break;
+		}
+	}
+
+	return SceneCache::hash(key, std::string_view{ unhashed, (size_t)(end - unhashed) });
+}
+
+Scene fileInputHandler(std::string fileName, bool cache)
+{
+	MappedFile file{ fileName };
+	const char *cursor = file.data(), *end = file.data() + file.size();
+	std::string_view line;
 	EmissiveMaterial mat{};
 	Scene scene{};
 
@@ -71,199 +331,505 @@ Scene fileInputHandler(std::string fileName)
 	std::vector<Vector<3>> vertices{};
 	std::vector<Vector<3>> normals{};
 
-	while (file.good())
+	// Lines of the current vertex or tri run, and what each parsed to
+	std::vector<RunLine> run{};
+	std::vector<int> runIndices{};
+	std::vector<char> runValid{};
+	int threads = 0;
+
+	// Sizes counted before parsing, the mesh the current tri lines belong to, and the vertex hints
+	GeometryCounts counts{ 0, std::vector<int>{} };
+	int meshGroup = -1;
+	bool inMesh = false;
+	bool watertight = false;
+	long long maxVerts = 0, maxNorms = 0;
+
+	// Every vertex line is well over 8 bytes, which caps what a bad hint can reserve
+	auto reserveVertices = [&]()
 	{
-		getline(file, line);
+		vertices.reserve(std::min((size_t)(maxVerts + maxNorms), file.size() / 8));
+		normals.reserve(std::min((size_t)maxNorms, file.size() / 8));
+	};
 
-		if (line.length() == 0 || line[0] == '#')
-		{
-			continue;
-		}
-		else if (regex_search(line, m, sphere))
-		{
-			auto offset = Matrix<4, 4>::Translation(Vector<3>{ p(m, 1), p(m, 2), p(m, 3) });
-			auto scale = Matrix<4, 4>::Scale(Vector<3>{ p(m, 4), p(m, 4), p(m, 4) });
-			Sphere *sphere = new Sphere(Vector<3>{}, 1.0f, mat, scale.inverse() * i * offset.inverse());
-			sphere->generateBoundingBox(offset * t * scale);
-			scene.addGeometry(sphere);
-		}
-		else if (regex_search(line, m, vertexnormal))
-		{
-			vertices.push_back(Vector<3>{ p(m, 1), p(m, 2), p(m, 3) });
-			normals.push_back(Vector<3>{ p(m, 4), p(m, 5), p(m, 6) });
-		}
-		else if (regex_search(line, m, vertex))
-		{
-			vertices.push_back(Vector<3>{ p(m, 1), p(m, 2), p(m, 3) });
-		}
-		else if (regex_search(line, m, triangle))
-		{
-			auto a = higherDimension(vertices[stoi(m.str(1))], 1.0f);
-			auto b = higherDimension(vertices[stoi(m.str(2))], 1.0f);
-			auto c = higherDimension(vertices[stoi(m.str(3))], 1.0f);
-			auto v0 = lowerDimension((t * a).homogenous());
-			auto v1 = lowerDimension((t * b).homogenous());
-			auto v2 = lowerDimension((t * c).homogenous());
-			Triangle *tri = new Triangle(v0, v1, v2, mat, Matrix<4, 4>{});
-			tri->generateBoundingBox(Matrix<4, 4>{});
-			scene.addGeometry(tri);
-		}
-		else if (regex_search(line, m, ambient))
-		{
-			mat.setka(Color(p(m, 1), p(m, 2), p(m, 3)));
-		}
-		else if (regex_search(line, m, diffuse))
-		{
-			mat.setkd(Color(p(m, 1), p(m, 2), p(m, 3)));
-		}
-		else if (regex_search(line, m, specular))
-		{
-			mat.setks(Color(p(m, 1), p(m, 2), p(m, 3)));
-		}
-		else if (regex_search(line, m, emission))
+	// Mesh being filled by the current run of triangles and the index each vertex has in it
+	TriangleMesh *mesh = NULL;
+	std::vector<int> meshVertices{};
+
+	auto addTriangle = [&](int n[3])
+	{
+		if (!mesh)
 		{
-			mat.setke(Color(p(m, 1), p(m, 2), p(m, 3)));
+			// A mesh holds each vertex at most once
+			mesh = scene.create<TriangleMesh>(scene.addMaterial(mat));
+			mesh->setWatertight(watertight);
+			if (meshGroup < (int)counts.meshTriangles.size())
+				mesh->reserve((int)std::min((size_t)3 * counts.meshTriangles[meshGroup], vertices.capacity()),
+					counts.meshTriangles[meshGroup]);
 		}
-		else if (regex_search(line, m, shininess))
+
+		if (meshVertices.size() < vertices.size())
+			meshVertices.resize(vertices.size(), -1);
+
+		for (int k = 0; k < 3; ++k)
 		{
-			mat.setexp(p(m, 1));
+			if (n[k] < 0 || n[k] >= (int)vertices.size())
+				return false;
+
+			// Transform each vertex the first time the mesh uses it, then share it
+			int &index = meshVertices[n[k]];
+			if (index < 0)
+				index = mesh->addVertex(lowerDimension((t * higherDimension(vertices[n[k]], 1.0f)).homogenous()));
+			n[k] = index;
 		}
-		else if (regex_search(line, m, directional))
+
+		mesh->addTriangle(n[0], n[1], n[2]);
+		return true;
+	};
+
+	// Parses a run of vertex or tri lines on several threads, then adds them in file order
+	auto parseRun = [&](COMMAND command)
+	{
+		int count = (int)run.size();
+		int parseThreads = threads > 0 ? threads : std::max((int)std::thread::hardware_concurrency(), 1);
+		size_t first = vertices.size();
+
+		runValid.assign(count, 0);
+		if (command == CMD_VERTEX)
+			vertices.resize(first + count);
+		else
+			runIndices.resize(3 * count);
+
+		parallelFor(count, parseThreads, [&](int begin, int end)
 		{
-			Color c = Color(p(m, 4), p(m, 5), p(m, 6));
-			Vector<3> dir{ p(m, 1), p(m, 2), p(m, 3) };
-			dir = lowerDimension(t * higherDimension(dir, 0)).normal();
-			scene.addLight(new Directional(1.0, c, dir));
-		}
-		else if (regex_search(line, m, point))
+			for (int k = begin; k < end; ++k)
+			{
+				Tokenizer tokens{ run[k].arguments, run[k].line.data() + run[k].line.size() };
+				float v[3];
+				int *n = &runIndices[3 * k];
+
+				if (command == CMD_VERTEX)
+				{
+					if ((runValid[k] = tokens.nextFloats(v, 3)))
+						vertices[first + k] = Vector<3>{ v[0], v[1], v[2] };
+				}
+				else
+					runValid[k] = tokens.nextInt(n[0]) && tokens.nextInt(n[1]) && tokens.nextInt(n[2]);
+			}
+		});
+
+		// Unparsed vertices are dropped, so later indices still count only the valid ones
+		size_t kept = first;
+		for (int k = 0; k < count; ++k)
 		{
-			Color c = Color(p(m, 4), p(m, 5), p(m, 6));
-			Vector<3> pos{ p(m, 1), p(m, 2), p(m, 3) };
-			pos = lowerDimension((t * higherDimension(pos, 1)).homogenous());
-			scene.addLight(new Point(1.0, c, pos, atten));
+			bool valid = runValid[k];
+			if (command == CMD_VERTEX && valid)
+				vertices[kept++] = vertices[first + k];
+			else if (command == CMD_TRI && valid)
+				valid = addTriangle(&runIndices[3 * k]);
+
+			if (!valid)
+				std::cout << run[k].line << "\n";
 		}
-		else if (regex_search(line, m, translate))
+
+		if (command == CMD_VERTEX)
+			vertices.resize(kept);
+	};
+
+	auto finishMesh = [&]()
+	{
+		if (!mesh)
+			return;
+
+		mesh->generateBoundingBox(Matrix<4, 4>{});
+		scene.addGeometry(mesh);
+		mesh = NULL;
+		meshVertices.clear();
+	};
+
+	Timer parseTimer;
+	long long numLines = 0;
+	bool cached = false;
+	std::vector<std::string_view> settings{};
+	size_t nextSetting = 0;
+
+	if (cache)
+	{
+		SceneCache sceneCache{ fileName + ".cache", cacheKey(cursor, end, settings) };
+		cached = scene.loadCache(sceneCache);
+	}
+
+	// The geometry came from the cache, so only the lines listed while hashing are parsed
+	auto readLine = [&](std::string_view& next)
+	{
+		if (!cached)
+			return nextLine(cursor, end, next);
+
+		if (nextSetting == settings.size())
+			return false;
+
+		next = settings[nextSetting++];
+		return true;
+	};
+
+	if (!cached)
+	{
+		counts = countGeometry(cursor, end);
+		scene.reserveGeometry(counts.spheres + (int)counts.meshTriangles.size());
+	}
+
+	while (readLine(line))
+	{
+		++numLines;
+
+		Tokenizer tokens{ line.data(), line.data() + line.size() };
+		std::string_view word, name;
+		float v[10];
+		int n[3];
+		bool valid = false;
+
+		// Skip blank lines and comments
+		if (!tokens.next(word) || word[0] == '#')
+			continue;
+
+		// Consecutive triangles share a mesh until the material, transform, or anything else changes
+		COMMAND command = commandType(word);
+		if (command != CMD_TRI && command != CMD_VERTEX && command != CMD_VERTEXNORMAL)
 		{
-			auto trans = Matrix<4, 4>::Translation(Vector<3>{ p(m, 1), p(m, 2), p(m, 3) });
-			auto invTrans = trans.inverse();
-			t = t * trans;
-			i = invTrans * i;
+			finishMesh();
+			inMesh = false;
 		}
-		else if (regex_search(line, m, rotate))
+		else if (command == CMD_TRI && !inMesh)
 		{
-			auto trans = Matrix<4, 4>::Rotation(Vector<3>{ p(m, 1), p(m, 2), p(m, 3) }, toRad(p(m, 4)));
-			auto invTrans = trans.inverse();
-			t = t * trans;
-			i = invTrans * i;
+			++meshGroup;
+			inMesh = true;
 		}
-		else if (regex_search(line, m, scale))
+
+		if (command == CMD_VERTEX || command == CMD_TRI)
 		{
-			auto trans = Matrix<4, 4>::Scale(Vector<3>{ p(m, 1), p(m, 2), p(m, 3) });
-			auto invTrans = trans.inverse();
-			t = t * trans;
-			i = invTrans * i;
+			cursor = findRun(line, word, cursor, end, run);
+			numLines += (long long)run.size() - 1;
+			parseRun(command);
+			continue;
 		}
-		else if (regex_search(line, m, push))
+
+		switch (command)
 		{
+		case CMD_SPHERE:
+			if ((valid = tokens.nextFloats(v, 4)))
+			{
+				auto offset = Matrix<4, 4>::Translation(Vector<3>{ v[0], v[1], v[2] });
+				auto scale = Matrix<4, 4>::Scale(Vector<3>{ v[3], v[3], v[3] });
+				Sphere *sphere = scene.create<Sphere>(Vector<3>{}, 1.0f, scene.addMaterial(mat), scale.inverse() * i * offset.inverse());
+				sphere->generateBoundingBox(offset * t * scale);
+				scene.addGeometry(sphere);
+			}
+			break;
+		case CMD_VERTEXNORMAL:
+			if ((valid = tokens.nextFloats(v, 6)))
+			{
+				vertices.push_back(Vector<3>{ v[0], v[1], v[2] });
+				normals.push_back(Vector<3>{ v[3], v[4], v[5] });
+			}
+			break;
+		case CMD_AMBIENT:
+			if ((valid = tokens.nextFloats(v, 3)))
+				mat.setka(Color(v[0], v[1], v[2]));
+			break;
+		case CMD_DIFFUSE:
+			if ((valid = tokens.nextFloats(v, 3)))
+				mat.setkd(Color(v[0], v[1], v[2]));
+			break;
+		case CMD_SPECULAR:
+			if ((valid = tokens.nextFloats(v, 3)))
+				mat.setks(Color(v[0], v[1], v[2]));
+			break;
+		case CMD_EMISSION:
+			if ((valid = tokens.nextFloats(v, 3)))
+				mat.setke(Color(v[0], v[1], v[2]));
+			break;
+		case CMD_SHININESS:
+			if ((valid = tokens.nextFloats(v, 1)))
+				mat.setexp(v[0]);
+			break;
+		case CMD_DIRECTIONAL:
+			if ((valid = tokens.nextFloats(v, 6)))
+			{
+				Color c = Color(v[3], v[4], v[5]);
+				Vector<3> dir{ v[0], v[1], v[2] };
+				dir = lowerDimension(t * higherDimension(dir, 0)).normal();
+				scene.addLight(scene.create<Directional>(1.0f, c, dir));
+			}
+			break;
+		case CMD_POINT:
+			if ((valid = tokens.nextFloats(v, 6)))
+			{
+				Color c = Color(v[3], v[4], v[5]);
+				Vector<3> pos{ v[0], v[1], v[2] };
+				pos = lowerDimension((t * higherDimension(pos, 1)).homogenous());
+				scene.addLight(scene.create<Point>(1.0f, c, pos, atten));
+			}
+			break;
+		case CMD_TRANSLATE:
+			if ((valid = tokens.nextFloats(v, 3)))
+			{
+				auto trans = Matrix<4, 4>::Translation(Vector<3>{ v[0], v[1], v[2] });
+				auto invTrans = trans.inverse();
+				t = t * trans;
+				i = invTrans * i;
+			}
+			break;
+		case CMD_ROTATE:
+			if ((valid = tokens.nextFloats(v, 4)))
+			{
+				auto trans = Matrix<4, 4>::Rotation(Vector<3>{ v[0], v[1], v[2] }, toRad(v[3]));
+				auto invTrans = trans.inverse();
+				t = t * trans;
+				i = invTrans * i;
+			}
+			break;
+		case CMD_SCALE:
+			if ((valid = tokens.nextFloats(v, 3)))
+			{
+				auto trans = Matrix<4, 4>::Scale(Vector<3>{ v[0], v[1], v[2] });
+				auto invTrans = trans.inverse();
+				t = t * trans;
+				i = invTrans * i;
+			}
+			break;
+		case CMD_PUSH:
+			valid = true;
 			transStack.push(Matrix<4, 4>{t});
 			invTransStack.push(Matrix<4, 4>{i});
-		}
-		else if (regex_search(line, m, pop))
-		{
+			break;
+		case CMD_POP:
+			valid = true;
 			t = Matrix<4, 4>{ transStack.top() };
 			transStack.pop();
 			i = Matrix<4, 4>{ invTransStack.top() };
 			invTransStack.pop();
-		}
-		else if (regex_search(line, m, camera))
-		{
-			Vector<3> eye{ p(m, 1), p(m, 2), p(m, 3) };
-			Vector<3> center{ p(m, 4), p(m, 5), p(m, 6) };
-			Vector<3> up{ p(m, 7), p(m, 8), p(m, 9) };
-			float fov = toRad(p(m, 10));
+			break;
+		case CMD_CAMERA:
+			if ((valid = tokens.nextFloats(v, 10)))
+			{
+				Vector<3> eye{ v[0], v[1], v[2] };
+				Vector<3> center{ v[3], v[4], v[5] };
+				Vector<3> up{ v[6], v[7], v[8] };
+				float fov = toRad(v[9]);
 
-			scene.buildMVP(eye, center, up, fov);
-		}
-		else if (regex_search(line, m, size))
-		{
-			int width = stoi(m.str(1));
-			int height = stoi(m.str(2));
-			scene.setScreenDimensions(width, height);
-		}
-		else if (regex_search(line, m, depth))
-		{
-			scene.setMaxDepth(stoi(m.str(1)));
-		}
-		else if (regex_search(line, m, maxverts))
-		{
+				scene.buildMVP(eye, center, up, fov);
+			}
+			break;
+		case CMD_SIZE:
+			if ((valid = tokens.nextInt(n[0]) && tokens.nextInt(n[1])))
+				scene.setScreenDimensions(n[0], n[1]);
+			break;
+		case CMD_MAXDEPTH:
+			if ((valid = tokens.nextInt(n[0])))
+				scene.setMaxDepth(n[0]);
+			break;
+		case CMD_THREADS:
+			if ((valid = tokens.nextInt(n[0])))
+			{
+				scene.setThreadCount(n[0]);
+				threads = n[0];
+			}
+			break;
+		case CMD_ACCELERATION:
+			if ((valid = tokens.next(name)))
+			{
+				if (name == "bvh")
+					scene.setAcceleration(BVH);
+				else if (name == "lbvh")
+					scene.setAcceleration(LBVH);
+				else if (name == "grid")
+					scene.setAcceleration(GRID);
+				else if (name == "none")
+					scene.setAcceleration(NONE);
+				else
+					valid = false;
+			}
+			break;
+		case CMD_GRIDMULTIPLIER:
+			if ((valid = tokens.nextFloat(v[0]) && v[0] > 0))
+				scene.setGridMultiplier(v[0]);
+			break;
+		case CMD_GRIDDENSITY:
+			if ((valid = tokens.nextInt(n[0]) && n[0] >= 0))
+				scene.setGridDensity(n[0]);
+			break;
+		case CMD_WATERTIGHT:
+			if ((valid = tokens.next(name)))
+			{
+				if (name == "on")
+					watertight = true;
+				else if (name == "off")
+					watertight = false;
+				else
+					valid = false;
+			}
+			break;
+		case CMD_MAXVERTS:
 			// Total number of vertices
+			if ((valid = tokens.nextInt(n[0])) && n[0] > 0)
+			{
+				maxVerts = n[0];
+				reserveVertices();
+			}
+			break;
+		case CMD_MAXVERTNORMS:
+			// Total number of vertices with normals, which are counted separately
+			if ((valid = tokens.nextInt(n[0])) && n[0] > 0)
+			{
+				maxNorms = n[0];
+				reserveVertices();
+			}
+			break;
+		case CMD_OUTPUT:
+			if ((valid = tokens.next(name)))
+				scene.setOutputFilename(std::string{ name });
+			break;
+		case CMD_ATTENUATION:
+			if ((valid = tokens.nextFloats(v, 3)))
+				atten = Vector<3>{ v[0], v[1], v[2] };
+			break;
+		default:
+			break;
 		}
-		else if (regex_search(line, m, maxvertnorms))
-		{
-			// Total number of normals
-		}
-		else if (regex_search(line, m, output))
-		{
-			std::string outputFile = m.str(1);
-			scene.setOutputFilename(outputFile);
-		}
-		else if (regex_search(line, m, attenuation))
-		{
-			atten = Vector<3>{ p(m, 1), p(m, 2), p(m, 3) };
-		}
-		else
-		{
-			// Print out unidentified lines
-			std::cout << line << "\n";;
-		}
+
+		// Print out unidentified lines
+		if (!valid)
+			std::cout << line << "\n";
 	}
-	file.close();
+	finishMesh();
+
+	double parseDuration = parseTimer.elapsed();
+	scene.statistics().setSceneFile(fileName);
+	scene.statistics().setParseTime(parseDuration);
+
+	// A cached scene only parses its settings, so its rate would say nothing about parsing
+	if (cached)
+	{
+		std::cout << "Loaded " << scene.numGeometries() << " objects from cache " << fileName << ".cache and parsed "
+			<< numLines << " other lines in " << parseDuration << " seconds" << std::endl;
+	}
+	else
+	{
+		std::cout << "Parsed " << numLines << " lines in " << parseDuration << " seconds";
+		if (parseDuration > 0)
+			std::cout << " (" << (long long)(numLines / parseDuration) << " lines/s)";
+		std::cout << std::endl;
+	}
+
 	return scene;
 }
 
+#ifdef USE_GLFW
 void keyboardHandler(GLFWwindow *window, int key, int scancode, int action, int mods)
 {
 	if (key == GLFW_KEY_ESCAPE)
 		glfwSetWindowShouldClose(window, GL_TRUE);
 }
+#endif
 
-int main(int argc, char * argv[])
+/* -------------------------------------------------------------------------------------------------
+   Converts a text scene file to a binary one beside it, scene.test becoming scene.rtscene.
+   -------------------------------------------------------------------------------------------------
+*/
+bool convertScene(const char *fileName)
 {
-	// GLFW Initialization
-	GLFWwindow *window;
-
-	// Measure the time it takes to construct scene
-	clock_t startTime = clock();
-	double setupDuration;
+	if (!std::ifstream{ fileName })
+	{
+		std::cout << "Unable to open scene file " << fileName << std::endl;
+		return false;
+	}
 
-	if (!glfwInit())
-		return -1;
+	std::string outputName{ fileName };
+	size_t extension = outputName.find_last_of("./\\");
+	if (extension != std::string::npos && outputName[extension] == '.')
+		outputName.erase(extension);
+	outputName += SCENE_FILE_EXTENSION;
 
-	auto scene = fileInputHandler(argv[1]);
+	auto scene = fileInputHandler(fileName, false);
+	if (!SceneFile::save(scene, outputName))
+	{
+		std::cout << "Unable to save binary scene file " << outputName << std::endl;
+		return false;
+	}
 
-	// Output scene construction time
-	setupDuration = (clock() - startTime) / (double)CLOCKS_PER_SEC;
-	std::cout << "Ray Tracer took " << setupDuration << " seconds to build scene" << std::endl;
+	std::cout << "Converted " << fileName << " to " << outputName << std::endl;
+	return true;
+}
 
-	window = glfwCreateWindow(scene.screenWidth(), scene.screenHeight(), "Ray Tracer", NULL, NULL);
+/* -------------------------------------------------------------------------------------------------
+   Renders a single scene file, text or binary. Interactive renders are shown in a window until
+   it's closed, headless renders just save the image and report.
+   -------------------------------------------------------------------------------------------------
+*/
+bool renderScene(const char *fileName, bool headless, bool cache)
+{
+	if (!std::ifstream{ fileName })
+	{
+		std::cout << "Unable to open scene file " << fileName << std::endl;
+		return false;
+	}
 
-	if (!window)
+	// The peak is measured from what's in use before loading, so it describes this scene alone
+	uint64_t allocations = allocationCount(), allocated = allocatedBytes();
+	resetAllocationPeak();
+	Scene scene{};
+	if (!SceneFile::isSceneFile(fileName))
+		scene = fileInputHandler(fileName, cache);
+	else if (!SceneFile::load(fileName, scene, cache))
 	{
-		glfwTerminate();
-		return -1;
+		std::cout << "Unable to load binary scene file " << fileName << std::endl;
+		return false;
 	}
 
-	glfwMakeContextCurrent(window);
-	glfwSetKeyCallback(window, keyboardHandler);
+	scene.statistics().setLoadMemory(allocationCount() - allocations, peakAllocatedBytes() - allocated);
+
+#ifdef USE_GLFW
+	GLFWwindow *window = NULL;
+
+	if (!headless)
+	{
+		window = glfwCreateWindow(scene.screenWidth(), scene.screenHeight(), "Ray Tracer", NULL, NULL);
 
-	startTime = clock();
-	scene.generateScene();
+		if (!window)
+			return false;
 
-	setupDuration = (clock() - startTime) / (double)CLOCKS_PER_SEC;
-	std::cout << "Ray Tracer took " << setupDuration << " seconds to render" << std::endl;
+		glfwMakeContextCurrent(window);
+		glfwSetKeyCallback(window, keyboardHandler);
+	}
+#endif
+
+	if (!scene.generateScene())
+	{
+		std::cout << "Unable to build the acceleration structure for " << fileName << std::endl;
+#ifdef USE_GLFW
+		if (window)
+			glfwDestroyWindow(window);
+#endif
+		return false;
+	}
 
 	scene.outputToFile();
 
+	if (cache && scene.saveCache())
+		std::cout << "Saved scene cache " << fileName << ".cache" << std::endl;
+
+	// Stage timings and ray counts, also saved as a JSON report beside the image
+	scene.statistics().setPeakMemory(peakResidentMemory());
+	scene.statistics().print(std::cout);
+	bool reported = scene.writeReport();
+	if (reported)
+		std::cout << "Saved render report " << scene.reportFilename() << "\n";
+	else
+		std::cout << "Unable to save render report.\n";
+
+	if (headless)
+		return reported;
+
+#ifdef USE_GLFW
 	// Main Loop
 	while (!glfwWindowShouldClose(window))
 	{
@@ -276,7 +842,87 @@ int main(int argc, char * argv[])
 		glfwSwapBuffers(window);
 	}
 
-	glfwTerminate();
+	glfwDestroyWindow(window);
+#endif
 
-	return 0;
-}
\ No newline at end of file
+	return reported;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Usage : Ray_Tracer [--headless] [--cache] [--convert] <scene file> [<scene file> ...]
+   Each scene file is rendered in turn. With --headless no window is ever created, which is what
+   render nodes without a display need, and a whole batch of scenes is rendered in one process.
+   With --cache each scene's geometry and acceleration structure are saved beside it after the
+   first render and loaded back on later ones.
+   With --convert the text scene files are converted to binary scene files instead of rendered.
+   Builds without GLFW are always headless.
+   Returns non-zero if any scene failed to render.
+   -------------------------------------------------------------------------------------------------
+*/
+int main(int argc, char * argv[])
+{
+	bool headless = false;
+	bool cache = false;
+	bool convert = false;
+	std::vector<const char*> sceneFiles;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg{ argv[i] };
+
+		if (arg == "--headless")
+			headless = true;
+		else if (arg == "--cache")
+			cache = true;
+		else if (arg == "--convert")
+			convert = true;
+		else
+			sceneFiles.push_back(argv[i]);
+	}
+
+	if (sceneFiles.empty())
+	{
+		std::cout << "Usage: " << argv[0] << " [--headless] [--cache] [--convert] <scene file> [<scene file> ...]" << std::endl;
+		return 1;
+	}
+
+	if (convert)
+	{
+		int failures = 0;
+		for (auto file = sceneFiles.begin(); file != sceneFiles.end(); ++file)
+		{
+			if (!convertScene(*file))
+				++failures;
+		}
+
+		return failures > 0 ? 1 : 0;
+	}
+
+#ifdef USE_GLFW
+	// GLFW Initialization
+	if (!headless && !glfwInit())
+		return -1;
+#else
+	headless = true;
+#endif
+
+	int failures = 0;
+	Timer batchTimer;
+
+	for (auto file = sceneFiles.begin(); file != sceneFiles.end(); ++file)
+	{
+		if (!renderScene(*file, headless, cache))
+			++failures;
+	}
+
+	if (sceneFiles.size() > 1)
+		std::cout << "Rendered " << sceneFiles.size() - failures << " of " << sceneFiles.size()
+				  << " scenes in " << batchTimer.elapsed() << " seconds" << std::endl;
+
+#ifdef USE_GLFW
+	if (!headless)
+		glfwTerminate();
+#endif
+
+	return failures > 0 ? 1 : 0;
+}
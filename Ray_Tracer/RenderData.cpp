@@ -132,12 +132,46 @@ Color Material::reflective() const
 	return m_specularBRDF.m_ks;
 }
 
+bool Material::operator ==(const Material& m) const
+{
+	return m_kr == m.m_kr &&
+		   m_ambientBRDF.m_kd == m.m_ambientBRDF.m_kd &&
+		   m_diffuseBRDF.m_kd == m.m_diffuseBRDF.m_kd &&
+		   m_specularBRDF.m_ks == m.m_specularBRDF.m_ks &&
+		   m_specularBRDF.m_exp == m.m_specularBRDF.m_exp;
+}
+
 bool Material::isReflective() const
 {
 	auto ks = m_specularBRDF.m_ks;
 	return ks.r > 0 || ks.g > 0 || ks.b > 0;
 }
 
+Color Material::getka() const
+{
+	return m_ambientBRDF.m_kd;
+}
+
+Color Material::getkd() const
+{
+	return m_diffuseBRDF.m_kd;
+}
+
+Color Material::getks() const
+{
+	return m_specularBRDF.m_ks;
+}
+
+float Material::getexp() const
+{
+	return m_specularBRDF.m_exp;
+}
+
+Color Material::getkr() const
+{
+	return m_kr;
+}
+
 void Material::setka(Color c)
 {
 	m_ambientBRDF.m_kd = c;
@@ -180,12 +214,43 @@ Color EmissiveMaterial::emissive(const ShaderData& sd, const Light* light) const
 
 #pragma endregion
 
+#pragma region Material Table
+
+MaterialTable::MaterialTable()
+	: m_materials{}
+{
+
+}
+
+// Scenes only use a handful of materials, so a linear search for a duplicate is cheap
+unsigned MaterialTable::add(const Material& material)
+{
+	for (unsigned i = 0; i < m_materials.size(); ++i)
+		if (m_materials[i] == material)
+			return i;
+
+	m_materials.push_back(material);
+	return static_cast<unsigned>(m_materials.size() - 1);
+}
+
+const Material& MaterialTable::operator [](unsigned id) const
+{
+	return m_materials[id];
+}
+
+int MaterialTable::size() const
+{
+	return static_cast<int>(m_materials.size());
+}
+
+#pragma endregion
+
 #pragma region Shader Data
 
 ShaderData::ShaderData()
 	: m_depth{ 0 }, 
 	  m_hitObject{ false }, 
-	  m_material{},
+	  m_materialId{ 0 },
 	  m_ray{},
 	  m_normal{},
 	  m_hitPoint{}
@@ -196,7 +261,7 @@ ShaderData::ShaderData()
 ShaderData::ShaderData(const ShaderData &sd)
 	: m_depth{ sd.m_depth },
 	  m_hitObject{ false },
-	  m_material{ sd.m_material },
+	  m_materialId{ sd.m_materialId },
 	  m_ray{ sd.m_ray },
 	  m_normal{ sd.m_normal },
 	  m_hitPoint{ sd.m_hitPoint }
@@ -207,7 +272,7 @@ ShaderData::ShaderData(const ShaderData &sd)
 ShaderData::ShaderData(ShaderData&& sd)
 	: m_depth{ sd.m_depth },
 	  m_hitObject{ sd.m_hitObject },
-	  m_material{ sd.m_material },
+	  m_materialId{ sd.m_materialId },
 	  m_ray{ sd.m_ray },
 	  m_normal{ sd.m_normal },
 	  m_hitPoint{ sd.m_hitPoint }
@@ -219,7 +284,7 @@ ShaderData& ShaderData::operator =(ShaderData sd)
 {
 	std::swap(m_depth, sd.m_depth);
 	std::swap(m_hitObject, sd.m_hitObject);
-	std::swap(m_material, sd.m_material);
+	std::swap(m_materialId, sd.m_materialId);
 	std::swap(m_ray, sd.m_ray);
 	std::swap(m_normal, sd.m_normal);
 	std::swap(m_hitPoint, m_hitPoint);
@@ -231,7 +296,7 @@ ShaderData& ShaderData::operator =(ShaderData&& sd)
 {
 	std::swap(m_depth, sd.m_depth);
 	std::swap(m_hitObject, sd.m_hitObject);
-	std::swap(m_material, sd.m_material);
+	std::swap(m_materialId, sd.m_materialId);
 	std::swap(m_ray, sd.m_ray);
 	std::swap(m_normal, sd.m_normal);
 	std::swap(m_hitPoint, m_hitPoint);
@@ -244,9 +309,9 @@ void ShaderData::setDepth(int d)
 	m_depth = d;
 }
 
-void ShaderData::setMaterial(Material m)
+void ShaderData::setMaterialId(unsigned id)
 {
-	m_material = m;
+	m_materialId = id;
 }
 
 void ShaderData::setRay(Ray r)
@@ -269,9 +334,9 @@ int ShaderData::getDepth() const
 	return m_depth;
 }
 
-Material ShaderData::getMaterial() const
+unsigned ShaderData::getMaterialId() const
 {
-	return m_material;
+	return m_materialId;
 }
 
 Ray ShaderData::getRay() const
@@ -139,7 +139,13 @@ public:
 	virtual Color emissive(const ShaderData&, const Light*) const;
 	virtual Color reflective() const;
 
+	bool operator ==(const Material&) const;
 	bool isReflective() const;
+	Color getka() const;
+	Color getkd() const;
+	Color getks() const;
+	float getexp() const;
+	Color getkr() const;
 	void setka(Color);
 	void setkd(Color);
 	void setks(Color);
@@ -169,11 +175,36 @@ public:
 
 #pragma endregion
 
+#pragma region Material Table
+
+/* -------------------------------------------------------------------------------------------------
+   Material Table interns every material used in the scene. Geometry and shader data refer to their
+   material by its index in the table, so finding the closest hit only ever copies an integer and
+   the BRDFs are looked up once per shaded point. Adding a material that matches one already in the
+   table returns the existing id, so a scene that switches back and forth between a few materials
+   still only stores a few.
+   -------------------------------------------------------------------------------------------------
+*/
+class MaterialTable
+{
+private:
+	std::vector<Material> m_materials;
+
+public:
+	MaterialTable();
+
+	unsigned add(const Material&);
+	const Material& operator [](unsigned) const;
+	int size() const;
+};
+
+#pragma endregion
+
 #pragma region Shader Data
 
 /* -------------------------------------------------------------------------------------------------
    Shader Data is the container class for all shading data. When tracing a ray, shader data keeps
-   track of the point the ray hit, the surface normal at that point, the material of the object
+   track of the point the ray hit, the surface normal at that point, the material id of the object
    it hit, and the depth of recursion. The Scene class then uses this data to compute the final
    color for the pixel the ray was generated for.
    -------------------------------------------------------------------------------------------------
@@ -183,7 +214,7 @@ class ShaderData
 private:
 	int m_depth;
 	bool m_hitObject;
-	Material m_material;
+	unsigned m_materialId;
 	Ray m_ray;
 	Vector<3> m_normal, m_hitPoint;
 
@@ -196,12 +227,12 @@ public:
 	ShaderData& operator =(ShaderData&&);
 
 	void setDepth(int);
-	void setMaterial(Material);
+	void setMaterialId(unsigned);
 	void setRay(Ray);
 	void setNormal(Vector<3>);
 	void setHitPoint(Vector<3>);
 	int getDepth() const;
-	Material getMaterial() const;
+	unsigned getMaterialId() const;
 	Ray getRay() const;
 	Vector<3> getNormal() const;
 	Vector<3> getHitPoint() const;
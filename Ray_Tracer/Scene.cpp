@@ -4,38 +4,20 @@
 #pragma region Sampler
 
 Sampler::Sampler(Vector<3> center, int horiz, int vert, float width, float height)
-	: m_center{ center }, m_viewport{ width, height }, x{ -1 }, y{ 0 },
-	  m_resolution{ new int[2]{horiz, vert} }
+	: m_center{ center }, m_viewport{ width, height }, m_width{ horiz }, m_height{ vert }
 {
 	
 }
 
-Vector<3> Sampler::getNext()
+Vector<3> Sampler::getPoint(Sample sample) const
 {
-	++x;
-	if (x == m_resolution[0])
-	{
-		x = 0;
-		y++;
-	}
-
 	// TODO: Add DPI scalar factor to x, y (the size of a pixel)
-	Vector<3> result{ ((x + 0.5f) * 2.0f / m_resolution[0] - 1.0f) * m_viewport[0],
-					  ((y + 0.5f) * 2.0f / m_resolution[1] - 1.0f) * m_viewport[1] };
+	Vector<3> result{ ((sample.x + 0.5f) * 2.0f / m_width - 1.0f) * m_viewport[0],
+					  ((sample.y + 0.5f) * 2.0f / m_height - 1.0f) * m_viewport[1] };
 
 	return result + m_center;
 }
 
-bool Sampler::atEnd()
-{
-	return y >= m_resolution[1];
-}
-
-Sample Sampler::currentIndex()
-{
-	return Sample(x, y);
-}
-
 void Sampler::setCenter(Vector<3> c)
 {
 	m_center = c;
@@ -43,8 +25,8 @@ void Sampler::setCenter(Vector<3> c)
 
 void Sampler::setResolution(int w, int h)
 {
-	m_resolution[0] = w;
-	m_resolution[1] = h;
+	m_width = w;
+	m_height = h;
 }
 
 void Sampler::setViewPort(float w, float h)
@@ -63,7 +45,7 @@ Camera::Camera(Vector<3> origin, PROJECTION projection)
 
 }
 
-Ray Camera::generateRay(Vector<3> coord, Sample sample)
+Ray Camera::generateRay(Vector<3> coord, Sample sample) const
 {
 	Vector<4> origin, direction;
 
@@ -135,11 +117,14 @@ void Film::displayPixel(Sample sample, Color color)
 
 void Film::display()
 {
+#ifdef USE_GLFW
 	glDrawPixels(m_width, m_height, GL_RGB, GL_FLOAT, m_pixels);
+#endif
 }
 
 void Film::outputFile()
 {
+#ifdef USE_FREEIMAGE
 	FIBITMAP *bitmap = FreeImage_Allocate(m_width, m_height, 24);
 	RGBQUAD color;
 
@@ -155,6 +140,26 @@ void Film::outputFile()
 	}
 
 	bool result = FreeImage_Save(FIF_PNG, bitmap, m_filename.c_str(), 0);
+	FreeImage_Unload(bitmap);
+#else
+	std::vector<unsigned char> rgb(m_width * m_height * 3);
+
+	// Film rows run bottom to top, like FreeImage and glDrawPixels, but PNG rows run top to bottom
+	for (int y = 0; y < m_height; y++)
+	{
+		unsigned char *row = &rgb[(m_height - 1 - y) * m_width * 3];
+
+		for (int x = 0; x < m_width; x++)
+		{
+			row[x * 3] = (unsigned char)(m_pixels[y * m_width + x].r * 255);
+			row[x * 3 + 1] = (unsigned char)(m_pixels[y * m_width + x].g * 255);
+			row[x * 3 + 2] = (unsigned char)(m_pixels[y * m_width + x].b * 255);
+		}
+	}
+
+	bool result = writePNG(m_filename, m_width, m_height, rgb.data());
+#endif
+
 	if (result)
 		std::cout << "Successfully saved file.\n";
 	else
@@ -166,6 +171,11 @@ void Film::setOutputFilename(std::string file)
 	m_filename = file;
 }
 
+std::string Film::outputFilename()
+{
+	return m_filename;
+}
+
 void Film::setDimensions(int w, int h)
 {
 	m_width = w;
@@ -195,18 +205,69 @@ Film::~Film()
 
 #pragma endregion
 
+#pragma region Tile Scheduler
+
+TileScheduler::TileScheduler(int width, int height, int tileSize, int workers)
+	: m_queues(workers)
+{
+	std::vector<Tile> tiles;
+
+	for (int y = 0; y < height; y += tileSize)
+		for (int x = 0; x < width; x += tileSize)
+			tiles.push_back(Tile{ x, y, std::min(x + tileSize, width), std::min(y + tileSize, height) });
+
+	// Give each worker a contiguous run of tiles so neighbouring pixels stay on one thread
+	int numTiles = (int)tiles.size();
+	for (int i = 0; i < numTiles; ++i)
+		m_queues[(long long)i * workers / numTiles].tiles.push_back(tiles[i]);
+}
+
+bool TileScheduler::next(int worker, Tile& tile)
+{
+	int workers = (int)m_queues.size();
+
+	// Own queue first, then try to steal from the back of everyone else's
+	for (int i = 0; i < workers; ++i)
+	{
+		WorkQueue& queue = m_queues[(worker + i) % workers];
+		std::lock_guard<std::mutex> guard{ queue.lock };
+
+		if (queue.tiles.empty())
+			continue;
+
+		if (i == 0)
+		{
+			tile = queue.tiles.front();
+			queue.tiles.pop_front();
+		}
+		else
+		{
+			tile = queue.tiles.back();
+			queue.tiles.pop_back();
+		}
+		return true;
+	}
+
+	return false;
+}
+
+#pragma endregion
+
 #pragma region Scene
 
-Color Scene::traceRay(const Ray& ray, const std::vector<Geometry*>& geometries, const int depth)
+Color Scene::traceRay(const Ray& ray, const std::vector<Geometry*>& geometries, const int depth) const
 {
 	// Recusion base case, return if we've exceeded bounce depth
 	if (depth > m_maxDepth)
 		return Color{};
 
+	if (depth > 0)
+		++threadCounters.reflectionRays;
+
 	float tMin = MAX_T;
 	bool hitObject = false;
 	Vector<3> point, normal;
-	Material material;
+	unsigned materialId = 0;
 	ShaderData shaderData;
 	shaderData.setDepth(depth);
 	shaderData.setRay(ray);
@@ -218,7 +279,7 @@ Color Scene::traceRay(const Ray& ray, const std::vector<Geometry*>& geometries,
 		// If ray intersects object at a new minimum t value, update shader data
 		if ((*geo)->hit(ray, t, shaderData) && t < tMin)
 		{
-			material = shaderData.getMaterial();
+			materialId = shaderData.getMaterialId();
 			point = shaderData.getHitPoint();
 			normal = shaderData.getNormal();
 			tMin = t;
@@ -229,9 +290,10 @@ Color Scene::traceRay(const Ray& ray, const std::vector<Geometry*>& geometries,
 	if (hitObject)
 	{
 		// Update shader data to that of intersected object and perform shading calculations
-		shaderData.setMaterial(material);
+		shaderData.setMaterialId(materialId);
 		shaderData.setHitPoint(point);
 		shaderData.setNormal(normal);
+		const Material& material = m_materials[materialId];
 
 		// Ambient Shading
 		Color color = material.ambient(shaderData, m_ambient);
@@ -246,12 +308,14 @@ Color Scene::traceRay(const Ray& ray, const std::vector<Geometry*>& geometries,
 			bool inShadow = false;
 			Ray shadowRay{ shaderData.getHitPoint(), l };
 			RayParameters params = (*light)->shadowRay(shadowRay);
+			++threadCounters.shadowRays;
 
-			//	Loop over each object in scene to see if it casts shadow
+			//	Loop over each object in scene to see if it casts shadow, only objects in front of the
+			//	light count
 			for (auto geo = m_geometries.begin(); geo != m_geometries.end(); ++geo)
 			{
 				// As soon as we find one object in the path, we can stop checking
-				if ((*geo)->shadowHit(shadowRay, params.t) && params.t < params.d)
+				if ((*geo)->occluded(shadowRay, params.d))
 				{
 					inShadow = true;
 					break;
@@ -264,7 +328,7 @@ Color Scene::traceRay(const Ray& ray, const std::vector<Geometry*>& geometries,
 		}
 
 		// Reflection Shading
-		if (shaderData.getMaterial().isReflective())
+		if (material.isReflective())
 		{
 			auto direction = shaderData.getRay().direction;
 			auto r = (direction - normal * 2.0f * direction.dotProduct(normal)).normal();
@@ -279,55 +343,115 @@ Color Scene::traceRay(const Ray& ray, const std::vector<Geometry*>& geometries,
 	return Color{};
 }
 
-Scene::Scene(int horizRes, int vertRes, PROJECTION projection, bool gridOn)
-    : m_gridOn{ gridOn },
+Scene::Scene(int horizRes, int vertRes, PROJECTION projection, ACCELERATION acceleration)
+    : m_acceleration{ acceleration },
 	  m_maxDepth{ 5 },
+	  m_threads{ 0 },
+	  m_gridMultiplier{ GRID_MULTIPLIER },
+	  m_gridDensity{ GRID_DENSITY },
 	  m_projection{ projection },
-	  m_grid{ new Grid },
+	  m_accelerator{ NULL },
 	  m_sampler{ Vector<3>{}, horizRes, vertRes },
 	  m_camera{ Vector<3>{}, projection },
+	  m_view{},
+	  m_hasView{ false },
 	  m_film{ Film(horizRes, vertRes) },
 	  m_ambient{ new Ambient() },
+	  m_materials{},
+	  m_objects{ std::vector<Geometry*>() },
 	  m_geometries{ std::vector<Geometry*>() },
-	  m_lights{ std::vector<Light*>() }
+	  m_lights{ std::vector<Light*>() },
+	  m_statistics{},
+	  m_cache{},
+	  m_cached{ false },
+	  m_sceneFile{ NULL },
+	  m_cacheFile{ NULL },
+	  m_arena{}
 {
 	
 }
 
 Scene::Scene(Scene&& scene)
-	: m_gridOn{ scene.m_gridOn },
+	: m_acceleration{ scene.m_acceleration },
 	  m_maxDepth{ scene.m_maxDepth },
+	  m_threads{ scene.m_threads },
+	  m_gridMultiplier{ scene.m_gridMultiplier },
+	  m_gridDensity{ scene.m_gridDensity },
 	  m_projection{ scene.m_projection },
-	  m_grid{ scene.m_grid },
+	  m_accelerator{ scene.m_accelerator },
 	  m_sampler{ scene.m_sampler },
 	  m_camera{ scene.m_camera },
+	  m_view{ scene.m_view },
+	  m_hasView{ scene.m_hasView },
 	  m_film{ scene.m_film },
 	  m_ambient{ scene.m_ambient },
+	  m_materials{ scene.m_materials },
+	  m_objects{ scene.m_objects },
 	  m_geometries{ scene.m_geometries },
-	  m_lights{ scene.m_lights }
-{
+	  m_lights{ scene.m_lights },
+	  m_statistics{ scene.m_statistics },
+	  m_cache{ scene.m_cache },
+	  m_cached{ scene.m_cached },
+	  m_sceneFile{ scene.m_sceneFile },
+	  m_cacheFile{ scene.m_cacheFile },
+	  m_arena{ std::move(scene.m_arena) }
+{
+	scene.m_accelerator = NULL;
+	scene.m_sceneFile = NULL;
+	scene.m_cacheFile = NULL;
+	scene.m_ambient = NULL;
+	scene.m_objects = std::vector<Geometry*>{};
 	scene.m_geometries = std::vector<Geometry*>{};
 	scene.m_lights = std::vector<Light*>{};
 }
 
 Scene& Scene::operator =(Scene&& scene)
 {
-	m_gridOn = scene.m_gridOn;
+	m_acceleration = scene.m_acceleration;
 	m_maxDepth = scene.m_maxDepth;
+	m_threads = scene.m_threads;
+	m_gridMultiplier = scene.m_gridMultiplier;
+	m_gridDensity = scene.m_gridDensity;
 	m_projection = scene.m_projection;
-	m_grid = scene.m_grid;
 	m_sampler = scene.m_sampler;
 	m_camera = scene.m_camera;
+	m_view = scene.m_view;
+	m_hasView = scene.m_hasView;
 	m_film = scene.m_film;
-	m_ambient = scene.m_ambient;
+	m_materials = scene.m_materials;
 	m_geometries = scene.m_geometries;
-	m_lights = scene.m_lights;
+	m_statistics = scene.m_statistics;
+	m_cache = scene.m_cache;
+	m_cached = scene.m_cached;
+
+	// Swap what the scenes own, so the moved from scene deletes this one's old objects
+	std::swap(m_accelerator, scene.m_accelerator);
+	std::swap(m_ambient, scene.m_ambient);
+	std::swap(m_objects, scene.m_objects);
+	std::swap(m_lights, scene.m_lights);
+	std::swap(m_sceneFile, scene.m_sceneFile);
+	std::swap(m_cacheFile, scene.m_cacheFile);
+	std::swap(m_arena, scene.m_arena);
 
 	return *this;
 }
 
+Scene::~Scene()
+{
+	// Geometry, lights and the acceleration structure all go at once
+	m_arena.clear();
+	delete m_ambient;
+
+	// After the geometry and acceleration structure, which may be using their arrays
+	delete m_sceneFile;
+	delete m_cacheFile;
+}
+
 void Scene::buildMVP(Vector<3> eye, Vector<3> center, Vector<3> up, float fov)
 {
+	m_view = CameraView{ eye, center, up, fov };
+	m_hasView = true;
+
 	auto dist = (center - eye).magnitude();
 	auto top = tanf(fov / 2.0f) * dist;
 	auto right = top * m_film.width() / m_film.height();
@@ -362,23 +486,100 @@ void Scene::buildMVP(Vector<3> eye, Vector<3> center, Vector<3> up, float fov)
 	m_camera.setTransform(transform.inverse());
 }
 
-void Scene::generateScene()
+bool Scene::generateScene()
 {
-	if (m_gridOn)
+	Timer timer;
+	int primitives = 0;
+
+	for (auto geo = m_geometries.begin(); geo != m_geometries.end(); ++geo)
+		primitives += (*geo)->primitiveCount();
+
+	int threads = m_threads;
+	if (threads <= 0)
+		threads = std::max((int)std::thread::hardware_concurrency(), 1);
+
+	if (m_cached)
 	{
-		m_grid->generateCells();
-		m_geometries.push_back(m_grid);
+		// Built when the cache was written
+		if (m_accelerator)
+			m_geometries = std::vector<Geometry*>{ m_accelerator };
 	}
-
-	auto nextPoint = m_sampler.getNext();
-	while (!m_sampler.atEnd())
+	else if (m_acceleration != NONE)
 	{
-		Ray r = m_camera.generateRay(nextPoint, m_sampler.currentIndex());
-		Color c = traceRay(r, m_geometries, 0);
-		m_film.displayPixel(r.sample, c);
+		if (m_acceleration == BVH)
+			m_accelerator = create<BoundingVolumeHierarchy>();
+		else if (m_acceleration == LBVH)
+			m_accelerator = create<LinearBVH>();
+		else
+		{
+			Grid* grid = create<Grid>();
+			grid->setMultiplier(m_gridMultiplier);
+			grid->setDensity(m_gridDensity);
+			m_accelerator = grid;
+		}
+
+		// The acceleration structure replaces the scene's geometry list
+		m_accelerator->reserve(primitives);
+		for (auto geo = m_geometries.begin(); geo != m_geometries.end(); ++geo)
+			m_accelerator->addGeometry(*geo);
 
-		nextPoint = m_sampler.getNext();
+		// The render threads aren't running yet, so the build can use all of them
+		m_accelerator->setBuildThreads(threads);
+		if (!m_accelerator->build())
+			return false;
+		m_geometries = std::vector<Geometry*>{ m_accelerator };
 	}
+
+	m_statistics.setBuildTime(timer.elapsed());
+
+	TileScheduler scheduler{ m_film.width(), m_film.height(), TILE_SIZE, threads };
+	std::vector<RayCounters> counters(threads);
+	std::vector<std::thread> workers;
+
+	timer.reset();
+
+	// The calling thread renders too, as worker 0
+	for (int i = 1; i < threads; ++i)
+		workers.push_back(std::thread{ &Scene::renderTiles, this, std::ref(scheduler), i, std::ref(counters[i]) });
+
+	renderTiles(scheduler, 0, counters[0]);
+
+	for (auto worker = workers.begin(); worker != workers.end(); ++worker)
+		worker->join();
+
+	m_statistics.setRenderTime(timer.elapsed());
+
+	for (auto c = counters.begin(); c != counters.end(); ++c)
+		m_statistics.addCounters(*c);
+
+	const char *names[] = { "none", "grid", "bvh", "lbvh" };
+	m_statistics.setConfiguration(names[m_acceleration], m_film.width(), m_film.height(), threads,
+		primitives, numLights());
+
+	return true;
+}
+
+void Scene::renderTiles(TileScheduler& scheduler, int worker, RayCounters& counters)
+{
+	Tile tile;
+	threadCounters = RayCounters{};
+
+	while (scheduler.next(worker, tile))
+	{
+		for (int y = tile.y0; y < tile.y1; ++y)
+		{
+			for (int x = tile.x0; x < tile.x1; ++x)
+			{
+				Sample sample{ x, y };
+				Ray r = m_camera.generateRay(m_sampler.getPoint(sample), sample);
+				Color c = traceRay(r, m_geometries, 0);
+				m_film.displayPixel(r.sample, c);
+				++threadCounters.primaryRays;
+			}
+		}
+	}
+
+	counters = threadCounters;
 }
 
 void Scene::display()
@@ -388,7 +589,29 @@ void Scene::display()
 
 void Scene::outputToFile()
 {
+	Timer timer;
 	m_film.outputFile();
+	m_statistics.setEncodeTime(timer.elapsed());
+}
+
+bool Scene::writeReport()
+{
+	m_statistics.setOutputFile(m_film.outputFilename());
+	return m_statistics.writeReport(reportFilename());
+}
+
+std::string Scene::reportFilename()
+{
+	std::string output = m_film.outputFilename();
+	std::string report = output;
+
+	// scene.png is reported in scene.json, keeping any directory
+	auto dot = output.find_last_of('.');
+	auto slash = output.find_last_of("/\\");
+	if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+		report = output.substr(0, dot);
+
+	return report + ".json";
 }
 
 void Scene::addLight(Light *light)
@@ -396,12 +619,22 @@ void Scene::addLight(Light *light)
 	m_lights.push_back(light);
 }
 
+unsigned Scene::addMaterial(const Material& material)
+{
+	return m_materials.add(material);
+}
+
 void Scene::addGeometry(Geometry *geo)
 {
-	if (m_gridOn)
-		m_grid->addGeometry(geo);
-	else
-		m_geometries.push_back(geo);
+	m_objects.push_back(geo);
+	m_geometries.push_back(geo);
+}
+
+// Makes room for more geometry, so adding it doesn't reallocate the lists
+void Scene::reserveGeometry(int count)
+{
+	m_objects.reserve(m_objects.size() + count);
+	m_geometries.reserve(m_geometries.size() + count);
 }
 
 void Scene::setScreenDimensions(int width, int height)
@@ -420,6 +653,67 @@ void Scene::setMaxDepth(int d)
 	m_maxDepth = d;
 }
 
+void Scene::setAcceleration(ACCELERATION a)
+{
+	m_acceleration = a;
+}
+
+void Scene::setThreadCount(int threads)
+{
+	m_threads = threads;
+}
+
+void Scene::setGridMultiplier(float multiplier)
+{
+	m_gridMultiplier = multiplier;
+}
+
+void Scene::setGridDensity(int density)
+{
+	m_gridDensity = density;
+}
+
+bool Scene::loadCache(const SceneCache& cache)
+{
+	std::vector<Geometry*> geometries;
+	Compound* accelerator = NULL;
+	m_cache = cache;
+
+	if (m_cached || !m_objects.empty())
+		return false;
+
+	// Kept mapped for as long as the scene, as what's loaded uses the cache's arrays in place
+	MappedFile *file = new MappedFile{ cache.fileName() };
+	if (!cache.load(*file, m_acceleration, m_materials, geometries, accelerator, m_arena))
+	{
+		delete file;
+		return false;
+	}
+
+	m_cacheFile = file;
+
+	for (auto geo = geometries.begin(); geo != geometries.end(); ++geo)
+		addGeometry(*geo);
+
+	m_accelerator = accelerator;
+	m_cached = true;
+	return true;
+}
+
+// Writes the scene's cache once it's generated, unless it was loaded from there in the first place
+bool Scene::saveCache()
+{
+	if (m_cached || m_cache.fileName().empty())
+		return false;
+
+	return m_cache.save(m_acceleration, m_materials, m_objects, m_accelerator);
+}
+
+Statistics& Scene::statistics()
+{
+	return m_statistics;
+}
+
 int Scene::numGeometries()
 {
 	return (int)m_geometries.size();
@@ -22,19 +22,39 @@
 #define SCENE_H
 
 #include <iostream>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
 #include <Windows.h>
-#include <gl\GL.h>
-#include <gl\GLU.h>
-#include <GLFW\glfw3.h>
-#include <FreeImage\FreeImage.h>
+#endif
+
+// Optional components, enabled by the build when the libraries are available
+#ifdef USE_GLFW
+#include <GLFW/glfw3.h>
+#endif
+
+#ifdef USE_FREEIMAGE
+#if __has_include(<FreeImage/FreeImage.h>)
+#include <FreeImage/FreeImage.h>
+#else
+#include <FreeImage.h>
+#endif
+#endif
 
 #include "Assets.h"
+#include "PNGWriter.h"
+#include "SceneCache.h"
+#include "Statistics.h"
 
 #pragma region Sampler
 
 /* -------------------------------------------------------------------------------------------------
-   Sampler is used as an iterator by the Scene to grab each pixel one by one to be converted into rays.
-   Its resolution and viewport should be set for starting raytracing to avoid errors in rendering
+   Sampler maps a pixel of the film to the matching point on the camera's viewport, which the
+   camera turns into a ray. It keeps no iteration state, so any number of render threads can share
+   one. Its resolution and viewport should be set before ray tracing to avoid errors in rendering.
    -------------------------------------------------------------------------------------------------
 */
 class Sampler
@@ -42,14 +62,12 @@ class Sampler
 private:
 	Vector<3> m_center;
 	Vector<2> m_viewport;
-	int x, y, *m_resolution;
+	int m_width, m_height;
 
 public:
 	Sampler(Vector<3> = Vector<3>{}, int = 0, int = 0, float = 0, float = 0);
 	
-	Vector<3> getNext();
-	bool atEnd();
-	Sample currentIndex();
+	Vector<3> getPoint(Sample) const;
 	void setCenter(Vector<3>);
 	void setResolution(int, int);
 	void setViewPort(float, float);
@@ -76,7 +94,7 @@ private:
 public:
 	Camera(Vector<3> = Vector<3>(), PROJECTION = ORTHO);
 
-	Ray generateRay(Vector<3>, Sample);
+	Ray generateRay(Vector<3>, Sample) const;
 	void setTransform(Matrix<4,4>);
 	void setOrigin(Vector<3>);
 };
@@ -88,6 +106,8 @@ public:
 /* -------------------------------------------------------------------------------------------------
    Film stores the array of rgb values that the ray tracer computes for each pixel. It can then 
    store the result into a file and/or blit it to the display window using glDrawPixels.
+   Images are saved with FreeImage when it's available and the built-in PNG writer otherwise.
+   Without GLFW there's no window to blit to and display does nothing.
    -------------------------------------------------------------------------------------------------
 */
 
@@ -109,6 +129,7 @@ public:
 	void outputFile();
 	void setOutputFilename(std::string);
 	void setDimensions(int, int);
+	std::string outputFilename();
 	int width();
 	int height();
 
@@ -117,8 +138,55 @@ public:
 
 #pragma endregion
 
+#pragma region Tile Scheduler
+
+/* -------------------------------------------------------------------------------------------------
+   A rectangular block of pixels, from (x0, y0) up to but not including (x1, y1).
+   -------------------------------------------------------------------------------------------------
+*/
+struct Tile
+{
+	int x0, y0, x1, y1;
+};
+
+/* -------------------------------------------------------------------------------------------------
+   Hands out the film's tiles to render threads. Each worker starts with its own contiguous run of
+   tiles, taking them from the front of its queue. A worker that runs out steals from the back of
+   another worker's queue, so threads that finish cheap regions early keep busy helping with
+   expensive ones (reflective surfaces, dense geometry) instead of sitting idle.
+   -------------------------------------------------------------------------------------------------
+*/
+class TileScheduler
+{
+private:
+	struct WorkQueue
+	{
+		std::mutex lock;
+		std::deque<Tile> tiles;
+	};
+
+	std::vector<WorkQueue> m_queues;
+
+public:
+	TileScheduler(int, int, int, int);
+
+	TileScheduler(const TileScheduler&) = delete;
+	TileScheduler& operator=(const TileScheduler&) = delete;
+
+	bool next(int, Tile&);
+};
+
+#pragma endregion
+
 #pragma region Scene
 
+// Where the camera was placed from, kept so the scene can be saved again
+struct CameraView
+{
+	Vector<3> eye, center, up;
+	float fov;
+};
+
 /* -------------------------------------------------------------------------------------------------
    Scene is the main ray tracing class. It hold lists of the geometries and lights in the scene and
    loops over them in traceRay to compute the shader data for each ray. traceRay is a recursive 
@@ -133,30 +201,62 @@ public:
 	   - If the material is reflective and we haven't exceeded max depth, then traceRay recurses and
 	     we add future computed shading data to the color
 	   - The resulting color is stored in Film's pixel array.
+   Rendering is split into tiles that are traced in parallel by a configurable number of threads,
+   so everything reached from traceRay has to be safe to call concurrently.
+   Each stage of the render is timed and the rays cast are counted in the scene's Statistics, which
+   writeReport saves as JSON next to the output image (scene.png gets scene.json).
    Notes:
        - Currently the ambient light is set to a default (1, 1, 1) color value. Can change to give 
 	     scenes a colored tint.
+	   - Materials are interned in a table and geometry refers to them by id, so identical
+	     materials are only stored once.
+	   - Geometry, lights and the acceleration structure are created in the scene's arena with
+	     create, which keeps them together in memory and frees them all when the scene is
+	     destroyed, so a batch of scenes can be rendered in one process. Anything added to a
+	     scene has to come from its arena.
+	   - Geometry is collected as it's added and handed to the acceleration structure (a linear grid
+	     by default, or a bounding volume hierarchy built with the surface area heuristic or from Morton
+	     codes) when the scene is generated.
+	   - A scene loaded from its cache already has its acceleration structure, so generating it
+	     skips the build, and keeps the cache mapped, since its meshes and acceleration structure
+	     use their arrays in place.
+	   - A scene loaded from a binary scene file keeps the file mapped, since its meshes use their
+	     arrays in place.
 -------------------------------------------------------------------------------------------------
 */
 
 class Scene
 {
 private:
-	bool m_gridOn;
+	ACCELERATION m_acceleration;
 	int m_maxDepth;
+	int m_threads;
+	float m_gridMultiplier;
+	int m_gridDensity;
 	PROJECTION m_projection;
-	Grid *m_grid;
+	Compound *m_accelerator;
 	Sampler m_sampler;
 	Camera m_camera;
+	CameraView m_view;
+	bool m_hasView;
 	Film m_film;
 	Ambient* m_ambient;
+	MaterialTable m_materials;
+	std::vector<Geometry*> m_objects;
 	std::vector<Geometry*> m_geometries;
 	std::vector<Light*> m_lights;
+	Statistics m_statistics;
+	SceneCache m_cache;
+	bool m_cached;
+	MappedFile *m_sceneFile;
+	MappedFile *m_cacheFile;
+	Arena m_arena;
 
-	Color traceRay(const Ray&, const std::vector<Geometry*>&, const int);
+	Color traceRay(const Ray&, const std::vector<Geometry*>&, const int) const;
+	void renderTiles(TileScheduler&, int, RayCounters&);
 
 public:
-	Scene(int = SCREEN_WIDTH, int = SCREEN_HEIGHT, PROJECTION = PERSPECTIVE, bool = true);
+	Scene(int = SCREEN_WIDTH, int = SCREEN_HEIGHT, PROJECTION = PERSPECTIVE, ACCELERATION = GRID);
 	
 	// Only one scene created in program
 	Scene(const Scene&) = delete;
@@ -165,21 +265,46 @@ public:
 	Scene(Scene&&);
 	Scene& operator =(Scene&&);
 
+	~Scene();
+
+	template <typename T, typename... Args>
+	T* create(Args&&...);
+
 	void buildMVP(Vector<3>, Vector<3>, Vector<3>, float);
-	void generateScene();
+	bool generateScene();
 	void display();
 	void outputToFile();
+	bool writeReport();
+	std::string reportFilename();
 	void addLight(Light*);
+	unsigned addMaterial(const Material&);
 	void addGeometry(Geometry*);
+	void reserveGeometry(int);
 	void setScreenDimensions(int, int);
 	void setOutputFilename(std::string);
 	void setMaxDepth(int);
+	void setAcceleration(ACCELERATION);
+	void setThreadCount(int);
+	void setGridMultiplier(float);
+	void setGridDensity(int);
+	bool loadCache(const SceneCache&);
+	bool saveCache();
+	Statistics& statistics();
 	int numGeometries();
 	int numLights();
 	int screenWidth();
 	int screenHeight();
+
+	friend class SceneFile;
 };
 
+// Creates an object owned by the scene, which lives until the scene is destroyed
+template <typename T, typename... Args>
+T* Scene::create(Args&&... args)
+{
+	return m_arena.create<T>(std::forward<Args>(args)...);
+}
+
 #pragma endregion
 
 #endif
\ No newline at end of file
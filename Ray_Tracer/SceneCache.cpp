@@ -0,0 +1,626 @@
+#include "stdafx.h"
+#include "SceneCache.h"
+
+#include <climits>
+#include <cstdio>
+#include <unordered_map>
+
+#pragma region Cache Streams
+
+CacheWriter::CacheWriter(const std::string& fileName)
+	: m_file{ fileName, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc }, m_offset{ 0 }
+{
+
+}
+
+bool CacheWriter::good() const
+{
+	return m_file.good();
+}
+
+void CacheWriter::writeString(std::string_view text)
+{
+	writeArray(text.data(), text.size());
+}
+
+// Pads the file out to the next multiple of CACHE_ALIGNMENT
+void CacheWriter::align()
+{
+	static const char padding[CACHE_ALIGNMENT] = {};
+	size_t remainder = m_offset % CACHE_ALIGNMENT;
+
+	if (remainder != 0)
+	{
+		m_file.write(padding, CACHE_ALIGNMENT - remainder);
+		m_offset += CACHE_ALIGNMENT - remainder;
+	}
+}
+
+CacheReader::CacheReader(const char *data, size_t size)
+	: m_begin{ data }, m_current{ data }, m_end{ data + size }, m_good{ data != NULL }
+{
+
+}
+
+bool CacheReader::good() const
+{
+	return m_good;
+}
+
+const char* CacheReader::position() const
+{
+	return m_current;
+}
+
+bool CacheReader::readString(std::string& text)
+{
+	const char *characters;
+	size_t count;
+
+	if (!viewArray(characters, count))
+		return false;
+
+	text.assign(characters, count);
+	return true;
+}
+
+// Skips the padding CacheWriter::align wrote
+bool CacheReader::align()
+{
+	size_t remainder = (size_t)(m_current - m_begin) % CACHE_ALIGNMENT;
+
+	if (remainder != 0)
+	{
+		if ((size_t)(m_end - m_current) < CACHE_ALIGNMENT - remainder)
+			return m_good = false;
+
+		m_current += CACHE_ALIGNMENT - remainder;
+	}
+
+	return m_good;
+}
+
+#pragma endregion
+
+#pragma region Scene Cache
+
+static const char CACHE_MAGIC[8] = { 'R', 'T', 'C', 'A', 'C', 'H', 'E', '\0' };
+
+enum CACHED_GEOMETRY { CACHED_SPHERE, CACHED_MESH };
+
+/* -------------------------------------------------------------------------------------------------
+   Start of every cache file. The layout fields hold the sizes of the structures copied as raw
+   bytes, which change with the SIMD width the tracer was built for.
+   -------------------------------------------------------------------------------------------------
+*/
+struct CacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	int32_t acceleration;
+	uint32_t layout[4];
+	uint64_t key;
+};
+
+static CacheHeader cacheHeader(uint64_t key, ACCELERATION acceleration)
+{
+	CacheHeader header{};
+	std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = SCENE_CACHE_VERSION;
+	header.layout[0] = BOX_GROUP_SIZE;
+	header.layout[1] = sizeof(PrimitiveGroup);
+	header.layout[2] = sizeof(WideBVHNode);
+	header.layout[3] = sizeof(SubGrid);
+	header.key = key;
+	header.acceleration = acceleration;
+
+	return header;
+}
+
+SceneCache::SceneCache(std::string fileName, uint64_t key)
+	: m_fileName{ fileName }, m_key{ key }
+{
+
+}
+
+// Mixes one word into a hash. Every step can be undone, so changing any one word changes the hash
+static uint64_t hashWord(uint64_t value, uint64_t word)
+{
+	value = (value ^ word) * 0x9e3779b97f4a7c15ull;
+	return value ^ (value >> 29);
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Continues a previous hash over the given bytes, so a key can be built up a piece at a time. The
+   bytes are taken a word at a time, as keys cover whole scene files, and the length of each piece
+   is mixed in last so pieces can't run into each other.
+   -------------------------------------------------------------------------------------------------
+*/
+uint64_t SceneCache::hash(uint64_t value, std::string_view bytes)
+{
+	const char *c = bytes.data(), *end = bytes.data() + bytes.size();
+	uint64_t word;
+
+	for (; end - c >= (ptrdiff_t)sizeof(word); c += sizeof(word))
+	{
+		std::memcpy(&word, c, sizeof(word));
+		value = hashWord(value, word);
+	}
+
+	word = 0;
+	std::memcpy(&word, c, end - c);
+	value = hashWord(value, word);
+
+	return hashWord(value, bytes.size());
+}
+
+const std::string& SceneCache::fileName() const
+{
+	return m_fileName;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Loads the cache, mapped from this cache's file, if it was written for this key, filling in the
+   acceleration it was built with, the material table, the geometry and the acceleration structure
+   (NULL without one), which are created in the given arena and view their arrays in the file.
+   Nothing is changed if the cache is missing, stale or damaged.
+   -------------------------------------------------------------------------------------------------
+*/
+bool SceneCache::load(const MappedFile& file, ACCELERATION& acceleration, MaterialTable& materials,
+	std::vector<Geometry*>& geometries, Compound*& accelerator, Arena& arena) const
+{
+	// Everything's read into an arena of its own, handed over only once the whole cache checks out
+	Arena loadArena;
+	CacheReader reader{ file.data(), file.size() };
+	CacheHeader header;
+
+	if (!reader.read(header))
+		return false;
+
+	CacheHeader expected = cacheHeader(m_key, NONE);
+	if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version ||
+		std::memcmp(header.layout, expected.layout, sizeof(header.layout)) != 0 || header.key != expected.key ||
+		header.acceleration < NONE || header.acceleration > LBVH)
+		return false;
+
+	MaterialTable table;
+	readMaterials(reader, table);
+	unsigned numMaterials = (unsigned)table.size();
+
+	// Geometry, then the acceleration structure over it
+	std::vector<Geometry*> loaded;
+	uint32_t numGeometries = 0;
+	reader.read(numGeometries);
+
+	for (uint32_t g = 0; g < numGeometries && reader.good(); ++g)
+	{
+		Geometry *geometry = readGeometry(reader, loadArena, true);
+		if (!geometry)
+			break;
+
+		loaded.push_back(geometry);
+		if (geometry->getMaterialId() >= numMaterials)
+			break;
+	}
+
+	Compound *structure = NULL;
+	bool valid = reader.good() && loaded.size() == numGeometries &&
+		(numGeometries == 0 || loaded.back()->getMaterialId() < numMaterials);
+
+	if (valid && header.acceleration != NONE)
+	{
+		structure = readAccelerator(reader, (ACCELERATION)header.acceleration, loaded, loadArena);
+		valid = structure != NULL;
+	}
+
+	if (!valid)
+		return false;
+
+	arena.append(loadArena);
+	acceleration = (ACCELERATION)header.acceleration;
+	materials = table;
+	geometries = loaded;
+	accelerator = structure;
+
+	return true;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Writes the cache, first to a temporary file that then replaces the old cache, so a render that's
+   stopped part way never leaves a half written cache behind. Returns false, writing nothing, if
+   the scene holds geometry that can't be cached.
+   -------------------------------------------------------------------------------------------------
+*/
+bool SceneCache::save(ACCELERATION acceleration, const MaterialTable& materials, const std::vector<Geometry*>& geometries,
+	const Compound* accelerator) const
+{
+	std::string temporary = m_fileName + ".tmp";
+	bool written;
+
+	{
+		CacheWriter writer{ temporary };
+		writer.write(cacheHeader(m_key, acceleration));
+		writeMaterials(writer, materials);
+
+		written = true;
+		writer.write((uint32_t)geometries.size());
+		for (auto geo = geometries.begin(); geo != geometries.end() && written; ++geo)
+			written = writeGeometry(writer, *geo);
+
+		if (written && acceleration != NONE)
+			written = writeAccelerator(writer, acceleration, accelerator, geometries);
+
+		written = written && writer.good();
+	}
+
+	if (!written)
+	{
+		std::remove(temporary.c_str());
+		return false;
+	}
+
+	// Renaming over an existing file fails on Windows
+	std::remove(m_fileName.c_str());
+	return std::rename(temporary.c_str(), m_fileName.c_str()) == 0;
+}
+
+void SceneCache::writeMaterials(CacheWriter& writer, const MaterialTable& materials)
+{
+	writer.write((uint32_t)materials.size());
+	for (int m = 0; m < materials.size(); ++m)
+	{
+		const Material& material = materials[m];
+		writer.write(material.getka());
+		writer.write(material.getkd());
+		writer.write(material.getks());
+		writer.write(material.getexp());
+		writer.write(material.getkr());
+	}
+}
+
+// Reads a material table, which has to hold every material read for the table to match ids
+bool SceneCache::readMaterials(CacheReader& reader, MaterialTable& materials)
+{
+	MaterialTable table;
+	uint32_t numMaterials = 0;
+	reader.read(numMaterials);
+
+	for (uint32_t m = 0; m < numMaterials && reader.good(); ++m)
+	{
+		Color ka, kd, ks, kr;
+		float exp = 0;
+		reader.read(ka);
+		reader.read(kd);
+		reader.read(ks);
+		reader.read(exp);
+		reader.read(kr);
+		table.add(Material{ ka, kd, ks, exp, kr });
+	}
+
+	if (!reader.good() || (uint32_t)table.size() != numMaterials)
+		return false;
+
+	materials = table;
+	return true;
+}
+
+bool SceneCache::writeGeometry(CacheWriter& writer, const Geometry* geometry)
+{
+	if (auto sphere = dynamic_cast<const Sphere*>(geometry))
+	{
+		writer.write((uint32_t)CACHED_SPHERE);
+		writer.write(sphere->materialId);
+		writer.write(sphere->invTransform);
+		writer.write(sphere->boundingBox);
+		writer.write(sphere->center);
+		writer.write(sphere->radius);
+		return true;
+	}
+
+	if (auto mesh = dynamic_cast<const TriangleMesh*>(geometry))
+	{
+		writer.write((uint32_t)CACHED_MESH);
+		writer.write(mesh->materialId);
+		writer.write(mesh->boundingBox);
+		writer.write((uint32_t)mesh->m_watertight);
+		writer.writeArray(mesh->m_vertices, (size_t)mesh->m_numVertices);
+		writer.writeArray(mesh->m_indices, (size_t)mesh->m_numIndices);
+		return true;
+	}
+
+	return false;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Reads a geometry written by writeGeometry, or returns NULL if it's damaged. With inPlace, a mesh
+   views its arrays where they lie in the reader's file, which then has to outlive it.
+   -------------------------------------------------------------------------------------------------
+*/
+Geometry* SceneCache::readGeometry(CacheReader& reader, Arena& arena, bool inPlace)
+{
+	uint32_t type = 0;
+	unsigned materialId = 0;
+	BoundingBox box;
+
+	if (!reader.read(type) || !reader.read(materialId))
+		return NULL;
+
+	if (type == CACHED_SPHERE)
+	{
+		Matrix<4, 4> invTransform;
+		Vector<3> center;
+		float radius = 0;
+		reader.read(invTransform);
+		reader.read(box);
+		reader.read(center);
+		reader.read(radius);
+
+		Sphere *sphere = arena.create<Sphere>(center, radius, materialId, invTransform);
+		sphere->boundingBox = box;
+		return sphere;
+	}
+
+	if (type == CACHED_MESH)
+	{
+		const Vector<3> *vertices;
+		const int *indices;
+		size_t numVertices, numIndices;
+		uint32_t watertight = 0;
+
+		reader.read(box);
+		reader.read(watertight);
+		if (!reader.viewArray(vertices, numVertices) || !reader.viewArray(indices, numIndices) ||
+			numVertices > (size_t)INT_MAX || numIndices > (size_t)INT_MAX || numIndices % 3 != 0)
+			return NULL;
+
+		for (size_t i = 0; i < numIndices; ++i)
+		{
+			if (indices[i] < 0 || indices[i] >= (int)numVertices)
+				return NULL;
+		}
+
+		TriangleMesh *mesh = arena.create<TriangleMesh>(materialId);
+		mesh->boundingBox = box;
+		mesh->setWatertight(watertight != 0);
+
+		if (inPlace)
+			mesh->viewArrays(vertices, (int)numVertices, indices, (int)numIndices);
+		else
+		{
+			mesh->m_vertexStorage.assign(vertices, vertices + numVertices);
+			mesh->m_indexStorage.assign(indices, indices + numIndices);
+			mesh->m_vertices = mesh->m_vertexStorage.data();
+			mesh->m_indices = mesh->m_indexStorage.data();
+			mesh->m_numVertices = (int)numVertices;
+			mesh->m_numIndices = (int)numIndices;
+		}
+
+		return mesh;
+	}
+
+	return NULL;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   The acceleration structure is stored as the arrays it's traced from, which a loaded structure
+   views where they lie in the file. Primitives refer to their geometry by its position in the
+   scene's geometry list, so they're the one array rebuilt on loading.
+   -------------------------------------------------------------------------------------------------
+*/
+bool SceneCache::writeAccelerator(CacheWriter& writer, ACCELERATION acceleration, const Compound* accelerator,
+	const std::vector<Geometry*>& geometries)
+{
+	if (!accelerator)
+		return false;
+
+	std::unordered_map<const Geometry*, int> ids;
+	for (int g = 0; g < (int)geometries.size(); ++g)
+		ids[geometries[g]] = g;
+
+	std::vector<int> primitives;
+	primitives.reserve(2 * accelerator->primitives.size());
+
+	for (auto primitive = accelerator->primitives.begin(); primitive != accelerator->primitives.end(); ++primitive)
+	{
+		auto id = ids.find(primitive->geometry);
+		if (id == ids.end())
+			return false;
+
+		primitives.push_back(id->second);
+		primitives.push_back(primitive->index);
+	}
+
+	writer.write(accelerator->boundingBox);
+	writer.writeArray(primitives);
+	writer.writeArray(accelerator->groups);
+
+	if (acceleration == GRID)
+	{
+		const Grid *grid = dynamic_cast<const Grid*>(accelerator);
+		if (!grid)
+			return false;
+
+		int resolution[3] = { grid->nx, grid->ny, grid->nz };
+		writer.write(resolution);
+		writer.write(grid->multiplier);
+		writer.write(grid->density);
+		writer.writeArray(grid->cellOffsets);
+		writer.writeArray(grid->cellPrimitives);
+		writer.writeArray(grid->cellSubGrids);
+		writer.writeArray(grid->subCellOffsets);
+		writer.writeArray(grid->subGrids);
+		return true;
+	}
+
+	const BoundingVolumeHierarchy *bvh = dynamic_cast<const BoundingVolumeHierarchy*>(accelerator);
+	if (!bvh)
+		return false;
+
+	writer.writeArray(bvh->wideNodes);
+	return true;
+}
+
+Compound* SceneCache::readAccelerator(CacheReader& reader, ACCELERATION acceleration, const std::vector<Geometry*>& geometries,
+	Arena& arena)
+{
+	Compound *accelerator = NULL;
+	Grid *grid = NULL;
+	BoundingVolumeHierarchy *bvh = NULL;
+
+	if (acceleration == GRID)
+		accelerator = grid = arena.create<Grid>();
+	else if (acceleration == BVH)
+		accelerator = bvh = arena.create<BoundingVolumeHierarchy>();
+	else if (acceleration == LBVH)
+		accelerator = bvh = arena.create<LinearBVH>();
+	else
+		return NULL;
+
+	ArrayView<int> primitives;
+	reader.read(accelerator->boundingBox);
+	reader.viewArray(primitives);
+	reader.viewArray(accelerator->groups);
+
+	bool valid = reader.good() && primitives.size() % 2 == 0;
+
+	// Counted once per geometry rather than once per primitive
+	std::vector<int> primitiveCounts(geometries.size());
+	for (size_t g = 0; g < geometries.size(); ++g)
+		primitiveCounts[g] = geometries[g]->primitiveCount();
+
+	accelerator->primitives.reserve(primitives.size() / 2);
+
+	for (size_t p = 0; valid && p < primitives.size(); p += 2)
+	{
+		int id = primitives[p];
+		valid = id >= 0 && id < (int)geometries.size() && primitives[p + 1] >= 0 && primitives[p + 1] < primitiveCounts[id];
+
+		if (valid)
+			accelerator->primitives.push_back(Primitive{ geometries[id], primitives[p + 1] });
+	}
+
+	if (valid && grid)
+	{
+		int resolution[3];
+		reader.read(resolution);
+		reader.read(grid->multiplier);
+		reader.read(grid->density);
+		reader.viewArray(grid->cellOffsets);
+		reader.viewArray(grid->cellPrimitives);
+		reader.viewArray(grid->cellSubGrids);
+		reader.viewArray(grid->subCellOffsets);
+		reader.viewArray(grid->subGrids);
+
+		grid->nx = resolution[0];
+		grid->ny = resolution[1];
+		grid->nz = resolution[2];
+
+		valid = reader.good() && validGrid(*grid);
+	}
+	else if (valid && bvh)
+	{
+		valid = reader.viewArray(bvh->wideNodes) && validHierarchy(*bvh);
+	}
+
+	// The arrays of spheres and triangles point into the geometry, so they're gathered again rather
+	// than cached, which also checks the groups only refer to primitives that exist
+	valid = valid && accelerator->gatherPrimitives();
+
+	// Anything left unfinished is freed along with the arena
+	return valid ? accelerator : NULL;
+}
+
+// Whether every offset of a run, which has to be in order, lies within the groups
+static bool validOffsets(const ArrayView<int>& offsets, size_t begin, size_t end, int numGroups)
+{
+	for (size_t i = begin; i < end; ++i)
+	{
+		if (offsets[i] < 0 || offsets[i] > numGroups || (i > begin && offsets[i] < offsets[i - 1]))
+			return false;
+	}
+
+	return true;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Checks everything a grid's traversal indexes with, so a damaged cache is rebuilt rather than read
+   out of bounds: every cell's groups, the sub-grid of every cell, and the cells of every sub-grid.
+   -------------------------------------------------------------------------------------------------
+*/
+bool SceneCache::validGrid(const Grid& grid)
+{
+	if (grid.nx <= 0 || grid.ny <= 0 || grid.nz <= 0)
+		return false;
+
+	long long numCells = (long long)grid.nx * grid.ny * grid.nz;
+	int numGroups = (int)grid.groups.size();
+
+	if ((long long)grid.cellOffsets.size() != numCells + 1 || (long long)grid.cellSubGrids.size() != numCells ||
+		!validOffsets(grid.cellOffsets, 0, grid.cellOffsets.size(), numGroups) ||
+		!validOffsets(grid.subCellOffsets, 0, grid.subCellOffsets.size(), numGroups))
+		return false;
+
+	for (auto subGrid = grid.cellSubGrids.begin(); subGrid != grid.cellSubGrids.end(); ++subGrid)
+	{
+		if (*subGrid < -1 || *subGrid >= (int)grid.subGrids.size())
+			return false;
+	}
+
+	// Each sub-grid reads the offsets of its cells and the one after its last
+	for (auto sub = grid.subGrids.begin(); sub != grid.subGrids.end(); ++sub)
+	{
+		if (sub->nx <= 0 || sub->ny <= 0 || sub->nz <= 0 || sub->firstCell < 0 ||
+			sub->firstCell + (long long)sub->nx * sub->ny * sub->nz >= (long long)grid.subCellOffsets.size())
+			return false;
+	}
+
+	return true;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Checks a hierarchy's nodes the same way. Nodes are stored before their children, so requiring
+   every child to come after its parent rules out cycles, and the depth worked out in that order
+   has to fit the traversal stack. Unused lanes must keep their empty boxes, as no ray enters them.
+   -------------------------------------------------------------------------------------------------
+*/
+bool SceneCache::validHierarchy(const BoundingVolumeHierarchy& bvh)
+{
+	int numNodes = (int)bvh.wideNodes.size();
+	long long numGroups = (long long)bvh.groups.size();
+	const BoxGroup empty{};
+	std::vector<int> depths(numNodes, 1);
+
+	for (int index = 0; index < numNodes; ++index)
+	{
+		const WideBVHNode& node = bvh.wideNodes[index];
+
+		if (depths[index] > BVH_MAX_DEPTH)
+			return false;
+
+		for (int lane = 0; lane < BOX_GROUP_SIZE; ++lane)
+		{
+			int offset = node.offsets[lane], count = node.counts[lane];
+
+			if (count > 0)
+			{
+				if (offset < 0 || offset + (long long)count > numGroups)
+					return false;
+			}
+			else if (count == 0 && offset > index && offset < numNodes)
+				depths[offset] = std::max(depths[offset], depths[index] + 1);
+			else
+			{
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					if (count != 0 || node.boxes.bounds[0][axis][lane] != empty.bounds[0][axis][lane] ||
+						node.boxes.bounds[1][axis][lane] != empty.bounds[1][axis][lane])
+						return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+#pragma endregion
@@ -0,0 +1,245 @@
+/* -------------------------------------------------------------------------------------------------
+   Copyright 2017 Shealyn Tate Hindenlang
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge, publish, distribute,
+   sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   -------------------------------------------------------------------------------------------------
+*/
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+
+#include "Assets.h"
+
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#pragma region Cache Streams
+
+// Arrays start on a multiple of this many bytes from the start of the file, a cache line, so they can be
+// used in place
+static const size_t CACHE_ALIGNMENT = 64;
+
+/* -------------------------------------------------------------------------------------------------
+   Writes values and arrays of plain data to a cache or binary scene file, byte for byte. An array
+   is written as its length followed by its elements, which are aligned to CACHE_ALIGNMENT.
+   -------------------------------------------------------------------------------------------------
+*/
+class CacheWriter
+{
+private:
+	std::ofstream m_file;
+	size_t m_offset;
+
+	void align();
+
+public:
+	CacheWriter(const std::string&);
+
+	bool good() const;
+
+	template <typename T>
+	void write(const T&);
+
+	template <typename T>
+	void writeArray(const T*, size_t);
+
+	template <typename T>
+	void writeArray(const std::vector<T>&);
+
+	template <typename T>
+	void writeArray(const ArrayView<T>&);
+
+	void writeString(std::string_view);
+};
+
+template <typename T>
+void CacheWriter::write(const T& value)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Only plain data can be cached");
+	m_file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+	m_offset += sizeof(T);
+}
+
+template <typename T>
+void CacheWriter::writeArray(const T* values, size_t count)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Only plain data can be cached");
+	write((uint64_t)count);
+	align();
+	m_file.write(reinterpret_cast<const char*>(values), count * sizeof(T));
+	m_offset += count * sizeof(T);
+}
+
+template <typename T>
+void CacheWriter::writeArray(const std::vector<T>& values)
+{
+	writeArray(values.data(), values.size());
+}
+
+template <typename T>
+void CacheWriter::writeArray(const ArrayView<T>& values)
+{
+	writeArray(values.data(), values.size());
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Reads back what a CacheWriter wrote, from a mapped file. Every read is checked against the end of
+   the file, and once one fails so does every read after it, so a truncated file is caught by
+   checking good once at the end. Arrays can be copied out, or viewed where they lie in the file.
+   -------------------------------------------------------------------------------------------------
+*/
+class CacheReader
+{
+private:
+	const char *m_begin, *m_current, *m_end;
+	bool m_good;
+
+	bool align();
+
+public:
+	CacheReader(const char*, size_t);
+
+	bool good() const;
+	const char* position() const;
+
+	template <typename T>
+	bool read(T&);
+
+	template <typename T>
+	bool viewArray(const T*&, size_t&);
+
+	template <typename T>
+	bool viewArray(ArrayView<T>&);
+
+	template <typename T>
+	bool readArray(std::vector<T>&);
+
+	bool readString(std::string&);
+};
+
+template <typename T>
+bool CacheReader::read(T& value)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Only plain data can be cached");
+
+	if (!m_good || (size_t)(m_end - m_current) < sizeof(T))
+		return m_good = false;
+
+	std::memcpy(&value, m_current, sizeof(T));
+	m_current += sizeof(T);
+	return true;
+}
+
+template <typename T>
+bool CacheReader::viewArray(const T*& values, size_t& count)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Only plain data can be cached");
+	static_assert(alignof(T) <= CACHE_ALIGNMENT, "Arrays are only aligned to CACHE_ALIGNMENT");
+
+	uint64_t length = 0;
+	if (!read(length) || !align() || length > (uint64_t)(m_end - m_current) / sizeof(T))
+		return m_good = false;
+
+	values = reinterpret_cast<const T*>(m_current);
+	count = (size_t)length;
+	m_current += count * sizeof(T);
+	return true;
+}
+
+template <typename T>
+bool CacheReader::viewArray(ArrayView<T>& values)
+{
+	const T *data;
+	size_t count;
+
+	if (!viewArray(data, count))
+		return false;
+
+	values = ArrayView<T>{ data, count };
+	return true;
+}
+
+template <typename T>
+bool CacheReader::readArray(std::vector<T>& values)
+{
+	const T *data;
+	size_t count;
+
+	if (!viewArray(data, count))
+		return false;
+
+	// Copied in one pass, without constructing the elements first
+	values.assign(data, data + count);
+	return true;
+}
+
+#pragma endregion
+
+#pragma region Scene Cache
+
+// Bumped whenever the layout of the cache file changes, so old caches are rebuilt rather than misread
+static const uint32_t SCENE_CACHE_VERSION = 3;
+
+// Starting value of the hash used for cache keys
+static const uint64_t SCENE_CACHE_SEED = 14695981039346656037ull;
+
+/* -------------------------------------------------------------------------------------------------
+   Binary cache of a scene's geometry, materials and built acceleration structure, so a scene that
+   is rendered again with only the camera, lights or output changed skips parsing its geometry and
+   building its acceleration structure. The key is a hash of every line of the scene file that
+   affects geometry (see hash), and a cache is only loaded if its key, version and the memory
+   layout of the structures it holds all match, so a stale or foreign cache is simply rebuilt.
+   The file is memory mapped, and the meshes and acceleration structure use its arrays where they
+   lie, so the file has to stay mapped as long as they're in use.
+   Notes:
+	   - Only spheres and triangle meshes, the geometry scene files create, can be cached.
+	   - The arrays are stored in the machine's own byte order and structure layout, so a cache is
+	     only good for the build that wrote it, or one with the same SIMD width.
+   -------------------------------------------------------------------------------------------------
+*/
+class SceneCache
+{
+private:
+	std::string m_fileName;
+	uint64_t m_key;
+
+	static bool writeAccelerator(CacheWriter&, ACCELERATION, const Compound*, const std::vector<Geometry*>&);
+	static Compound* readAccelerator(CacheReader&, ACCELERATION, const std::vector<Geometry*>&, Arena&);
+	static bool validGrid(const Grid&);
+	static bool validHierarchy(const BoundingVolumeHierarchy&);
+
+public:
+	SceneCache(std::string = "", uint64_t = 0);
+
+	static uint64_t hash(uint64_t, std::string_view);
+
+	// Shared with binary scene files
+	static void writeMaterials(CacheWriter&, const MaterialTable&);
+	static bool readMaterials(CacheReader&, MaterialTable&);
+	static bool writeGeometry(CacheWriter&, const Geometry*);
+	static Geometry* readGeometry(CacheReader&, Arena&, bool = false);
+
+	const std::string& fileName() const;
+	bool load(const MappedFile&, ACCELERATION&, MaterialTable&, std::vector<Geometry*>&, Compound*&, Arena&) const;
+	bool save(ACCELERATION, const MaterialTable&, const std::vector<Geometry*>&, const Compound*) const;
+};
+
+#pragma endregion
+
+#endif
@@ -0,0 +1,236 @@
+#include "stdafx.h"
+#include "SceneFile.h"
+
+#include <cstdio>
+
+#pragma region Scene File
+
+static const char SCENE_FILE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+
+enum SCENE_LIGHT { SCENE_DIRECTIONAL, SCENE_POINT };
+
+/* -------------------------------------------------------------------------------------------------
+   Start of every binary scene file. The layout fields hold the sizes of the types stored as raw
+   bytes, so a file from a build that lays them out differently is refused.
+   -------------------------------------------------------------------------------------------------
+*/
+struct SceneFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t layout[4];
+};
+
+static SceneFileHeader sceneFileHeader()
+{
+	SceneFileHeader header{};
+	std::memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC));
+	header.version = SCENE_FILE_VERSION;
+	header.layout[0] = sizeof(Vector<3>);
+	header.layout[1] = sizeof(Matrix<4, 4>);
+	header.layout[2] = sizeof(Color);
+	header.layout[3] = sizeof(BoundingBox);
+
+	return header;
+}
+
+// Checks for the magic number rather than the extension, so renamed files still load
+bool SceneFile::isSceneFile(const std::string& fileName)
+{
+	std::ifstream file{ fileName, std::ifstream::in | std::ifstream::binary };
+	char magic[sizeof(SCENE_FILE_MAGIC)] = {};
+
+	return file.read(magic, sizeof(magic)) && std::memcmp(magic, SCENE_FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Writes a parsed scene, before it's generated, as a binary scene file. Returns false, removing the
+   file, if the scene holds lights or geometry the format can't store.
+   -------------------------------------------------------------------------------------------------
+*/
+bool SceneFile::save(Scene& scene, const std::string& fileName)
+{
+	bool written = true;
+
+	{
+		CacheWriter writer{ fileName };
+		writer.write(sceneFileHeader());
+
+		// Image, camera and lights
+		writer.write((int32_t)scene.m_film.width());
+		writer.write((int32_t)scene.m_film.height());
+		writer.write((int32_t)scene.m_maxDepth);
+		writer.write((int32_t)scene.m_threads);
+		writer.writeString(scene.m_film.outputFilename());
+		writer.write((uint32_t)scene.m_hasView);
+		writer.write(scene.m_view);
+
+		writer.write((uint32_t)scene.m_lights.size());
+		for (auto light = scene.m_lights.begin(); light != scene.m_lights.end() && written; ++light)
+		{
+			if (auto directional = dynamic_cast<const Directional*>(*light))
+			{
+				writer.write((uint32_t)SCENE_DIRECTIONAL);
+				writer.write(directional->m_ls);
+				writer.write(directional->m_color);
+				writer.write(directional->m_dir);
+			}
+			else if (auto point = dynamic_cast<const Point*>(*light))
+			{
+				writer.write((uint32_t)SCENE_POINT);
+				writer.write(point->m_ls);
+				writer.write(point->m_color);
+				writer.write(point->m_position);
+				writer.write(point->m_attenuation);
+			}
+			else
+				written = false;
+		}
+
+		// Acceleration settings, materials and geometry, which run to the end of the file
+		writer.write((int32_t)scene.m_acceleration);
+		writer.write(scene.m_gridMultiplier);
+		writer.write((int32_t)scene.m_gridDensity);
+		SceneCache::writeMaterials(writer, scene.m_materials);
+
+		writer.write((uint32_t)scene.m_objects.size());
+		for (auto geo = scene.m_objects.begin(); geo != scene.m_objects.end() && written; ++geo)
+			written = SceneCache::writeGeometry(writer, *geo);
+
+		written = written && writer.good();
+	}
+
+	if (!written)
+		std::remove(fileName.c_str());
+
+	return written;
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Loads a binary scene file into a newly created scene, which keeps the file mapped for its
+   meshes. With cache set, the geometry and acceleration structure come from the scene's cache when
+   it matches. Returns false if the file is missing, from another build or damaged.
+   -------------------------------------------------------------------------------------------------
+*/
+bool SceneFile::load(const std::string& fileName, Scene& scene, bool cache)
+{
+	Timer timer;
+
+	delete scene.m_sceneFile;
+	scene.m_sceneFile = new MappedFile{ fileName };
+
+	const MappedFile& file = *scene.m_sceneFile;
+	CacheReader reader{ file.data(), file.size() };
+	SceneFileHeader header, expected = sceneFileHeader();
+
+	if (!reader.read(header) || std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+		header.version != expected.version || std::memcmp(header.layout, expected.layout, sizeof(header.layout)) != 0)
+		return false;
+
+	// Image, camera and lights
+	int32_t width = 0, height = 0, maxDepth = 0, threads = 0;
+	std::string output;
+	uint32_t hasView = 0, numLights = 0;
+	CameraView view{};
+
+	reader.read(width);
+	reader.read(height);
+	reader.read(maxDepth);
+	reader.read(threads);
+	reader.readString(output);
+	reader.read(hasView);
+	reader.read(view);
+
+	if (!reader.good() || width <= 0 || height <= 0)
+		return false;
+
+	scene.setScreenDimensions(width, height);
+	scene.setOutputFilename(output);
+	scene.setMaxDepth(maxDepth);
+	scene.setThreadCount(threads);
+	if (hasView)
+		scene.buildMVP(view.eye, view.center, view.up, view.fov);
+
+	reader.read(numLights);
+	for (uint32_t l = 0; l < numLights && reader.good(); ++l)
+	{
+		uint32_t type = 0;
+		float ls = 0;
+		Color color;
+		Vector<3> v, attenuation;
+
+		reader.read(type);
+		reader.read(ls);
+		reader.read(color);
+		reader.read(v);
+
+		if (type == SCENE_DIRECTIONAL)
+			scene.addLight(scene.create<Directional>(ls, color, v));
+		else if (type == SCENE_POINT && reader.read(attenuation))
+			scene.addLight(scene.create<Point>(ls, color, v, attenuation));
+		else
+			return false;
+	}
+
+	if (!reader.good())
+		return false;
+
+	// The rest of the file decides the scene's geometry, so it's what the cache is keyed on
+	const char *geometry = reader.position();
+	if (cache)
+	{
+		uint64_t key = SceneCache::hash(SCENE_CACHE_SEED, std::string_view{ geometry, (size_t)(file.data() + file.size() - geometry) });
+		SceneCache sceneCache{ fileName + ".cache", key };
+
+		if (scene.loadCache(sceneCache))
+		{
+			std::cout << "Loaded " << scene.numGeometries() << " objects from cache " << sceneCache.fileName() << std::endl;
+			scene.statistics().setSceneFile(fileName);
+			scene.statistics().setParseTime(timer.elapsed());
+			return true;
+		}
+	}
+
+	int32_t acceleration = 0, gridDensity = 0;
+	float gridMultiplier = 0;
+	reader.read(acceleration);
+	reader.read(gridMultiplier);
+	reader.read(gridDensity);
+
+	if (!reader.good() || acceleration < NONE || acceleration > LBVH || !(gridMultiplier > 0) || gridDensity < 0 ||
+		!SceneCache::readMaterials(reader, scene.m_materials))
+		return false;
+
+	scene.setAcceleration((ACCELERATION)acceleration);
+	scene.setGridMultiplier(gridMultiplier);
+	scene.setGridDensity(gridDensity);
+
+	// Every geometry takes more than 32 bytes, which caps what a bad count can reserve
+	uint32_t numGeometries = 0;
+	reader.read(numGeometries);
+	scene.reserveGeometry((int)std::min((size_t)numGeometries, file.size() / 32));
+
+	for (uint32_t g = 0; g < numGeometries && reader.good(); ++g)
+	{
+		Geometry *geo = SceneCache::readGeometry(reader, scene.m_arena, true);
+		if (!geo)
+			return false;
+
+		scene.addGeometry(geo);
+		if (geo->getMaterialId() >= (unsigned)scene.m_materials.size())
+			return false;
+	}
+
+	if (!reader.good())
+		return false;
+
+	double loadDuration = timer.elapsed();
+	scene.statistics().setSceneFile(fileName);
+	scene.statistics().setParseTime(loadDuration);
+
+	std::cout << "Loaded " << numGeometries << " objects from " << fileName << " in " << loadDuration << " seconds" << std::endl;
+
+	return true;
+}
+
+#pragma endregion
@@ -0,0 +1,59 @@
+/* -------------------------------------------------------------------------------------------------
+   Copyright 2017 Shealyn Tate Hindenlang
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge, publish, distribute,
+   sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   -------------------------------------------------------------------------------------------------
+*/
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include "Scene.h"
+
+#include <string>
+
+#pragma region Scene File
+
+// Bumped whenever the layout of binary scene files changes
+static const uint32_t SCENE_FILE_VERSION = 2;
+
+// Extension the converter gives binary scene files
+static const char SCENE_FILE_EXTENSION[] = ".rtscene";
+
+/* -------------------------------------------------------------------------------------------------
+   Binary scene files hold everything a parsed scene file describes, stored the way the tracer uses
+   it: the image settings, camera and lights, followed by the acceleration settings, materials and
+   geometry. Transforms are already applied to the geometry and lights, so they aren't stored.
+   Loading maps the file and the meshes use its vertex and index arrays in place, so nothing is
+   parsed and large scenes load as fast as the file can be read.
+   Notes:
+	   - Like scene caches, the arrays are stored in the machine's own byte order and layout, so a
+	     binary scene file is converted for the machines it's rendered on.
+	   - The geometry comes last, and with --cache the cache key is a hash of that part of the file,
+	     so editing the camera or lights keeps a scene's cache.
+   -------------------------------------------------------------------------------------------------
+*/
+class SceneFile
+{
+public:
+	static bool isSceneFile(const std::string&);
+	static bool save(Scene&, const std::string&);
+	static bool load(const std::string&, Scene&, bool = false);
+};
+
+#pragma endregion
+
+#endif
@@ -0,0 +1,198 @@
+/* -------------------------------------------------------------------------------------------------
+   Copyright 2017 Shealyn Tate Hindenlang
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge, publish, distribute,
+   sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   -------------------------------------------------------------------------------------------------
+*/
+#ifndef SLABTEST_H
+#define SLABTEST_H
+
+#include "Utilities.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SLAB_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SLAB_SSE
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#pragma region Precomputed Ray
+
+/* -------------------------------------------------------------------------------------------------
+   A ray with everything the slab test needs computed once up front: the inverse of its direction
+   and, per axis, whether the direction is negative. With the sign known, the near and far planes
+   of a box are picked directly instead of being sorted for every box the ray is tested against.
+   -------------------------------------------------------------------------------------------------
+*/
+struct PrecomputedRay
+{
+	Vector<3> origin, invDirection;
+	int sign[3];
+
+	PrecomputedRay(const Ray&);
+};
+
+inline PrecomputedRay::PrecomputedRay(const Ray& ray)
+	: origin{ ray.origin }
+{
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		invDirection[axis] = 1.0f / ray.direction[axis];
+		sign[axis] = (invDirection[axis] < 0.0f) ? 1 : 0;
+	}
+}
+
+#pragma endregion
+
+#pragma region Box Group
+
+/* -------------------------------------------------------------------------------------------------
+   BOX_GROUP_SIZE boxes stored as structure of arrays, bounds[0] holding the minimum and bounds[1]
+   the maximum corners, one array of lanes per axis. hitBoxGroup tests a ray against every box in a
+   group at once: eight boxes per AVX instruction, four with SSE, or a plain loop elsewhere.
+   Unused lanes are left empty (min above max) so they never report a hit.
+   -------------------------------------------------------------------------------------------------
+*/
+#ifdef SLAB_AVX
+static const int BOX_GROUP_SIZE = 8;
+#else
+static const int BOX_GROUP_SIZE = 4;
+#endif
+
+struct alignas(32) BoxGroup
+{
+	float bounds[2][3][BOX_GROUP_SIZE];
+
+	BoxGroup();
+	void setBox(int, const Vector<3>&, const Vector<3>&);
+};
+
+inline BoxGroup::BoxGroup()
+{
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		for (int lane = 0; lane < BOX_GROUP_SIZE; ++lane)
+		{
+			bounds[0][axis][lane] = MAX_T;
+			bounds[1][axis][lane] = -MAX_T;
+		}
+	}
+}
+
+inline void BoxGroup::setBox(int lane, const Vector<3>& min, const Vector<3>& max)
+{
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		bounds[0][axis][lane] = min[axis];
+		bounds[1][axis][lane] = max[axis];
+	}
+}
+
+/* -------------------------------------------------------------------------------------------------
+   Slab test of one ray against a whole group. Returns a mask with bit i set if the ray enters box i
+   between MIN_T and tMax. If tNear isn't NULL it receives every lane's entry distance.
+   Min and max take the running interval as their second operand, so the NaN produced when the ray
+   starts on a slab plane it runs parallel to leaves the interval unchanged.
+   -------------------------------------------------------------------------------------------------
+*/
+inline unsigned hitBoxGroup(const BoxGroup& group, const PrecomputedRay& ray, float tMax, float *tNear = NULL)
+{
+#if defined(SLAB_AVX)
+	__m256 t0 = _mm256_set1_ps(MIN_T);
+	__m256 t1 = _mm256_set1_ps(tMax);
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		__m256 origin = _mm256_set1_ps(ray.origin[axis]);
+		__m256 inv = _mm256_set1_ps(ray.invDirection[axis]);
+		__m256 tA = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(group.bounds[ray.sign[axis]][axis]), origin), inv);
+		__m256 tB = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(group.bounds[1 - ray.sign[axis]][axis]), origin), inv);
+
+		t0 = _mm256_max_ps(tA, t0);
+		t1 = _mm256_min_ps(tB, t1);
+	}
+
+	if (tNear)
+		_mm256_storeu_ps(tNear, t0);
+
+	return (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#elif defined(SLAB_SSE)
+	__m128 t0 = _mm_set1_ps(MIN_T);
+	__m128 t1 = _mm_set1_ps(tMax);
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		__m128 origin = _mm_set1_ps(ray.origin[axis]);
+		__m128 inv = _mm_set1_ps(ray.invDirection[axis]);
+		__m128 tA = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(group.bounds[ray.sign[axis]][axis]), origin), inv);
+		__m128 tB = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(group.bounds[1 - ray.sign[axis]][axis]), origin), inv);
+
+		t0 = _mm_max_ps(tA, t0);
+		t1 = _mm_min_ps(tB, t1);
+	}
+
+	if (tNear)
+		_mm_storeu_ps(tNear, t0);
+
+	return (unsigned)_mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+	unsigned mask = 0;
+
+	for (int lane = 0; lane < BOX_GROUP_SIZE; ++lane)
+	{
+		float t0 = MIN_T;
+		float t1 = tMax;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float tA = (group.bounds[ray.sign[axis]][axis][lane] - ray.origin[axis]) * ray.invDirection[axis];
+			float tB = (group.bounds[1 - ray.sign[axis]][axis][lane] - ray.origin[axis]) * ray.invDirection[axis];
+
+			t0 = (tA > t0) ? tA : t0;
+			t1 = (tB < t1) ? tB : t1;
+		}
+
+		if (tNear)
+			tNear[lane] = t0;
+		if (t0 <= t1)
+			mask |= 1u << lane;
+	}
+
+	return mask;
+#endif
+}
+
+// Index of the lowest set bit of a non-zero mask
+inline int lowestLane(unsigned mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+#pragma endregion
+
+#endif
@@ -0,0 +1,277 @@
+#include "stdafx.h"
+#include "Statistics.h"
+
+#include <atomic>
+#include <fstream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+#pragma region Ray Counters
+
+thread_local RayCounters threadCounters;
+
+RayCounters::RayCounters()
+	: primaryRays{ 0 }, shadowRays{ 0 }, reflectionRays{ 0 }, intersectionTests{ 0 }, gridCellsVisited{ 0 }
+{
+
+}
+
+void RayCounters::operator +=(const RayCounters& c)
+{
+	primaryRays += c.primaryRays;
+	shadowRays += c.shadowRays;
+	reflectionRays += c.reflectionRays;
+	intersectionTests += c.intersectionTests;
+	gridCellsVisited += c.gridCellsVisited;
+}
+
+uint64_t RayCounters::totalRays() const
+{
+	return primaryRays + shadowRays + reflectionRays;
+}
+
+#pragma endregion
+
+#pragma region Timer
+
+Timer::Timer()
+	: m_start{ std::chrono::steady_clock::now() }
+{
+
+}
+
+void Timer::reset()
+{
+	m_start = std::chrono::steady_clock::now();
+}
+
+double Timer::elapsed() const
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+uint64_t peakResidentMemory()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+
+	// macOS reports bytes, everything else kilobytes
+#ifdef __APPLE__
+	return (uint64_t)usage.ru_maxrss;
+#else
+	return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+#pragma endregion
+
+#pragma region Allocation Counting
+
+static std::atomic<uint64_t> allocations{ 0 };
+static std::atomic<uint64_t> allocated{ 0 };
+static std::atomic<uint64_t> peakAllocated{ 0 };
+
+void countAllocation(uint64_t bytes)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t inUse = allocated.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	uint64_t peak = peakAllocated.load(std::memory_order_relaxed);
+	while (inUse > peak && !peakAllocated.compare_exchange_weak(peak, inUse, std::memory_order_relaxed))
+		;
+}
+
+void countFree(uint64_t bytes)
+{
+	allocated.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+uint64_t allocationCount()
+{
+	return allocations.load(std::memory_order_relaxed);
+}
+
+uint64_t allocatedBytes()
+{
+	return allocated.load(std::memory_order_relaxed);
+}
+
+uint64_t peakAllocatedBytes()
+{
+	return peakAllocated.load(std::memory_order_relaxed);
+}
+
+void resetAllocationPeak()
+{
+	peakAllocated.store(allocated.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+#pragma endregion
+
+#pragma region Statistics
+
+// Quote a string for JSON, escaping the characters that can appear in file paths
+static std::string jsonString(const std::string& s)
+{
+	std::string result{ "\"" };
+
+	for (auto c = s.begin(); c != s.end(); ++c)
+	{
+		if (*c == '"' || *c == '\\')
+			result += '\\';
+		if ((unsigned char)*c >= 0x20)
+			result += *c;
+	}
+
+	return result + "\"";
+}
+
+Statistics::Statistics()
+	: m_sceneFile{}, m_outputFile{}, m_acceleration{},
+	  m_width{ 0 }, m_height{ 0 }, m_threads{ 0 }, m_primitives{ 0 }, m_lights{ 0 },
+	  m_parseTime{ 0 }, m_buildTime{ 0 }, m_renderTime{ 0 }, m_encodeTime{ 0 },
+	  m_peakMemory{ 0 }, m_loadAllocations{ 0 }, m_loadMemory{ 0 }, m_counters{}
+{
+
+}
+
+void Statistics::setSceneFile(std::string file)
+{
+	m_sceneFile = file;
+}
+
+void Statistics::setOutputFile(std::string file)
+{
+	m_outputFile = file;
+}
+
+void Statistics::setConfiguration(std::string acceleration, int width, int height, int threads, int primitives, int lights)
+{
+	m_acceleration = acceleration;
+	m_width = width;
+	m_height = height;
+	m_threads = threads;
+	m_primitives = primitives;
+	m_lights = lights;
+}
+
+void Statistics::setParseTime(double t)
+{
+	m_parseTime = t;
+}
+
+void Statistics::setBuildTime(double t)
+{
+	m_buildTime = t;
+}
+
+void Statistics::setRenderTime(double t)
+{
+	m_renderTime = t;
+}
+
+void Statistics::setEncodeTime(double t)
+{
+	m_encodeTime = t;
+}
+
+void Statistics::setPeakMemory(uint64_t bytes)
+{
+	m_peakMemory = bytes;
+}
+
+void Statistics::setLoadMemory(uint64_t allocations, uint64_t bytes)
+{
+	m_loadAllocations = allocations;
+	m_loadMemory = bytes;
+}
+
+void Statistics::addCounters(const RayCounters& c)
+{
+	m_counters += c;
+}
+
+double Statistics::totalTime() const
+{
+	return m_parseTime + m_buildTime + m_renderTime + m_encodeTime;
+}
+
+double Statistics::raysPerSecond() const
+{
+	return (m_renderTime > 0) ? m_counters.totalRays() / m_renderTime : 0;
+}
+
+void Statistics::print(std::ostream& out) const
+{
+	out << "Parse " << m_parseTime << " s, build " << m_buildTime << " s, render " << m_renderTime
+		<< " s, encode " << m_encodeTime << " s\n";
+	out << m_loadAllocations << " allocations loading the scene, " << (m_loadMemory / (1024.0 * 1024.0))
+		<< " MB allocated at most while loading\n";
+	out << m_counters.totalRays() << " rays (" << m_counters.primaryRays << " primary, "
+		<< m_counters.shadowRays << " shadow, " << m_counters.reflectionRays << " reflection), "
+		<< (long long)(raysPerSecond()) << " rays/s\n";
+	out << m_counters.intersectionTests << " intersection tests, "
+		<< m_counters.gridCellsVisited << " grid cells visited, "
+		<< (m_peakMemory / (1024.0 * 1024.0)) << " MB process peak memory" << std::endl;
+}
+
+bool Statistics::writeReport(const std::string& fileName) const
+{
+	std::ofstream file(fileName, std::ofstream::out | std::ofstream::trunc);
+
+	if (!file)
+		return false;
+
+	file.precision(9);
+	file << "{\n";
+	file << "  \"scene\": " << jsonString(m_sceneFile) << ",\n";
+	file << "  \"output\": " << jsonString(m_outputFile) << ",\n";
+	file << "  \"acceleration\": " << jsonString(m_acceleration) << ",\n";
+	file << "  \"width\": " << m_width << ",\n";
+	file << "  \"height\": " << m_height << ",\n";
+	file << "  \"threads\": " << m_threads << ",\n";
+	file << "  \"primitives\": " << m_primitives << ",\n";
+	file << "  \"lights\": " << m_lights << ",\n";
+	file << "  \"timings\": {\n";
+	file << "    \"parse\": " << m_parseTime << ",\n";
+	file << "    \"build\": " << m_buildTime << ",\n";
+	file << "    \"render\": " << m_renderTime << ",\n";
+	file << "    \"encode\": " << m_encodeTime << ",\n";
+	file << "    \"total\": " << totalTime() << "\n";
+	file << "  },\n";
+	file << "  \"rays\": {\n";
+	file << "    \"primary\": " << m_counters.primaryRays << ",\n";
+	file << "    \"shadow\": " << m_counters.shadowRays << ",\n";
+	file << "    \"reflection\": " << m_counters.reflectionRays << ",\n";
+	file << "    \"total\": " << m_counters.totalRays() << "\n";
+	file << "  },\n";
+	file << "  \"intersectionTests\": " << m_counters.intersectionTests << ",\n";
+	file << "  \"gridCellsVisited\": " << m_counters.gridCellsVisited << ",\n";
+	file << "  \"raysPerSecond\": " << raysPerSecond() << ",\n";
+	file << "  \"loadAllocations\": " << m_loadAllocations << ",\n";
+	file << "  \"loadPeakMemory\": " << m_loadMemory << ",\n";
+	file << "  \"peakMemory\": " << m_peakMemory << "\n";
+	file << "}\n";
+
+	return file.good();
+}
+
+#pragma endregion
@@ -0,0 +1,135 @@
+/* -------------------------------------------------------------------------------------------------
+   Copyright 2017 Shealyn Tate Hindenlang
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge, publish, distribute,
+   sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   -------------------------------------------------------------------------------------------------
+*/
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#pragma region Ray Counters
+
+/* -------------------------------------------------------------------------------------------------
+   Counts the work done while rendering: rays cast by type, ray-primitive intersection tests and
+   grid cells stepped through. Every thread increments its own copy, threadCounters, without any
+   locking, and the scene adds the copies together once the render threads have finished.
+   -------------------------------------------------------------------------------------------------
+*/
+struct RayCounters
+{
+	uint64_t primaryRays;
+	uint64_t shadowRays;
+	uint64_t reflectionRays;
+	uint64_t intersectionTests;
+	uint64_t gridCellsVisited;
+
+	RayCounters();
+	void operator +=(const RayCounters&);
+	uint64_t totalRays() const;
+};
+
+extern thread_local RayCounters threadCounters;
+
+#pragma endregion
+
+#pragma region Timer
+
+/* -------------------------------------------------------------------------------------------------
+   Wall clock stopwatch. Unlike clock(), which sums CPU time over every thread, it measures the time
+   that actually passed, so it stays meaningful when rendering runs in parallel.
+   -------------------------------------------------------------------------------------------------
+*/
+class Timer
+{
+private:
+	std::chrono::steady_clock::time_point m_start;
+
+public:
+	Timer();
+
+	void reset();
+	double elapsed() const;
+};
+
+// Largest resident set size of the process so far in bytes, 0 if the platform can't report it
+uint64_t peakResidentMemory();
+
+// Count an allocation or free of the given size, called by the operator new and delete the
+// Ray_Tracer program replaces. Programs that don't replace them count nothing.
+void countAllocation(uint64_t);
+void countFree(uint64_t);
+
+// Number of allocations counted so far across every thread
+uint64_t allocationCount();
+
+// Bytes allocated and not yet freed, and the most there have been since the peak was last reset
+uint64_t allocatedBytes();
+uint64_t peakAllocatedBytes();
+void resetAllocationPeak();
+
+#pragma endregion
+
+#pragma region Statistics
+
+/* -------------------------------------------------------------------------------------------------
+   Statistics collects the wall clock time of each stage of a render (parsing the scene file,
+   building the acceleration structure, tracing and encoding the image) along with the ray counters
+   and the settings the scene was rendered with. It prints a short summary and writes the same
+   data as a JSON report, so rays per second can be compared across builds and machines.
+   Peak memory is the process's high water mark, so it only describes a single scene when that
+   scene is the only one rendered by the process. Loading is described on its own: the number of
+   allocations it took and the most bytes it had allocated at once, on top of what was already in
+   use, so scenes rendered one after another in a batch can be compared.
+   -------------------------------------------------------------------------------------------------
+*/
+class Statistics
+{
+private:
+	std::string m_sceneFile, m_outputFile, m_acceleration;
+	int m_width, m_height, m_threads, m_primitives, m_lights;
+	double m_parseTime, m_buildTime, m_renderTime, m_encodeTime;
+	uint64_t m_peakMemory, m_loadAllocations, m_loadMemory;
+	RayCounters m_counters;
+
+public:
+	Statistics();
+
+	void setSceneFile(std::string);
+	void setOutputFile(std::string);
+	void setConfiguration(std::string, int, int, int, int, int);
+	void setParseTime(double);
+	void setBuildTime(double);
+	void setRenderTime(double);
+	void setEncodeTime(double);
+	void setPeakMemory(uint64_t);
+	void setLoadMemory(uint64_t, uint64_t);
+	void addCounters(const RayCounters&);
+
+	double totalTime() const;
+	double raysPerSecond() const;
+	void print(std::ostream&) const;
+	bool writeReport(const std::string&) const;
+};
+
+#pragma endregion
+
+#endif
@@ -1,6 +1,288 @@
 #include "stdafx.h"
 #include "Utilities.h"
 
+#include <cctype>
+#include <charconv>
+#include <unordered_map>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#pragma region Scene File Commands
+
+COMMAND commandType(std::string_view word)
+{
+	static const std::unordered_map<std::string_view, COMMAND> commands
+	{
+		{ "camera", CMD_CAMERA }, { "size", CMD_SIZE }, { "maxdepth", CMD_MAXDEPTH },
+		{ "output", CMD_OUTPUT }, { "threads", CMD_THREADS }, { "acceleration", CMD_ACCELERATION },
+		{ "gridmultiplier", CMD_GRIDMULTIPLIER }, { "griddensity", CMD_GRIDDENSITY },
+		{ "sphere", CMD_SPHERE }, { "maxverts", CMD_MAXVERTS }, { "maxvertnorms", CMD_MAXVERTNORMS },
+		{ "vertex", CMD_VERTEX }, { "vertexnormal", CMD_VERTEXNORMAL }, { "tri", CMD_TRI },
+		{ "watertight", CMD_WATERTIGHT },
+		{ "ambient", CMD_AMBIENT }, { "diffuse", CMD_DIFFUSE }, { "specular", CMD_SPECULAR },
+		{ "emission", CMD_EMISSION }, { "shininess", CMD_SHININESS },
+		{ "directional", CMD_DIRECTIONAL }, { "point", CMD_POINT }, { "attenuation", CMD_ATTENUATION },
+		{ "translate", CMD_TRANSLATE }, { "rotate", CMD_ROTATE }, { "scale", CMD_SCALE },
+		{ "pushTransform", CMD_PUSH }, { "popTransform", CMD_POP }
+	};
+
+	auto command = commands.find(word);
+	return (command == commands.end()) ? CMD_UNKNOWN : command->second;
+}
+
+#pragma endregion
+
+#pragma region Tokenizer
+
+Tokenizer::Tokenizer(const char *begin, const char *end)
+	: m_current{ begin }, m_end{ end }
+{
+
+}
+
+bool Tokenizer::next(std::string_view& token)
+{
+	while (m_current != m_end && isspace((unsigned char)*m_current))
+		++m_current;
+
+	if (m_current == m_end)
+		return false;
+
+	const char *start = m_current;
+	while (m_current != m_end && !isspace((unsigned char)*m_current))
+		++m_current;
+
+	token = std::string_view{ start, (size_t)(m_current - start) };
+	return true;
+}
+
+bool Tokenizer::nextFloat(float& value)
+{
+	std::string_view token;
+	if (!next(token))
+		return false;
+
+	const char *first = token.data();
+	const char *last = first + token.size();
+	if (first != last && *first == '+')
+		++first;
+
+	auto result = std::from_chars(first, last, value);
+	return result.ec == std::errc{} && result.ptr == last;
+}
+
+bool Tokenizer::nextInt(int& value)
+{
+	std::string_view token;
+	if (!next(token))
+		return false;
+
+	const char *first = token.data();
+	const char *last = first + token.size();
+	if (first != last && *first == '+')
+		++first;
+
+	auto result = std::from_chars(first, last, value);
+	return result.ec == std::errc{} && result.ptr == last;
+}
+
+bool Tokenizer::nextFloats(float *values, int count)
+{
+	for (int i = 0; i < count; ++i)
+		if (!nextFloat(values[i]))
+			return false;
+
+	return true;
+}
+
+#pragma endregion
+
+#pragma region Arena
+
+Arena::Arena()
+	: m_blocks{}, m_destructors{}, m_current{ NULL }, m_end{ NULL }, m_bytes{ 0 }
+{
+
+}
+
+Arena::Arena(Arena&& arena)
+	: m_blocks{ std::move(arena.m_blocks) }, m_destructors{ std::move(arena.m_destructors) },
+	  m_current{ arena.m_current }, m_end{ arena.m_end }, m_bytes{ arena.m_bytes }
+{
+	arena.m_blocks.clear();
+	arena.m_destructors.clear();
+	arena.m_current = arena.m_end = NULL;
+	arena.m_bytes = 0;
+}
+
+Arena& Arena::operator =(Arena&& arena)
+{
+	if (this != &arena)
+	{
+		clear();
+		std::swap(m_blocks, arena.m_blocks);
+		std::swap(m_destructors, arena.m_destructors);
+		std::swap(m_current, arena.m_current);
+		std::swap(m_end, arena.m_end);
+		std::swap(m_bytes, arena.m_bytes);
+	}
+
+	return *this;
+}
+
+Arena::~Arena()
+{
+	clear();
+}
+
+void* Arena::allocate(size_t size, size_t alignment)
+{
+	size_t padding = m_current ? (alignment - (size_t)m_current % alignment) % alignment : 0;
+
+	if (!m_current || size + padding > (size_t)(m_end - m_current))
+	{
+		// Blocks come from new, so only alignments beyond its own need room to be made up
+		size_t blockSize = std::max(ARENA_BLOCK_SIZE, size + alignment);
+		if (m_blocks.size() == m_blocks.capacity())
+			m_blocks.reserve(std::max<size_t>(2 * m_blocks.capacity(), 16));
+		m_blocks.push_back(static_cast<char*>(::operator new(blockSize)));
+		m_current = m_blocks.back();
+		m_end = m_current + blockSize;
+		padding = (alignment - (size_t)m_current % alignment) % alignment;
+	}
+
+	void *memory = m_current + padding;
+	m_current += padding + size;
+	m_bytes += size;
+	return memory;
+}
+
+// Takes over every object of another arena, which is left empty
+void Arena::append(Arena& arena)
+{
+	if (this == &arena)
+		return;
+
+	m_blocks.insert(m_blocks.end(), arena.m_blocks.begin(), arena.m_blocks.end());
+	m_destructors.insert(m_destructors.end(), arena.m_destructors.begin(), arena.m_destructors.end());
+	m_bytes += arena.m_bytes;
+
+	arena.m_blocks.clear();
+	arena.m_destructors.clear();
+	arena.m_current = arena.m_end = NULL;
+	arena.m_bytes = 0;
+}
+
+void Arena::clear()
+{
+	for (auto destructor = m_destructors.rbegin(); destructor != m_destructors.rend(); ++destructor)
+		destructor->destroy(destructor->object);
+
+	for (auto block = m_blocks.begin(); block != m_blocks.end(); ++block)
+		::operator delete(*block);
+
+	m_blocks.clear();
+	m_destructors.clear();
+	m_current = m_end = NULL;
+	m_bytes = 0;
+}
+
+// Bytes taken by the objects created so far
+size_t Arena::bytes() const
+{
+	return m_bytes;
+}
+
+#pragma endregion
+
+#pragma region Mapped File
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& fileName)
+	: m_data{ NULL }, m_size{ 0 }, m_file{ INVALID_HANDLE_VALUE }, m_mapping{ NULL }
+{
+	m_file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+		return;
+
+	m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!m_mapping)
+		return;
+
+	m_data = (const char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (m_data)
+		m_size = (size_t)size.QuadPart;
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& fileName)
+	: m_data{ NULL }, m_size{ 0 }
+{
+	int file = open(fileName.c_str(), O_RDONLY);
+	if (file < 0)
+		return;
+
+	// The mapping keeps the file open on its own
+	struct stat info;
+	if (fstat(file, &info) == 0 && info.st_size > 0)
+	{
+		void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (data != MAP_FAILED)
+		{
+			m_data = (const char*)data;
+			m_size = (size_t)info.st_size;
+		}
+	}
+
+	close(file);
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_data)
+		munmap((void*)m_data, m_size);
+}
+
+#endif
+
+const char* MappedFile::data() const
+{
+	return m_data;
+}
+
+size_t MappedFile::size() const
+{
+	return m_size;
+}
+
+#pragma endregion
+
 #pragma region Color Data
 
 Color::Color(float r, float g, float b)
@@ -32,6 +314,16 @@ Color Color::operator /(float s) const
 		return Color(r / s, g / s, b / s);
 }
 
+bool Color::operator ==(const Color& c) const
+{
+	return r == c.r && g == c.g && b == c.b;
+}
+
+bool Color::operator !=(const Color& c) const
+{
+	return !(*this == c);
+}
+
 void Color::operator +=(Color c)
 {
 	r += c.r;
@@ -20,8 +20,15 @@
 #ifndef UTILITIES_H
 #define UTILITIES_H
 
-#include <GraphicsMathLib\Matrix.h>
-#include <regex>
+#include <GraphicsMathLib/Matrix.h>
+#include <algorithm>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 using namespace GraphicsMath;
 
@@ -29,14 +36,16 @@ using namespace GraphicsMath;
 
 static const float MIN_T = 0.001f;
 static const float MAX_T = 999999999.0f;
-static const float M_PI = 3.141592f;
+static const float PI = 3.141592f;
 
 static const int SCREEN_WIDTH = 256;
 static const int SCREEN_HEIGHT = 256;
+static const int TILE_SIZE = 16;
 
 
 enum PROJECTION { ORTHO, PERSPECTIVE };
 enum SPECULAR { BLINN, PHONG };
+enum ACCELERATION { NONE, GRID, BVH, LBVH };
 
 static const SPECULAR SPECULAR_MODEL = BLINN;
 
@@ -44,41 +53,255 @@ class ShaderData;
 
 #pragma endregion
 
-#pragma region Regex Patterns
+#pragma region Parallel Loops
 
-//	Regex patterns for parsing input files to construct scene
-static const std::string start = "\\s*";
-static const std::string num = "\\s+([\\+-]?\\d+\\.\\d*|[\\+-]?\\.\\d+|[\\+-]?\\d+)";
-static const std::string end = "\\s*";
+// Fewest items worth handing to a thread of their own
+static const int PARALLEL_GRAIN = 4096;
 
-static const std::regex camera(start + "camera" + num + num + num + num + num + num + num + num + num + num + end);
-static const std::regex size(start + "size" + num + num + end);
-static const std::regex depth(start + "maxdepth" + num + end);
+/* -------------------------------------------------------------------------------------------------
+   Splits the items 0 up to count into one contiguous block per thread and calls body(begin, end)
+   for each block, the calling thread taking the first. Every thread gets at least grain items, so
+   small loops run on the calling thread alone.
+   -------------------------------------------------------------------------------------------------
+*/
+template <typename Body>
+void parallelFor(int count, int threads, const Body& body, int grain = PARALLEL_GRAIN)
+{
+	threads = std::max(1, std::min(threads, count / grain));
+	std::vector<std::thread> workers;
+
+	for (int i = 1; i < threads; ++i)
+		workers.push_back(std::thread{ body, (int)((long long)count * i / threads), (int)((long long)count * (i + 1) / threads) });
+
+	body(0, (int)((long long)count / threads));
+
+	for (auto worker = workers.begin(); worker != workers.end(); ++worker)
+		worker->join();
+}
+
+#pragma endregion
+
+#pragma region Scene File Commands
+
+//	Commands understood in scene input files
+enum COMMAND
+{
+	CMD_UNKNOWN,
+	CMD_CAMERA, CMD_SIZE, CMD_MAXDEPTH, CMD_OUTPUT, CMD_THREADS, CMD_ACCELERATION,
+	CMD_GRIDMULTIPLIER, CMD_GRIDDENSITY,
+	CMD_SPHERE, CMD_MAXVERTS, CMD_MAXVERTNORMS, CMD_VERTEX, CMD_VERTEXNORMAL, CMD_TRI, CMD_WATERTIGHT,
+	CMD_AMBIENT, CMD_DIFFUSE, CMD_SPECULAR, CMD_EMISSION, CMD_SHININESS,
+	CMD_DIRECTIONAL, CMD_POINT, CMD_ATTENUATION,
+	CMD_TRANSLATE, CMD_ROTATE, CMD_SCALE, CMD_PUSH, CMD_POP
+};
+
+COMMAND commandType(std::string_view);
+
+#pragma endregion
+
+#pragma region Tokenizer
+
+/* -------------------------------------------------------------------------------------------------
+   Splits one line of a scene file into whitespace separated tokens without copying it. Numbers are
+   converted in place with std::from_chars and must make up the whole token, so every line is read
+   exactly once. An optional leading '+' is accepted, which from_chars doesn't allow on its own.
+   -------------------------------------------------------------------------------------------------
+*/
+class Tokenizer
+{
+private:
+	const char *m_current, *m_end;
+
+public:
+	Tokenizer(const char*, const char*);
 
-static const std::regex output(start + "output" + "\\s+([A-Za-z0-9_-]+\\.png)" + end);
+	bool next(std::string_view&);
+	bool nextFloat(float&);
+	bool nextInt(int&);
+	bool nextFloats(float*, int);
+};
+
+#pragma endregion
+
+#pragma region Arena
+
+// Size of the blocks an arena allocates from, larger objects get a block of their own
+static const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+/* -------------------------------------------------------------------------------------------------
+   Bump allocator that creates objects one after another in large blocks, so objects created
+   together sit together in memory, and destroys them all at once. Objects can't be freed one at a
+   time; they're destroyed, in the reverse of the order they were created, when the arena is
+   cleared or destroyed.
+   -------------------------------------------------------------------------------------------------
+*/
+class Arena
+{
+private:
+	struct Destructor
+	{
+		void *object;
+		void (*destroy)(void*);
+	};
+
+	std::vector<char*> m_blocks;
+	std::vector<Destructor> m_destructors;
+	char *m_current, *m_end;
+	size_t m_bytes;
+
+	void* allocate(size_t, size_t);
 
-static const std::regex sphere(start + "sphere" + num + num + num + num + end);
-static const std::regex maxverts(start + "maxverts" + num + end);
-static const std::regex maxvertnorms(start + "maxvertnorms" + num + end);
-static const std::regex vertex(start + "vertex" + num + num + num + end);
-static const std::regex vertexnormal(start + "vertexnormal" + num + num + num + num + num + num + end);
-static const std::regex triangle(start + "tri" + num + num + num + end);
+public:
+	Arena();
 
-static const std::regex ambient(start + "ambient" + num + num + num + end);
-static const std::regex diffuse(start + "diffuse" + num + num + num + end);
-static const std::regex specular(start + "specular" + num + num + num + end);
-static const std::regex emission(start + "emission" + num + num + num + end);
-static const std::regex shininess(start + "shininess" + num + end);
+	Arena(const Arena&) = delete;
+	Arena& operator =(const Arena&) = delete;
 
-static const std::regex directional(start + "directional" + num + num + num + num + num + num + end);
-static const std::regex point(start + "point" + num + num + num + num + num + num + end);
-static const std::regex attenuation(start + "attenuation" + num + num + num + end);
+	Arena(Arena&&);
+	Arena& operator =(Arena&&);
 
-static const std::regex translate(start + "translate" + num + num + num + end);
-static const std::regex rotate(start + "rotate" + num + num + num + num + end);
-static const std::regex scale(start + "scale" + num + num + num + end);
-static const std::regex push(start + "pushTransform" + end);
-static const std::regex pop(start + "popTransform" + end);
+	~Arena();
+
+	template <typename T, typename... Args>
+	T* create(Args&&...);
+
+	void append(Arena&);
+	void clear();
+	size_t bytes() const;
+};
+
+template <typename T, typename... Args>
+T* Arena::create(Args&&... args)
+{
+	// Room for the destructor is made first, so recording it once the object exists can't throw.
+	// Growing by doubling keeps creating many objects linear.
+	if (!std::is_trivially_destructible<T>::value && m_destructors.size() == m_destructors.capacity())
+		m_destructors.reserve(std::max<size_t>(2 * m_destructors.capacity(), 16));
+
+	T *object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	if (!std::is_trivially_destructible<T>::value)
+		m_destructors.push_back(Destructor{ object, [](void *o) { static_cast<T*>(o)->~T(); } });
+
+	return object;
+}
+
+#pragma endregion
+
+#pragma region Mapped File
+
+/* -------------------------------------------------------------------------------------------------
+   Read only memory mapping of a whole file. The file's pages are read in by the operating system
+   as they're touched rather than copied up front, and stay mapped until the object is destroyed.
+   data is NULL if the file couldn't be opened or is empty.
+   -------------------------------------------------------------------------------------------------
+*/
+class MappedFile
+{
+private:
+	const char *m_data;
+	size_t m_size;
+#ifdef _WIN32
+	void *m_file, *m_mapping;
+#endif
+
+public:
+	MappedFile(const std::string&);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator =(const MappedFile&) = delete;
+
+	const char* data() const;
+	size_t size() const;
+};
+
+#pragma endregion
+
+#pragma region Array View
+
+/* -------------------------------------------------------------------------------------------------
+   Read only view of an array held elsewhere, such as a vector or a mapped file. Structures that can
+   be loaded from a cache trace through views, which point at their own vectors once built and
+   straight into the mapped cache once loaded, so a loaded structure's arrays are never copied.
+   A view doesn't own its array, which has to outlive it and not be reallocated while it's viewed.
+   -------------------------------------------------------------------------------------------------
+*/
+template <typename T>
+class ArrayView
+{
+private:
+	const T *m_data;
+	size_t m_size;
+
+public:
+	ArrayView();
+	ArrayView(const T*, size_t);
+	ArrayView(const std::vector<T>&);
+
+	const T& operator [](size_t) const;
+	const T* data() const;
+	size_t size() const;
+	bool empty() const;
+	const T* begin() const;
+	const T* end() const;
+};
+
+template <typename T>
+ArrayView<T>::ArrayView()
+	: m_data{ NULL }, m_size{ 0 }
+{
+
+}
+
+template <typename T>
+ArrayView<T>::ArrayView(const T *data, size_t size)
+	: m_data{ data }, m_size{ size }
+{
+
+}
+
+template <typename T>
+ArrayView<T>::ArrayView(const std::vector<T>& values)
+	: m_data{ values.data() }, m_size{ values.size() }
+{
+
+}
+
+template <typename T>
+inline const T& ArrayView<T>::operator [](size_t i) const
+{
+	return m_data[i];
+}
+
+template <typename T>
+inline const T* ArrayView<T>::data() const
+{
+	return m_data;
+}
+
+template <typename T>
+inline size_t ArrayView<T>::size() const
+{
+	return m_size;
+}
+
+template <typename T>
+inline bool ArrayView<T>::empty() const
+{
+	return m_size == 0;
+}
+
+template <typename T>
+inline const T* ArrayView<T>::begin() const
+{
+	return m_data;
+}
+
+template <typename T>
+inline const T* ArrayView<T>::end() const
+{
+	return m_data + m_size;
+}
 
 #pragma endregion
 
@@ -99,14 +322,9 @@ inline float roundBound(float d)
 	return (round(d * 1000) / 1000.0f);
 }
 
-inline float p(std::smatch m, int i) 
-{ 
-	return stof(m.str(i)); 
-}
-
 inline float toRad(float deg) 
 { 
-	return deg * M_PI / 180.0f; 
+	return deg * PI / 180.0f; 
 }
 
 #pragma endregion
@@ -122,6 +340,8 @@ struct Color
 	Color operator *(const Color& c) const;
 	Color operator *(float s) const;
 	Color operator /(float s) const;
+	bool operator ==(const Color& c) const;
+	bool operator !=(const Color& c) const;
 	void operator +=(Color c);
 	void operator *=(float s);
 	void operator /=(float s);
@@ -5,10 +5,15 @@
 
 #pragma once
 
+#ifdef _WIN32
 #include "targetver.h"
+#endif
 
 #include <stdio.h>
+
+#ifdef _WIN32
 #include <tchar.h>
+#endif
 
 
 